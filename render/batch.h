@@ -0,0 +1,210 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <cstdio>
+#include "math.h"
+#include "camera.h"
+#include "scene.h"
+#include "framebuffer.h"
+#include "scenefile.h"
+#include "capture.h"
+
+using namespace std;
+
+// Camera keyframes, one per line as <time in seconds> <x y z> <yaw> <pitch>. Poses in between
+// are interpolated linearly, before the first and after the last key the camera holds still
+class CameraPath {
+    struct Key {
+        float time;
+        Vec3d position;
+        float yaw;
+        float pitch;
+    };
+    vector<Key> keys;
+
+public:
+    string error;
+
+    bool load(const string& sFilename) {
+        ifstream f(sFilename);
+        if (!f.is_open()) {
+            error = "cannot open " + sFilename;
+            return false;
+        }
+
+        string line;
+        int lineNumber = 0;
+        while (getline(f, line)) {
+            lineNumber++;
+            line = line.substr(0, line.find('#'));
+            if (line.find_first_not_of(" \t\r") == string::npos)
+                continue;
+
+            istringstream s(line);
+            Key key;
+            if (!(s >> key.time >> key.position.x >> key.position.y >> key.position.z >> key.yaw >> key.pitch)) {
+                error = "line " + to_string(lineNumber) + ": expected <time> <x y z> <yaw> <pitch>";
+                return false;
+            }
+            if (!keys.empty() && key.time <= keys.back().time) {
+                error = "line " + to_string(lineNumber) + ": keyframe times have to increase";
+                return false;
+            }
+            keys.push_back(key);
+        }
+
+        if (keys.empty()) {
+            error = sFilename + " has no keyframes";
+            return false;
+        }
+        return true;
+    }
+
+    float duration() const {
+        return keys.empty() ? 0.0f : keys.back().time;
+    }
+
+    void apply(float time, Camera& camera) const {
+        size_t next = 0;
+        while (next < keys.size() && keys[next].time < time)
+            next++;
+
+        const Key& b = keys[min(next, keys.size() - 1)];
+        const Key& a = keys[next > 0 ? next - 1 : 0];
+        float blend = b.time > a.time ? min(max((time - a.time) / (b.time - a.time), 0.0f), 1.0f) : 0.0f;
+
+        camera.vCameraPosition = a.position * (1.0f - blend) + b.position * blend;
+        camera.fYaw = a.yaw + (b.yaw - a.yaw) * blend;
+        camera.fPitch = a.pitch + (b.pitch - a.pitch) * blend;
+    }
+};
+
+struct BatchSettings {
+    string scenePath;
+    string cameraPath;
+    string outputPrefix;
+    CaptureFormat format = CaptureFormat::PNG;
+    int width = 1280;
+    int height = 720;
+    float framesPerSecond = 30.0f;
+    float fov = 60.0f;
+    int threads = 0; // 0 for one per hardware thread
+    bool rayTraced = false;
+};
+
+// Renders every frame of a camera path without a window and writes <prefix>_000000.<ext> images.
+// Frames are independent, so whole frames go to the workers: each has its own renderer and
+// framebuffer and pulls short runs of consecutive frames, which keeps its caches and shadow
+// cascades useful from one frame to the next
+class BatchRender {
+    static const int framesPerRun = 8;
+
+    BatchSettings settings;
+
+public:
+    BatchRender(const BatchSettings& settings) : settings(settings) {}
+
+    // Process exit code
+    int run() {
+        if (settings.format == CaptureFormat::Y4M) {
+            printf("Batch output is an image sequence, ppm or png\n");
+            return 1;
+        }
+
+        Scene scene;
+        SceneFile sceneFile;
+        if (!sceneFile.load(settings.scenePath, scene)) {
+            printf("%s: %s\n", settings.scenePath.c_str(), sceneFile.error.c_str());
+            return 1;
+        }
+
+        CameraPath path;
+        if (!path.load(settings.cameraPath)) {
+            printf("%s: %s\n", settings.cameraPath.c_str(), path.error.c_str());
+            return 1;
+        }
+
+        // Farm jobs usually point into a fresh directory per shot
+        filesystem::path outputDirectory = filesystem::path(settings.outputPrefix).parent_path();
+        error_code ignored;
+        if (!outputDirectory.empty())
+            filesystem::create_directories(outputDirectory, ignored);
+
+        // The workers only read the scene, settle everything it builds lazily before they start
+        scene.updateTransforms();
+        scene.getBatches();
+
+        int frameCount = (int)(path.duration() * settings.framesPerSecond) + 1;
+        int threads = settings.threads > 0 ? settings.threads : max(1, (int)thread::hardware_concurrency());
+        threads = min(threads, (frameCount + framesPerRun - 1) / framesPerRun);
+
+        atomic<int> nextRun{ 0 };
+        atomic<int> finished{ 0 };
+        atomic<int> failed{ 0 };
+
+        auto work = [&]() {
+            Renderer3d renderer(settings.fov, (float)settings.width, (float)settings.height, scene);
+            renderer.setLightDirection(sceneFile.sunDirection);
+            if (threads > 1)
+                renderer.setTraceThreads(1);
+
+            Framebuffer image(settings.width, settings.height);
+            for (int run = nextRun++; run * framesPerRun < frameCount; run = nextRun++) {
+                for (int frame = run * framesPerRun; frame < min((run + 1) * framesPerRun, frameCount); frame++) {
+                    path.apply(frame / settings.framesPerSecond, renderer.camera);
+
+                    if (settings.rayTraced)
+                        renderer.traceTo(image);
+                    else
+                        renderer.renderTo(image);
+
+                    if (!save(image, frame))
+                        failed++;
+                    finished++;
+                }
+            }
+        };
+
+        printf("Rendering %d frame(s) at %dx%d on %d thread(s)\n", frameCount, settings.width, settings.height, threads);
+        auto start = chrono::steady_clock::now();
+
+        vector<future<void>> jobs;
+        for (int i = 0; i < threads; i++)
+            jobs.push_back(async(launch::async, work));
+
+        for (auto& job : jobs) {
+            while (job.wait_for(chrono::seconds(1)) != future_status::ready)
+                reportProgress(finished, frameCount, start);
+        }
+        reportProgress(finished, frameCount, start);
+
+        if (failed > 0) {
+            printf("%d frame(s) could not be written to %s\n", (int)failed, settings.outputPrefix.c_str());
+            return 1;
+        }
+        return 0;
+    }
+
+private:
+    bool save(const Framebuffer& image, int frame) const {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%06d.", frame);
+        string name = settings.outputPrefix + suffix;
+        return settings.format == CaptureFormat::PPM ? image.savePPM(name + "ppm") : image.savePNG(name + "png");
+    }
+
+    static void reportProgress(int finished, int frameCount, chrono::steady_clock::time_point start) {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double rate = finished / max(seconds, 1e-6);
+        double left = rate > 0.0 ? (frameCount - finished) / rate : 0.0;
+        printf("%d/%d frames, %.1f frames/s, %.0f s left\n", finished, frameCount, rate, left);
+        fflush(stdout);
+    }
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <initializer_list>
+#include "math.h"
+#include "cpu.h"
+
+using namespace std;
+
+// Refers to a body in a BodyStore. Bodies change slots as they fall asleep, wake up and as others
+// are removed, the handle stays the same. A removed body's index is reused with a new generation,
+// so an old handle is recognized as stale instead of reaching someone else's body
+struct BodyHandle {
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+};
+
+// Rigid body state kept as one array per component, so integrating walks only the floats it needs
+// and does eight bodies per step. Awake bodies fill the front of the arrays and sleeping ones the
+// back, a tick never looks at a sleeping body
+class BodyStore {
+public:
+    // A body slower than sleepSpeed for sleepTicks ticks in a row falls asleep, it stops being
+    // integrated until woken
+    static constexpr float sleepSpeed = 0.01f;
+    static const int sleepTicks = 30;
+
+private:
+    enum : uint8_t { collidableFlag = 1 };
+
+    // Per slot
+    vector<float> x, y, z;
+    vector<float> velocityX, velocityY, velocityZ;
+    vector<float> placedX, placedY, placedZ; // Where the body was when it was last placed in the scene
+    vector<float> stillTicks;                // Float so the count stays in the registers the speeds are in
+    vector<uint8_t> flags;
+    vector<uint32_t> owners;                 // Handle index of the body in each slot
+    size_t awakeCount = 0;
+
+    // Per handle index
+    vector<uint32_t> slots;
+    vector<uint32_t> generations;
+    vector<uint32_t> freeIndices;
+
+    // Slots that reached sleepTicks during the last integrate
+    vector<size_t> tired;
+
+public:
+    static CpuPath getPath() {
+        return activePath();
+    }
+
+    // Pin a slower path than the CPU supports, e.g. to compare them
+    static void setPath(CpuPath path) {
+        activePath() = min(path, Cpu::getPath());
+    }
+
+    BodyHandle create(const Vec3d& position, const Vec3d& velocity = { 0.0f, 0.0f, 0.0f }) {
+        BodyHandle handle;
+        if (!freeIndices.empty()) {
+            handle.index = freeIndices.back();
+            freeIndices.pop_back();
+        }
+        else {
+            handle.index = (uint32_t)slots.size();
+            slots.push_back(0);
+            generations.push_back(0);
+        }
+        handle.generation = generations[handle.index];
+
+        size_t slot = x.size();
+        x.push_back(position.x); y.push_back(position.y); z.push_back(position.z);
+        velocityX.push_back(velocity.x); velocityY.push_back(velocity.y); velocityZ.push_back(velocity.z);
+        placedX.push_back(position.x); placedY.push_back(position.y); placedZ.push_back(position.z);
+        stillTicks.push_back(0.0f);
+        flags.push_back(collidableFlag);
+        owners.push_back(handle.index);
+        slots[handle.index] = (uint32_t)slot;
+
+        // New bodies start awake
+        swapSlots(slot, awakeCount++);
+        return handle;
+    }
+
+    void remove(BodyHandle handle) {
+        if (!isValid(handle))
+            return;
+
+        // Out of the awake part first, then to the very end
+        size_t slot = slots[handle.index];
+        if (slot < awakeCount) {
+            size_t lastAwake = --awakeCount;
+            swapSlots(slot, lastAwake);
+            slot = lastAwake;
+        }
+        swapSlots(slot, x.size() - 1);
+
+        for (auto* component : { &x, &y, &z, &velocityX, &velocityY, &velocityZ, &placedX, &placedY, &placedZ, &stillTicks })
+            component->pop_back();
+        flags.pop_back();
+        owners.pop_back();
+
+        generations[handle.index]++;
+        freeIndices.push_back(handle.index);
+    }
+
+    bool isValid(BodyHandle handle) const {
+        return handle.index < slots.size() && generations[handle.index] == handle.generation;
+    }
+
+    size_t size() const {
+        return x.size();
+    }
+
+    size_t getAwakeCount() const {
+        return awakeCount;
+    }
+
+    Vec3d getPosition(BodyHandle handle) const {
+        size_t slot = slots[handle.index];
+        return Vec3d(x[slot], y[slot], z[slot]);
+    }
+
+    void setPosition(BodyHandle handle, const Vec3d& position) {
+        size_t slot = slots[handle.index];
+        x[slot] = position.x;
+        y[slot] = position.y;
+        z[slot] = position.z;
+    }
+
+    Vec3d getVelocity(BodyHandle handle) const {
+        size_t slot = slots[handle.index];
+        return Vec3d(velocityX[slot], velocityY[slot], velocityZ[slot], 0.0f);
+    }
+
+    // Does not wake the body, see wake
+    void setVelocity(BodyHandle handle, const Vec3d& velocity) {
+        size_t slot = slots[handle.index];
+        velocityX[slot] = velocity.x;
+        velocityY[slot] = velocity.y;
+        velocityZ[slot] = velocity.z;
+    }
+
+    // Whether the body moved since markPlaced
+    bool hasMoved(BodyHandle handle) const {
+        size_t slot = slots[handle.index];
+        return x[slot] != placedX[slot] || y[slot] != placedY[slot] || z[slot] != placedZ[slot];
+    }
+
+    void markPlaced(BodyHandle handle) {
+        size_t slot = slots[handle.index];
+        placedX[slot] = x[slot];
+        placedY[slot] = y[slot];
+        placedZ[slot] = z[slot];
+    }
+
+    bool isCollidable(BodyHandle handle) const {
+        return (flags[slots[handle.index]] & collidableFlag) != 0;
+    }
+
+    void setCollidable(BodyHandle handle, bool collidable) {
+        uint8_t& f = flags[slots[handle.index]];
+        f = collidable ? f | collidableFlag : f & ~collidableFlag;
+    }
+
+    bool isAsleep(BodyHandle handle) const {
+        return slots[handle.index] >= awakeCount;
+    }
+
+    // Back to being integrated, also restarts the count toward sleeping
+    void wake(BodyHandle handle) {
+        size_t slot = slots[handle.index];
+        stillTicks[slot] = 0.0f;
+        if (slot >= awakeCount)
+            swapSlots(slot, awakeCount++);
+    }
+
+    void sleep(BodyHandle handle) {
+        size_t slot = slots[handle.index];
+        if (slot >= awakeCount)
+            return;
+
+        velocityX[slot] = velocityY[slot] = velocityZ[slot] = 0.0f;
+        swapSlots(slot, --awakeCount);
+    }
+
+    // One tick for every awake body: gravity pulls the velocity down, the velocity moves the position,
+    // and bodies that stayed slow long enough fall asleep
+    void integrate(float gravity) {
+        tired.clear();
+
+        size_t done = 0;
+#ifdef CPU_X86
+        if (getPath() == CpuPath::AVX2)
+            done = integrateAVX2(gravity);
+#endif
+#ifdef MATH_SSE
+        if (getPath() != CpuPath::Scalar)
+            done += integrateSSE(done, gravity);
+#endif
+        integrateScalar(done, gravity);
+
+        // Highest first, a slot swapped to the back is then never one still waiting here
+        for (size_t i = tired.size(); i-- > 0;) {
+            size_t slot = tired[i];
+            velocityX[slot] = velocityY[slot] = velocityZ[slot] = 0.0f;
+            swapSlots(slot, --awakeCount);
+        }
+    }
+
+private:
+    static CpuPath& activePath() {
+        static CpuPath path = Cpu::getPath();
+        return path;
+    }
+
+    void swapSlots(size_t a, size_t b) {
+        if (a == b)
+            return;
+
+        for (auto* component : { &x, &y, &z, &velocityX, &velocityY, &velocityZ, &placedX, &placedY, &placedZ, &stillTicks })
+            swap((*component)[a], (*component)[b]);
+        swap(flags[a], flags[b]);
+        swap(owners[a], owners[b]);
+        slots[owners[a]] = (uint32_t)a;
+        slots[owners[b]] = (uint32_t)b;
+    }
+
+    void integrateScalar(size_t first, float gravity) {
+        for (size_t i = first; i < awakeCount; i++) {
+            velocityY[i] -= gravity;
+            x[i] += velocityX[i];
+            y[i] += velocityY[i];
+            z[i] += velocityZ[i];
+
+            float speed = velocityX[i] * velocityX[i] + velocityY[i] * velocityY[i] + velocityZ[i] * velocityZ[i];
+            stillTicks[i] = speed < sleepSpeed * sleepSpeed ? stillTicks[i] + 1.0f : 0.0f;
+            if (stillTicks[i] >= sleepTicks)
+                tired.push_back(i);
+        }
+    }
+
+#ifdef MATH_SSE
+    // Four bodies per step from first, returns how many it did
+    size_t integrateSSE(size_t first, float gravity) {
+        size_t count = (awakeCount - first) & ~(size_t)3;
+        __m128 pull = _mm_set1_ps(gravity);
+        __m128 slow = _mm_set1_ps(sleepSpeed * sleepSpeed);
+        __m128 one = _mm_set1_ps(1.0f);
+        __m128 limit = _mm_set1_ps((float)sleepTicks);
+
+        for (size_t i = first; i < first + count; i += 4) {
+            __m128 vx = _mm_loadu_ps(&velocityX[i]);
+            __m128 vy = _mm_sub_ps(_mm_loadu_ps(&velocityY[i]), pull);
+            __m128 vz = _mm_loadu_ps(&velocityZ[i]);
+            _mm_storeu_ps(&velocityY[i], vy);
+
+            _mm_storeu_ps(&x[i], _mm_add_ps(_mm_loadu_ps(&x[i]), vx));
+            _mm_storeu_ps(&y[i], _mm_add_ps(_mm_loadu_ps(&y[i]), vy));
+            _mm_storeu_ps(&z[i], _mm_add_ps(_mm_loadu_ps(&z[i]), vz));
+
+            // Adding one and masking with the comparison counts slow ticks and resets on fast ones
+            __m128 speed = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz));
+            __m128 still = _mm_and_ps(_mm_add_ps(_mm_loadu_ps(&stillTicks[i]), one), _mm_cmplt_ps(speed, slow));
+            _mm_storeu_ps(&stillTicks[i], still);
+
+            int lanes = _mm_movemask_ps(_mm_cmpge_ps(still, limit));
+            for (int lane = 0; lanes; lane++, lanes >>= 1) {
+                if (lanes & 1)
+                    tired.push_back(i + lane);
+            }
+        }
+        return count;
+    }
+#endif
+
+#ifdef CPU_X86
+    // Eight bodies per step from the first slot, returns how many it did
+    CPU_TARGET_AVX2 size_t integrateAVX2(float gravity) {
+        size_t count = awakeCount & ~(size_t)7;
+        __m256 pull = _mm256_set1_ps(gravity);
+        __m256 slow = _mm256_set1_ps(sleepSpeed * sleepSpeed);
+        __m256 one = _mm256_set1_ps(1.0f);
+        __m256 limit = _mm256_set1_ps((float)sleepTicks);
+
+        for (size_t i = 0; i < count; i += 8) {
+            __m256 vx = _mm256_loadu_ps(&velocityX[i]);
+            __m256 vy = _mm256_sub_ps(_mm256_loadu_ps(&velocityY[i]), pull);
+            __m256 vz = _mm256_loadu_ps(&velocityZ[i]);
+            _mm256_storeu_ps(&velocityY[i], vy);
+
+            _mm256_storeu_ps(&x[i], _mm256_add_ps(_mm256_loadu_ps(&x[i]), vx));
+            _mm256_storeu_ps(&y[i], _mm256_add_ps(_mm256_loadu_ps(&y[i]), vy));
+            _mm256_storeu_ps(&z[i], _mm256_add_ps(_mm256_loadu_ps(&z[i]), vz));
+
+            __m256 speed = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)), _mm256_mul_ps(vz, vz));
+            __m256 still = _mm256_and_ps(_mm256_add_ps(_mm256_loadu_ps(&stillTicks[i]), one), _mm256_cmp_ps(speed, slow, _CMP_LT_OQ));
+            _mm256_storeu_ps(&stillTicks[i], still);
+
+            int lanes = _mm256_movemask_ps(_mm256_cmp_ps(still, limit, _CMP_GE_OQ));
+            for (int lane = 0; lanes; lane++, lanes >>= 1) {
+                if (lanes & 1)
+                    tired.push_back(i + lane);
+            }
+        }
+        return count;
+    }
+#endif
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <stdio.h>
+#include "scene.h"
+#include "bodies.h"
+
+using namespace std;
+
+// Integrates a large number of free flying bodies per tick, once laid out one object per body the
+// way PhysicsObject used to hold its state, then through BodyStore on every path the CPU has.
+// Also checks that bodies resting against each other fall asleep, and that a scripted scene with
+// bodies in contact plays out the same on every path. Include after renderer3d.cpp
+class BodyBenchmark {
+    size_t count;
+    int ticks = 20;
+    float gravity = 0.001f;
+
+    // What a body carried before the state moved to BodyStore
+    struct ObjectBody {
+        Scene* scene;
+        size_t instance;
+        MeshRef collidingMesh;
+        Vec3d previousPosition;
+        Vec3d position;
+        Vec3d velocity = { 0,0,0 };
+        bool collidable = true;
+        bool invisible = false;
+        bool asleep = false;
+        int stillTicks = 0;
+    };
+
+public:
+    BodyBenchmark(size_t count) : count(count) {}
+
+    int run() {
+        printf("%zu bodies, %d ticks\n", count, ticks);
+
+        vector<Vec3d> expected;
+        double objectMs = runObjects(expected);
+        printf("%-10s %8.3f ms per tick %8.1f M bodies/s  (%zu bytes per body)\n", "objects", objectMs, count / objectMs / 1000.0, sizeof(ObjectBody));
+
+        const char* names[] = { "scalar", "SSE", "AVX2" };
+        CpuPath best = BodyStore::getPath();
+        bool same = true;
+        for (int path = 0; path <= (int)best; path++) {
+            BodyStore::setPath((CpuPath)path);
+
+            BodyStore bodies;
+            vector<BodyHandle> handles;
+            double ms = runStore(bodies, handles);
+            printf("%-10s %8.3f ms per tick %8.1f M bodies/s  %.2fx\n", names[path], ms, count / ms / 1000.0, objectMs / ms);
+
+            for (size_t i = 0; i < count && same; i++) {
+                Vec3d p = bodies.getPosition(handles[i]);
+                same = p.x == expected[i].x && p.y == expected[i].y && p.z == expected[i].z;
+            }
+        }
+        if (!same)
+            printf("Positions differ between the layouts\n");
+
+        vector<float> reference;
+        bool scriptedSame = true;
+        for (int path = 0; path <= (int)best; path++) {
+            BodyStore::setPath((CpuPath)path);
+            vector<float> states = runScripted();
+            if (path == 0)
+                reference = states;
+            else if (states != reference) {
+                printf("The scripted scene plays out differently on %s\n", names[path]);
+                scriptedSame = false;
+            }
+        }
+        BodyStore::setPath(best);
+        if (scriptedSame)
+            printf("Scripted scene of 50 bodies in contact plays out the same on every path\n");
+        same = same && scriptedSame;
+
+        return same && checkContacts() ? 0 : 1;
+    }
+
+private:
+    // Fixed generator so every layout starts from the same bodies, all fast enough to stay awake
+    static void start(size_t i, Vec3d& position, Vec3d& velocity) {
+        uint32_t seed = (uint32_t)i * 2654435761u + 1u;
+        auto random = [&seed]() {
+            seed = seed * 1664525u + 1013904223u;
+            return (seed >> 8) * (1.0f / 16777216.0f);
+        };
+
+        position = { random() * 100.0f, random() * 100.0f, random() * 100.0f };
+        velocity = { random() - 0.5f, random() * 0.5f + 0.1f, random() - 0.5f, 0.0f };
+    }
+
+    double runObjects(vector<Vec3d>& positions) {
+        vector<ObjectBody> objects(count);
+        for (size_t i = 0; i < count; i++) {
+            start(i, objects[i].position, objects[i].velocity);
+            objects[i].previousPosition = objects[i].position;
+        }
+
+        double ms = time([&]() {
+            for (auto& body : objects) {
+                if (body.asleep)
+                    continue;
+
+                body.velocity.y -= gravity;
+                body.position = body.position + body.velocity;
+                body.previousPosition = body.position;
+
+                if (body.velocity.dot(body.velocity) < BodyStore::sleepSpeed * BodyStore::sleepSpeed) {
+                    if (++body.stillTicks >= BodyStore::sleepTicks) {
+                        body.asleep = true;
+                        body.velocity = { 0,0,0 };
+                    }
+                }
+                else {
+                    body.stillTicks = 0;
+                }
+            }
+        });
+
+        positions.resize(count);
+        for (size_t i = 0; i < count; i++)
+            positions[i] = objects[i].position;
+        return ms;
+    }
+
+    // A row of cubes at rest, each touching the next. They have to fall asleep together, and a push
+    // at the end of the row has to wake the rest
+    static bool checkContacts() {
+        const int cubes = 8;
+
+        Scene scene;
+        Mesh cube;
+        cube.createCubeoid({ -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f });
+        MeshRef cubeRef = scene.addMesh(cube);
+
+        vector<PhysicsObject> objects;
+        objects.reserve(cubes);
+        Physics3d physics(scene, objects);
+        for (int i = 0; i < cubes; i++)
+            physics.addPhysicsObject(scene.addInstance(cubeRef), { (float)i, 0.0f, 0.0f });
+
+        for (int t = 0; t <= BodyStore::sleepTicks; t++)
+            physics.update();
+        physics.update();
+        size_t restingAwake = physics.getAwakeCount();
+
+        objects.back().setVelocity({ -0.5f, 0.0f, 0.0f });
+        physics.update();
+        physics.update();
+        size_t pushedAwake = physics.getAwakeCount();
+
+        bool asleep = restingAwake == 0, woken = pushedAwake == cubes;
+        printf("%d touching cubes: %zu awake after %d ticks at rest, %zu after a push\n", cubes, restingAwake, BodyStore::sleepTicks + 2, pushedAwake);
+        if (!asleep)
+            printf("Resting bodies in contact kept each other awake\n");
+        if (!woken)
+            printf("A pushed body did not wake the ones it touches\n");
+        return asleep && woken;
+    }
+
+    // 50 bodies for 120 ticks: rows of touching cubes at rest, scattered single ones, and pushes into
+    // rows part way through. Returns position, velocity and sleep state of every body after every tick
+    static vector<float> runScripted() {
+        Scene scene;
+        Mesh cube;
+        cube.createCubeoid({ -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f });
+        MeshRef cubeRef = scene.addMesh(cube);
+
+        vector<PhysicsObject> objects;
+        objects.reserve(50);
+        Physics3d physics(scene, objects);
+        auto add = [&](float x, float y, float z) { physics.addPhysicsObject(scene.addInstance(cubeRef), { x, y, z }); };
+        for (int row = 0; row < 5; row++)
+            for (int i = 0; i < 6; i++) add((float)i, row * 20.0f, 0.0f);
+        for (int i = 0; i < 10; i++) add(100.0f + i * 5.0f, 0.0f, 0.0f);
+        for (int i = 0; i < 10; i++) add(i * 0.9f, 0.0f, 50.0f + (i / 5) * 20.0f);
+
+        objects[30].setVelocity({ 0.3f, 0.0f, 0.0f });
+        objects[31].setVelocity({ 0.0f, 0.02f, 0.01f });
+        objects[40].setVelocity({ 0.004f, 0.0f, 0.0f });
+        objects[45].setVelocity({ -0.4f, 0.1f, 0.0f });
+
+        vector<float> states;
+        for (int t = 0; t < 120; t++) {
+            if (t == 60) {
+                objects[12].setVelocity({ 0.2f, 0.0f, 0.0f });
+                objects[20].addGravity();
+            }
+            physics.update();
+
+            for (auto& object : objects) {
+                Vec3d p = object.getPosition(), v = object.getVelocity();
+                states.insert(states.end(), { p.x, p.y, p.z, v.x, v.y, v.z, object.isAsleep() ? 1.0f : 0.0f });
+            }
+        }
+        return states;
+    }
+
+    double runStore(BodyStore& bodies, vector<BodyHandle>& handles) {
+        handles.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            Vec3d position, velocity;
+            start(i, position, velocity);
+            handles[i] = bodies.create(position, velocity);
+        }
+
+        return time([&]() { bodies.integrate(gravity); });
+    }
+
+    // Mean time of a tick over all ticks
+    template <typename F>
+    double time(F tick) {
+        auto start = chrono::steady_clock::now();
+        for (int t = 0; t < ticks; t++)
+            tick();
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / ticks;
+    }
+};
@@ -25,4 +25,29 @@ public:
 		fYaw = 0.0f;
 		fPitch = 0.0f;
 	}
+
+	// True when the pose changed since the renderer last built its view from it,
+	// also catches the fields being written directly
+	bool isDirty() const {
+		return dirty
+			|| vCameraPosition.x != lastPosition.x || vCameraPosition.y != lastPosition.y || vCameraPosition.z != lastPosition.z
+			|| fYaw != lastYaw || fPitch != lastPitch;
+	}
+
+	void markDirty() {
+		dirty = true;
+	}
+
+	void clearDirty() {
+		lastPosition = vCameraPosition;
+		lastYaw = fYaw;
+		lastPitch = fPitch;
+		dirty = false;
+	}
+
+private:
+	Vec3d lastPosition;
+	float lastYaw = 0.0f;
+	float lastPitch = 0.0f;
+	bool dirty = true;
 };
\ No newline at end of file
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include "framebuffer.h"
+
+using namespace std;
+
+enum class CaptureFormat { PPM, PNG, Y4M };
+
+// Streams finished frames to disk on a writer thread. Frames pass through a fixed ring of buffers
+// allocated up front: the render thread fills a free slot and moves on, and when the writer has
+// fallen so far behind that no slot is free the frame is dropped and counted instead of waited for.
+// Image sequences are named <path>_000000.<ext> after the frame number, so drops show up as gaps.
+// Y4M writes every frame into the single file <path> as 4:2:0 full range video
+class FrameCapture {
+public:
+    struct Stats {
+        uint64_t written = 0;
+        uint64_t dropped = 0;
+        bool failed = false; // A write went wrong, nothing after it was written
+    };
+
+private:
+    struct Slot {
+        Framebuffer frame;
+        uint64_t number = 0;
+        bool bottomUp = false;
+    };
+
+    string path;
+    CaptureFormat format;
+
+    vector<Slot> slots;
+    size_t head = 0; // Next slot the render thread fills, only touched by it
+    size_t tail = 0; // Next slot the writer stores, only touched by it
+
+    // Held just long enough to count, never while a frame is copied or written
+    mutex lock;
+    condition_variable wake;
+    size_t queued = 0;
+    bool stopping = false;
+
+    atomic<uint64_t> frames{ 0 };
+    atomic<uint64_t> written{ 0 };
+    atomic<uint64_t> dropped{ 0 };
+    atomic<bool> failed{ false };
+
+    ofstream stream;
+    vector<uint8_t> planes;
+    thread writer;
+
+public:
+    FrameCapture(const string& path, CaptureFormat format, int width, int height, int framesPerSecond = 60, size_t slotCount = 4)
+        : path(path), format(format), slots(slotCount) {
+        for (auto& slot : slots)
+            slot.frame.resizeColor(width, height);
+
+        if (format == CaptureFormat::Y4M) {
+            stream.open(path, ios::binary);
+            stream << "YUV4MPEG2 W" << width << " H" << height << " F" << framesPerSecond << ":1 Ip A1:1 C420jpeg\n";
+            failed = !stream.good();
+        }
+
+        writer = thread([this]() { run(); });
+    }
+
+    ~FrameCapture() {
+        stop();
+    }
+
+    // Free buffer for the next frame at the capture size, or nullptr when the writer is behind and
+    // the frame is dropped. A buffer that was handed out has to be submitted before the next acquire
+    Framebuffer* acquire() {
+        uint64_t number = frames++;
+        {
+            lock_guard<mutex> guard(lock);
+            if (queued == slots.size()) {
+                dropped++;
+                return nullptr;
+            }
+        }
+
+        slots[head].number = number;
+        return &slots[head].frame;
+    }
+
+    // Queue the acquired buffer, bottomUp for rows read back from GL
+    void submit(bool bottomUp = false) {
+        slots[head].bottomUp = bottomUp;
+        head = (head + 1) % slots.size();
+        {
+            lock_guard<mutex> guard(lock);
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    // Writes out what is still queued and closes the capture
+    void stop() {
+        if (!writer.joinable())
+            return;
+
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+        stream.close();
+    }
+
+    Stats getStats() const {
+        Stats stats;
+        stats.written = written;
+        stats.dropped = dropped;
+        stats.failed = failed;
+        return stats;
+    }
+
+private:
+    void run() {
+        while (true) {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [this]() { return queued > 0 || stopping; });
+                if (queued == 0)
+                    return;
+            }
+
+            Slot& slot = slots[tail];
+            if (!failed) {
+                if (write(slot))
+                    written++;
+                else
+                    failed = true;
+            }
+            tail = (tail + 1) % slots.size();
+
+            lock_guard<mutex> guard(lock);
+            queued--;
+        }
+    }
+
+    bool write(Slot& slot) {
+        if (slot.bottomUp)
+            slot.frame.flipRows();
+
+        switch (format) {
+        case CaptureFormat::PPM:
+            return slot.frame.savePPM(sequenceName(slot.number, "ppm"));
+        case CaptureFormat::PNG:
+            return slot.frame.savePNG(sequenceName(slot.number, "png"));
+        case CaptureFormat::Y4M:
+            return writeY4M(slot.frame);
+        }
+        return false;
+    }
+
+    string sequenceName(uint64_t number, const char* extension) const {
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%06llu.", (unsigned long long)number);
+        return path + suffix + extension;
+    }
+
+    // JPEG style BT.601 in fixed point, chroma averaged over 2x2 pixels with the last row and column repeated
+    bool writeY4M(const Framebuffer& frame) {
+        int width = frame.width, height = frame.height;
+        int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+        size_t lumaSize = (size_t)width * height, chromaSize = (size_t)chromaWidth * chromaHeight;
+        planes.resize(lumaSize + chromaSize * 2);
+
+        uint8_t* luma = planes.data();
+        uint8_t* cb = luma + lumaSize;
+        uint8_t* cr = cb + chromaSize;
+
+        for (size_t i = 0; i < lumaSize; i++) {
+            uint32_t c = frame.color[i];
+            int r = c & 0xFF, g = (c >> 8) & 0xFF, b = (c >> 16) & 0xFF;
+            luma[i] = (uint8_t)((19595 * r + 38470 * g + 7471 * b + 32768) >> 16);
+        }
+
+        for (int cy = 0; cy < chromaHeight; cy++) {
+            for (int cx = 0; cx < chromaWidth; cx++) {
+                int r = 0, g = 0, b = 0;
+                for (int k = 0; k < 4; k++) {
+                    int x = min(cx * 2 + (k & 1), width - 1), y = min(cy * 2 + (k >> 1), height - 1);
+                    uint32_t c = frame.color[(size_t)y * width + x];
+                    r += c & 0xFF;
+                    g += (c >> 8) & 0xFF;
+                    b += (c >> 16) & 0xFF;
+                }
+
+                // Sums of four pixels, so the shift is two bits wider
+                size_t i = (size_t)cy * chromaWidth + cx;
+                cb[i] = (uint8_t)min(max((-11059 * r - 21709 * g + 32768 * b + (128 << 18) + (1 << 17)) >> 18, 0), 255);
+                cr[i] = (uint8_t)min(max((32768 * r - 27439 * g - 5329 * b + (128 << 18) + (1 << 17)) >> 18, 0), 255);
+            }
+        }
+
+        stream << "FRAME\n";
+        stream.write((const char*)planes.data(), planes.size());
+        return stream.good();
+    }
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define CPU_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CPU_TARGET_AVX2
+#else
+#define CPU_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace std;
+
+// Widest vector instructions a loop can use. Code for a wider path is only compiled on x86 and
+// only run when the CPU has it, see Cpu::getPath
+enum class CpuPath { Scalar, SSE2, AVX2 };
+
+// What the processor running us supports, looked up once
+class Cpu {
+public:
+    static CpuPath getPath() {
+        static CpuPath path = detectPath();
+        return path;
+    }
+
+private:
+    static CpuPath detectPath() {
+#if defined(CPU_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        int maxLeaf = info[0];
+
+        __cpuid(info, 1);
+        bool sse2 = (info[3] & (1 << 26)) != 0;
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+
+        bool avx2 = false;
+        if (maxLeaf >= 7 && osxsave && avx) {
+            __cpuidex(info, 7, 0);
+            // The OS also has to save the upper halves of the ymm registers
+            avx2 = (info[1] & (1 << 5)) != 0 && (_xgetbv(0) & 6) == 6;
+        }
+
+        return avx2 ? CpuPath::AVX2 : sse2 ? CpuPath::SSE2 : CpuPath::Scalar;
+#elif defined(CPU_X86)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? CpuPath::AVX2 : __builtin_cpu_supports("sse2") ? CpuPath::SSE2 : CpuPath::Scalar;
+#else
+        return CpuPath::Scalar;
+#endif
+    }
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+using namespace std;
+
+// Bounded ring for exactly one producer and one consumer thread, without locks. The producer
+// only writes head and the consumer only writes tail, each publishes with a release store that
+// the other side acquires, so an item is complete before it can be seen
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity has to be a power of two");
+
+    static const size_t cacheLine = 64;
+
+    T items[Capacity];
+
+    // A cache line of padding on each side keeps the two counters off each other's lines and off the
+    // items'. Padding rather than alignas, so the queue needs no over-aligned new where it is a member
+    char beforeHead[cacheLine];
+    atomic<size_t> head{ 0 };
+    char beforeTail[cacheLine - sizeof(atomic<size_t>)];
+    atomic<size_t> tail{ 0 };
+    char afterTail[cacheLine - sizeof(atomic<size_t>)];
+
+public:
+    // Producer only, false when the queue is full and the item was not added
+    bool push(const T& item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h - tail.load(memory_order_acquire) == Capacity)
+            return false;
+
+        items[h & (Capacity - 1)] = item;
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer only, false when there is nothing to take
+    bool pop(T& item) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t == head.load(memory_order_acquire))
+            return false;
+
+        item = items[t & (Capacity - 1)];
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+};
@@ -12,12 +12,23 @@ public:
 	int nbFrames;
 	float fps;
 
+	// Input to present latency of the frames drawn in the current second
+	double latencySum = 0.0;
+	double latencyMax = 0.0;
+	int latencySamples = 0;
+
 	Fps() {
 		lastTime = glfwGetTime();
 		nbFrames = 0;
 		fps = 0.0f;
 	}
 
+	void addInputLatency(double seconds) {
+		latencySum += seconds;
+		latencyMax = seconds > latencyMax ? seconds : latencyMax;
+		latencySamples++;
+	}
+
 	void update() {
 		currentTime = glfwGetTime();
 		nbFrames++;
@@ -25,7 +36,13 @@ public:
 			if (printFPS) {
 				printf("%f ms/frame |", 1000.0 / double(nbFrames));
 				printf("%f fps\n", (float)nbFrames);
+				if (latencySamples > 0) {
+					printf("%f ms input to present, %f ms worst\n", 1000.0 * latencySum / latencySamples, 1000.0 * latencyMax);
+				}
 			}
+			latencySum = 0.0;
+			latencyMax = 0.0;
+			latencySamples = 0;
 			fps = float(nbFrames);
 			nbFrames = 0;
 			lastTime += 1.0;
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <cstdlib>
+#include "math.h"
+
+using namespace std;
+
+// Difference between two images, channels are compared in 0..255 units
+struct ImageDiff {
+    int differingPixels = 0;
+    int maxChannelDelta = 0;
+    double meanChannelDelta = 0.0;
+    bool sizeMismatch = false;
+};
+
+// Software render target with a color and a depth plane. Rows are stored top to bottom and
+// colors as R,G,B,A bytes, so the buffer can be written out or handed to glDrawPixels as is
+class Framebuffer {
+public:
+    int width = 0;
+    int height = 0;
+
+    vector<uint32_t> color;
+    vector<float> depth;
+
+    Framebuffer() = default;
+
+    Framebuffer(int width, int height) {
+        resize(width, height);
+    }
+
+    void resize(int width, int height) {
+        this->width = width;
+        this->height = height;
+        color.assign((size_t)width * height, packColor({ 0.0f, 0.0f, 0.0f }));
+        depth.assign((size_t)width * height, 1.0f);
+    }
+
+    // Depth plane only, for passes like shadow maps that never look at color
+    void resizeDepth(int width, int height) {
+        this->width = width;
+        this->height = height;
+        color.clear();
+        depth.assign((size_t)width * height, 1.0f);
+    }
+
+    // Color plane only, for images that are only stored or shown
+    void resizeColor(int width, int height) {
+        this->width = width;
+        this->height = height;
+        color.assign((size_t)width * height, packColor({ 0.0f, 0.0f, 0.0f }));
+        depth.clear();
+    }
+
+    void clear(uint32_t clearColor, float clearDepth = 1.0f) {
+        fill(color.begin(), color.end(), clearColor);
+        fill(depth.begin(), depth.end(), clearDepth);
+    }
+
+    static uint32_t packColor(const Vec3d& c) {
+        auto channel = [](float f) { return (uint32_t)(min(max(f, 0.0f), 1.0f) * 255.0f + 0.5f); };
+        return channel(c.x) | (channel(c.y) << 8) | (channel(c.z) << 16) | 0xFF000000u;
+    }
+
+    bool savePPM(const string& sFilename) const {
+        ofstream f(sFilename, ios::binary);
+        if (!f.is_open())
+            return false;
+
+        f << "P6\n" << width << " " << height << "\n255\n";
+
+        vector<uint8_t> row((size_t)width * 3);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                uint32_t c = color[(size_t)y * width + x];
+                row[x * 3 + 0] = c & 0xFF;
+                row[x * 3 + 1] = (c >> 8) & 0xFF;
+                row[x * 3 + 2] = (c >> 16) & 0xFF;
+            }
+            f.write((const char*)row.data(), row.size());
+        }
+
+        return f.good();
+    }
+
+    // Rows read back from GL come bottom up
+    void flipRows() {
+        for (int y = 0; y < height / 2; y++) {
+            swap_ranges(color.begin() + (size_t)y * width, color.begin() + (size_t)(y + 1) * width, color.begin() + (size_t)(height - 1 - y) * width);
+        }
+    }
+
+    // 8 bit RGB PNG. The image data is stored in deflate blocks without compression: the file is as big
+    // as a PPM, but writing it costs little more than the copy, which matters when frames are streamed
+    bool savePNG(const string& sFilename) const {
+        ofstream f(sFilename, ios::binary);
+        if (!f.is_open())
+            return false;
+
+        // Every row is a filter type byte (0, none) followed by the pixels
+        size_t rowSize = (size_t)width * 3 + 1;
+        vector<uint8_t> raw(rowSize * height);
+        for (int y = 0; y < height; y++) {
+            uint8_t* row = &raw[y * rowSize];
+            row[0] = 0;
+            for (int x = 0; x < width; x++) {
+                uint32_t c = color[(size_t)y * width + x];
+                row[1 + x * 3 + 0] = c & 0xFF;
+                row[1 + x * 3 + 1] = (c >> 8) & 0xFF;
+                row[1 + x * 3 + 2] = (c >> 16) & 0xFF;
+            }
+        }
+
+        // zlib stream: header, stored blocks of at most 65535 bytes, Adler-32 of the raw data
+        vector<uint8_t> zlib = { 0x78, 0x01 };
+        zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+        size_t offset = 0;
+        do {
+            size_t length = min(raw.size() - offset, (size_t)65535);
+            bool last = offset + length == raw.size();
+            zlib.push_back(last ? 1 : 0);
+            zlib.push_back(length & 0xFF);
+            zlib.push_back((length >> 8) & 0xFF);
+            zlib.push_back(~length & 0xFF);
+            zlib.push_back((~length >> 8) & 0xFF);
+            zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+            offset += length;
+        } while (offset < raw.size());
+
+        uint32_t a = 1, b = 0;
+        for (size_t i = 0; i < raw.size(); i += 5552) {
+            for (size_t j = i; j < min(i + 5552, raw.size()); j++) {
+                a += raw[j];
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        appendBigEndian(zlib, (b << 16) | a);
+
+        vector<uint8_t> header;
+        appendBigEndian(header, width);
+        appendBigEndian(header, height);
+        header.insert(header.end(), { 8, 2, 0, 0, 0 }); // 8 bit, RGB, deflate, adaptive filters, no interlace
+
+        static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        f.write((const char*)signature, sizeof(signature));
+        writeChunk(f, "IHDR", header);
+        writeChunk(f, "IDAT", zlib);
+        writeChunk(f, "IEND", {});
+
+        return f.good();
+    }
+
+    // Binary P6 files with 8 bit channels only
+    bool loadPPM(const string& sFilename) {
+        ifstream f(sFilename, ios::binary);
+        if (!f.is_open())
+            return false;
+
+        string magic;
+        int w = 0, h = 0, maxValue = 0;
+        f >> magic;
+        skipComments(f); f >> w;
+        skipComments(f); f >> h;
+        skipComments(f); f >> maxValue;
+        f.get();
+
+        if (magic != "P6" || w <= 0 || h <= 0 || maxValue != 255)
+            return false;
+
+        resize(w, h);
+
+        vector<uint8_t> row((size_t)w * 3);
+        for (int y = 0; y < h; y++) {
+            if (!f.read((char*)row.data(), row.size()))
+                return false;
+            for (int x = 0; x < w; x++) {
+                color[(size_t)y * w + x] = row[x * 3] | (row[x * 3 + 1] << 8) | (row[x * 3 + 2] << 16) | 0xFF000000u;
+            }
+        }
+
+        return true;
+    }
+
+    // A pixel differs when any channel is further apart than tolerance
+    static ImageDiff compare(const Framebuffer& a, const Framebuffer& b, int tolerance) {
+        ImageDiff diff;
+        if (a.width != b.width || a.height != b.height) {
+            diff.sizeMismatch = true;
+            return diff;
+        }
+
+        uint64_t totalDelta = 0;
+        for (size_t i = 0; i < a.color.size(); i++) {
+            int pixelDelta = 0;
+            for (int shift = 0; shift < 24; shift += 8) {
+                int delta = abs((int)((a.color[i] >> shift) & 0xFF) - (int)((b.color[i] >> shift) & 0xFF));
+                pixelDelta = max(pixelDelta, delta);
+                totalDelta += delta;
+            }
+
+            diff.maxChannelDelta = max(diff.maxChannelDelta, pixelDelta);
+            if (pixelDelta > tolerance)
+                diff.differingPixels++;
+        }
+
+        if (!a.color.empty())
+            diff.meanChannelDelta = (double)totalDelta / (a.color.size() * 3);
+
+        return diff;
+    }
+
+private:
+    static void appendBigEndian(vector<uint8_t>& out, uint32_t value) {
+        out.insert(out.end(), { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value });
+    }
+
+    static void writeChunk(ofstream& f, const char* type, const vector<uint8_t>& data) {
+        static const array<uint32_t, 256> crcTable = []() {
+            array<uint32_t, 256> table;
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                table[n] = c;
+            }
+            return table;
+        }();
+
+        // The CRC covers the type and the data, not the length
+        vector<uint8_t> chunk;
+        appendBigEndian(chunk, (uint32_t)data.size());
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 4; i < chunk.size(); i++)
+            crc = crcTable[(crc ^ chunk[i]) & 0xFF] ^ (crc >> 8);
+        appendBigEndian(chunk, crc ^ 0xFFFFFFFFu);
+
+        f.write((const char*)chunk.data(), chunk.size());
+    }
+
+    static void skipComments(ifstream& f) {
+        f >> ws;
+        while (f.peek() == '#') {
+            string comment;
+            getline(f, comment);
+            f >> ws;
+        }
+    }
+};
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include "framebuffer.h"
+#include "heightfield.h"
+
+using namespace std;
+
+// A scripted camera pose
+struct GoldenShot {
+    string name;
+    Vec3d position;
+    float fYaw;
+    float fPitch;
+    bool rayTraced = false; // Through the ray tracer instead of the rasterizer
+};
+
+struct GoldenScene {
+    string name;
+    function<bool(Scene&)> build;
+    vector<GoldenShot> shots;
+};
+
+// Renders fixed scenes offscreen and compares every shot against a stored PPM golden
+// in the given directory, so changes to the pipeline can be checked for correctness.
+// With update set, missing or differing goldens are (re)written instead of failing.
+// The terrain scenes load terrain.obj from the same directory, render/goldens keeps both.
+// Include after renderer3d.cpp
+class GoldenCheck {
+    string directory;
+    bool update;
+
+    int width = 320;
+    int height = 240;
+    int tolerance = 2;          // Per channel difference still counted as equal
+    int maxDifferingPixels = 0; // Pixels allowed above tolerance before a shot fails
+    int timingRuns = 5;
+
+public:
+    GoldenCheck(string directory, bool update) : directory(directory), update(update) {}
+
+    // Returns the number of failed shots
+    int run() {
+        int failures = 0;
+
+        for (auto& goldenScene : makeScenes(directory + "/terrain.obj")) {
+            Scene scene;
+            if (!goldenScene.build(scene)) {
+                printf("%-24s FAILED, scene could not be built\n", goldenScene.name.c_str());
+                failures++;
+                continue;
+            }
+
+            Renderer3d renderer(60.0f, (float)width, (float)height, scene);
+            Framebuffer image(width, height);
+
+            for (auto& shot : goldenScene.shots) {
+                if (!runShot(goldenScene.name + "_" + shot.name, shot, renderer, image))
+                    failures++;
+            }
+        }
+
+        printf("%d shot(s) failed\n", failures);
+        return failures;
+    }
+
+private:
+    bool runShot(const string& name, const GoldenShot& shot, Renderer3d& renderer, Framebuffer& image) {
+        renderer.camera.vCameraPosition = shot.position;
+        renderer.camera.fYaw = shot.fYaw;
+        renderer.camera.fPitch = shot.fPitch;
+
+        // Best of a few runs keeps the timing stable enough to compare between changes.
+        // Every run rebuilds the whole scene so the cached geometry does not hide pipeline costs
+        double bestMs = 1e30;
+        for (int i = 0; i < timingRuns; i++) {
+            renderer.invalidate();
+            auto start = chrono::high_resolution_clock::now();
+            if (shot.rayTraced)
+                renderer.traceTo(image);
+            else
+                renderer.renderTo(image);
+            auto end = chrono::high_resolution_clock::now();
+            bestMs = min(bestMs, chrono::duration<double, milli>(end - start).count());
+        }
+
+        string goldenPath = directory + "/" + name + ".ppm";
+        Framebuffer golden;
+
+        if (!golden.loadPPM(goldenPath)) {
+            if (update && image.savePPM(goldenPath)) {
+                printf("%-24s %8.3f ms  golden written\n", name.c_str(), bestMs);
+                return true;
+            }
+            printf("%-24s %8.3f ms  FAILED, no golden at %s\n", name.c_str(), bestMs, goldenPath.c_str());
+            return false;
+        }
+
+        ImageDiff diff = Framebuffer::compare(image, golden, tolerance);
+        bool passed = !diff.sizeMismatch && diff.differingPixels <= maxDifferingPixels;
+
+        if (diff.sizeMismatch) {
+            printf("%-24s %8.3f ms  %s, golden is %dx%d\n", name.c_str(), bestMs, passed ? "ok" : "FAILED", golden.width, golden.height);
+        }
+        else {
+            printf("%-24s %8.3f ms  %s, %d pixel(s) differ, max delta %d, mean delta %.4f\n",
+                name.c_str(), bestMs, passed ? "ok" : "FAILED", diff.differingPixels, diff.maxChannelDelta, diff.meanChannelDelta);
+        }
+
+        if (!passed) {
+            if (update) {
+                image.savePPM(goldenPath);
+                printf("%-24s golden updated\n", name.c_str());
+                return true;
+            }
+            image.savePPM(directory + "/" + name + ".actual.ppm");
+        }
+
+        return passed;
+    }
+
+    // 64 texels square, 8 by 8 checks
+    static shared_ptr<Texture> makeChecker() {
+        const int size = 64;
+        vector<uint32_t> pixels(size * size);
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                bool odd = ((x / 8) + (y / 8)) % 2 != 0;
+                pixels[y * size + x] = Framebuffer::packColor(odd ? Vec3d(1.0f, 0.9f, 0.2f) : Vec3d(0.1f, 0.3f, 0.8f));
+            }
+        }
+        return Texture::fromPixels(size, size, pixels);
+    }
+
+    static vector<GoldenScene> makeScenes(const string& terrainPath) {
+        vector<GoldenScene> scenes;
+
+        // Generated geometry only, always available
+        scenes.push_back({ "cubes", [](Scene& scene) {
+            Mesh cube;
+            cube.createCubeoid({ -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f });
+            MeshRef ref = scene.addMesh(cube);
+
+            for (int x = -2; x <= 2; x++) {
+                for (int z = 0; z < 4; z++) {
+                    scene.addInstance(ref, Mat4x4::MakeTranslation(x * 2.0f, (x + z) % 2 * 0.5f, 4.0f + z * 2.0f));
+                }
+            }
+            return true;
+        }, {
+            { "front", { 0.0f, 0.0f, 0.0f }, 0.0f, 0.0f },
+            { "above", { 0.0f, 4.0f, 0.0f }, 0.0f, 0.6f },
+            { "side", { -8.0f, 1.0f, 8.0f }, -1.2f, 0.1f },
+            { "inside", { 0.0f, 0.0f, 4.0f }, 0.3f, 0.0f },
+            { "traced", { 0.0f, 4.0f, 0.0f }, 0.0f, 0.6f, true },
+        } });
+
+        // Checkered cubes seen at grazing angles, exercises perspective correction and mip selection
+        scenes.push_back({ "textured", [](Scene& scene) {
+            Mesh cube;
+            cube.createCubeoid({ -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f });
+            MeshRef ref = scene.addMesh(cube);
+            shared_ptr<Texture> checker = makeChecker();
+
+            Mesh slab;
+            slab.createCubeoid({ -20.0f, -1.2f, 0.0f }, { 20.0f, -1.0f, 40.0f });
+            size_t floor = scene.addInstance(scene.addMesh(slab));
+            scene.getInstance(floor).material.texture = checker;
+
+            for (int x = -1; x <= 1; x++) {
+                size_t cube = scene.addInstance(ref, Mat4x4::MakeTranslation(x * 2.0f, 0.0f, 4.0f));
+                scene.getInstance(cube).material.texture = checker;
+            }
+            return true;
+        }, {
+            { "front", { 0.0f, 0.0f, 0.0f }, 0.0f, 0.0f },
+            { "grazing", { 0.0f, 0.3f, -2.0f }, 0.4f, 0.0f },
+            { "traced", { 0.0f, 0.0f, 0.0f }, 0.0f, 0.0f, true },
+        } });
+
+        // Cubes hung off a small hierarchy, checks world matrices compose in the right order
+        scenes.push_back({ "hierarchy", [](Scene& scene) {
+            Mesh cube;
+            cube.createCubeoid({ -0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, 0.5f });
+            MeshRef ref = scene.addMesh(cube);
+
+            size_t root = scene.addNode(SceneNode::none, Mat4x4::MultiplyMatrix(Mat4x4::MakeRotationY(0.4f), Mat4x4::MakeTranslation(0.0f, 0.0f, 8.0f)));
+            for (int arm = -1; arm <= 1; arm++) {
+                size_t armNode = scene.addNode(root, Mat4x4::MultiplyMatrix(Mat4x4::MakeRotationZ(arm * 0.3f), Mat4x4::MakeTranslation(arm * 3.0f, 0.0f, 0.0f)));
+                scene.addInstanceAt(ref, armNode);
+
+                for (int level = 1; level <= 2; level++) {
+                    size_t child = scene.addNode(armNode, Mat4x4::MultiplyMatrix(Mat4x4::MakeRotationX(level * 0.5f), Mat4x4::MakeTranslation(0.0f, level * 1.5f, 0.0f)));
+                    scene.addInstanceAt(ref, child);
+                }
+            }
+            return true;
+        }, {
+            { "front", { 0.0f, 0.0f, 0.0f }, 0.0f, 0.0f },
+            { "above", { 0.0f, 6.0f, 2.0f }, 0.0f, 0.7f },
+        } });
+
+        // A tessellated floor under a few hundred colored point and spot lights
+        scenes.push_back({ "lights", [](Scene& scene) {
+            Mesh floor;
+            const int cells = 64;
+            const float size = 0.5f;
+            for (int z = 0; z < cells; z++) {
+                for (int x = 0; x < cells; x++) {
+                    Vec3d a(x * size, 0.0f, z * size), b((x + 1) * size, 0.0f, z * size);
+                    Vec3d c(x * size, 0.0f, (z + 1) * size), d((x + 1) * size, 0.0f, (z + 1) * size);
+                    floor.tris.push_back({ a, c, b });
+                    floor.tris.push_back({ b, c, d });
+                }
+            }
+            size_t ground = scene.addInstance(scene.addMesh(std::move(floor)), Mat4x4::MakeTranslation(-16.0f, 0.0f, 0.0f));
+            scene.getInstance(ground).material.color = { 0.4f, 0.4f, 0.4f };
+
+            // Fixed generator so the golden never changes
+            uint32_t seed = 12345;
+            auto random = [&seed]() {
+                seed = seed * 1664525u + 1013904223u;
+                return (seed >> 8) * (1.0f / 16777216.0f);
+            };
+
+            for (int i = 0; i < 256; i++) {
+                Light light;
+                light.position = { random() * 32.0f - 16.0f, 0.5f, random() * 32.0f };
+                light.color = { random(), random(), random() };
+                light.range = 1.0f + random() * 2.0f;
+                light.intensity = 0.8f;
+                if (i % 8 == 0) {
+                    light.type = LightType::Spot;
+                    light.direction = { 0.0f, -1.0f, 0.0f, 0.0f };
+                    light.range = 4.0f;
+                }
+                scene.addLight(light);
+            }
+            return true;
+        }, {
+            { "front", { 0.0f, 3.0f, 0.0f }, 0.0f, 0.5f },
+            { "above", { 0.0f, 14.0f, 4.0f }, 0.0f, 1.2f },
+            { "traced", { 0.0f, 3.0f, 0.0f }, 0.0f, 0.5f, true },
+        } });
+
+        // The OBJ fixture: quads with texture coordinates and normals, textured so the coordinates show
+        scenes.push_back({ "terrain", [terrainPath](Scene& scene) {
+            Mesh mesh;
+            if (!mesh.LoadFromObjectFile(terrainPath))
+                return false;
+            size_t terrain = scene.addInstance(scene.addMesh(std::move(mesh)));
+            scene.getInstance(terrain).material.texture = makeChecker();
+            return true;
+        }, {
+            { "front", { 0.0f, 5.0f, -16.0f }, 0.0f, 0.35f },
+            { "above", { 0.0f, 18.0f, -6.0f }, 0.0f, 1.1f },
+            { "traced", { 0.0f, 5.0f, -16.0f }, 0.0f, 0.35f, true },
+        } });
+
+        // Same terrain stored quantized, should stay within a few pixels of the full precision shots
+        scenes.push_back({ "terrain_packed", [terrainPath](Scene& scene) {
+            Mesh mesh;
+            if (!mesh.LoadFromObjectFile(terrainPath))
+                return false;
+            scene.addInstance(scene.addMesh(std::move(mesh), true));
+            return true;
+        }, {
+            { "front", { 0.0f, 5.0f, -16.0f }, 0.0f, 0.35f },
+            { "traced", { 0.0f, 5.0f, -16.0f }, 0.0f, 0.35f, true },
+        } });
+
+        // The terrain read back into a heightfield and rendered from its heights alone
+        scenes.push_back({ "terrain_heightfield", [terrainPath](Scene& scene) {
+            Mesh mesh;
+            Heightfield heightfield;
+            if (!mesh.LoadFromObjectFile(terrainPath) || !heightfield.fromMesh(mesh))
+                return false;
+            scene.addInstance(scene.addMesh(heightfield.toMesh()));
+            return true;
+        }, {
+            { "front", { 0.0f, 5.0f, -16.0f }, 0.0f, 0.35f },
+        } });
+
+        return scenes;
+    }
+};
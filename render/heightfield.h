@@ -0,0 +1,414 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include "math.h"
+#include "texture.h"
+
+using namespace std;
+
+// Terrain as one height per point of a regular grid in the xz plane. A point's height, normal or
+// whether a ray hits it is found from the grid cell it falls in rather than by searching
+// triangles, and the heights take a few percent of the memory of the same terrain as a mesh.
+// Every cell is split into two triangles along the diagonal from (x + 1, z) to (x, z + 1), the
+// same split toMesh renders, so queries and the picture agree
+class Heightfield {
+    int columns = 0; // Points along x
+    int rows = 0;    // Points along z
+    float originX = 0.0f;
+    float originZ = 0.0f;
+    float spacingX = 1.0f;
+    float spacingZ = 1.0f;
+    vector<float> heights; // Row by row, x fastest
+
+    // Lowest and highest height of blocks of 2^(level + 1) by 2^(level + 1) cells, so a ray can
+    // skip whole blocks it passes above or below. A single cell's range comes from its corners
+    struct Level {
+        int columns;
+        int rows;
+        vector<float> low;
+        vector<float> high;
+    };
+    vector<Level> levels;
+
+    // Each level halves the cells along both axes, a grid of int sized dimensions needs at most this
+    // many. A raycast pops a block before pushing its four children, so its stack holds at most three
+    // waiting siblings per level and the four children of the block it is in
+    static const int maxLevels = 31;
+    static const int stackSize = 3 * maxLevels + 1;
+    static_assert(maxLevels >= (int)sizeof(int) * 8 - 1, "every grid an int can describe has to fit the raycast stack");
+
+public:
+    struct Hit {
+        bool hit = false;
+        float distance = 0.0f;
+        Vec3d position;
+        Vec3d normal;
+    };
+
+    // A grid of heights in rows of columns, x from originX and z from originZ
+    bool build(int columns, int rows, float originX, float originZ, float spacingX, float spacingZ, vector<float> heights) {
+        if (columns < 2 || rows < 2 || spacingX <= 0.0f || spacingZ <= 0.0f || heights.size() != (size_t)columns * rows)
+            return false;
+
+        this->columns = columns;
+        this->rows = rows;
+        this->originX = originX;
+        this->originZ = originZ;
+        this->spacingX = spacingX;
+        this->spacingZ = spacingZ;
+        this->heights = std::move(heights);
+        buildLevels();
+        return true;
+    }
+
+    // Takes the heights of a mesh whose corners all lie on one regular xz grid with a single
+    // height per grid point, like terrain exported from an editor. False for anything else
+    bool fromMesh(const Mesh& mesh) {
+        size_t count = mesh.triangleCount();
+        if (count == 0)
+            return false;
+
+        vector<float> xs, zs;
+        xs.reserve(count * 3);
+        zs.reserve(count * 3);
+        for (size_t t = 0; t < count; t++) {
+            for (int corner = 0; corner < 3; corner++) {
+                Vec3d p = mesh.position(t, corner);
+                xs.push_back(p.x);
+                zs.push_back(p.z);
+            }
+        }
+
+        float stepX, stepZ;
+        if (!gridAxis(xs, stepX) || !gridAxis(zs, stepZ))
+            return false;
+
+        int gridColumns = (int)xs.size();
+        int gridRows = (int)zs.size();
+        if ((size_t)(gridColumns - 1) * (gridRows - 1) * 2 != count)
+            return false;
+
+        // Every grid point has to be a corner, and always at the same height
+        vector<float> grid((size_t)gridColumns * gridRows, NAN);
+        float tolerance = 1e-3f * max(stepX, stepZ);
+        for (size_t t = 0; t < count; t++) {
+            for (int corner = 0; corner < 3; corner++) {
+                Vec3d p = mesh.position(t, corner);
+                int x = (int)lroundf((p.x - xs[0]) / stepX);
+                int z = (int)lroundf((p.z - zs[0]) / stepZ);
+                if (x < 0 || x >= gridColumns || z < 0 || z >= gridRows)
+                    return false;
+
+                float& height = grid[(size_t)z * gridColumns + x];
+                if (!isnan(height) && fabsf(height - p.y) > tolerance)
+                    return false;
+                height = p.y;
+            }
+        }
+
+        for (float height : grid) {
+            if (isnan(height))
+                return false;
+        }
+
+        return build(gridColumns, gridRows, xs[0], zs[0], stepX, stepZ, std::move(grid));
+    }
+
+    // Brightness of a PPM or TGA image, black at 0 and white at maxHeight, centered on the origin
+    bool fromImage(const string& sFilename, float spacing, float maxHeight) {
+        int width = 0, height = 0;
+        vector<uint32_t> pixels;
+        if (!Texture::decode(sFilename, width, height, pixels))
+            return false;
+
+        vector<float> grid(pixels.size());
+        for (size_t i = 0; i < pixels.size(); i++) {
+            uint32_t c = pixels[i];
+            float brightness = ((c & 0xFF) + ((c >> 8) & 0xFF) + ((c >> 16) & 0xFF)) / (3.0f * 255.0f);
+            grid[i] = brightness * maxHeight;
+        }
+
+        return build(width, height, -0.5f * (width - 1) * spacing, -0.5f * (height - 1) * spacing, spacing, spacing, std::move(grid));
+    }
+
+    // Two triangles per cell for the renderer, wound so the normals face up
+    Mesh toMesh() const {
+        Mesh mesh;
+        mesh.tris.reserve((size_t)(columns - 1) * (rows - 1) * 2);
+        for (int z = 0; z + 1 < rows; z++) {
+            for (int x = 0; x + 1 < columns; x++) {
+                Vec3d a = point(x, z), b = point(x, z + 1), c = point(x + 1, z), d = point(x + 1, z + 1);
+
+                Triangle t1 = { a, b, c };
+                Triangle t2 = { c, b, d };
+                mesh.tris.push_back(t1);
+                mesh.tris.push_back(t2);
+            }
+        }
+        mesh.computeNormals();
+        return mesh;
+    }
+
+    bool isEmpty() const {
+        return heights.empty();
+    }
+
+    bool contains(float x, float z) const {
+        return !heights.empty() && x >= originX && z >= originZ && x <= originX + (columns - 1) * spacingX && z <= originZ + (rows - 1) * spacingZ;
+    }
+
+    // Surface height below a point, the edge heights continue outside the grid
+    float heightAt(float x, float z) const {
+        int cellX, cellZ;
+        float u, v;
+        locate(x, z, cellX, cellZ, u, v);
+
+        float a = at(cellX, cellZ), b = at(cellX, cellZ + 1), c = at(cellX + 1, cellZ), d = at(cellX + 1, cellZ + 1);
+        if (u + v <= 1.0f)
+            return a + (c - a) * u + (b - a) * v;
+        return d + (b - d) * (1.0f - u) + (c - d) * (1.0f - v);
+    }
+
+    // Normal of the triangle below a point
+    Vec3d normalAt(float x, float z) const {
+        int cellX, cellZ;
+        float u, v;
+        locate(x, z, cellX, cellZ, u, v);
+
+        float a = at(cellX, cellZ), b = at(cellX, cellZ + 1), c = at(cellX + 1, cellZ), d = at(cellX + 1, cellZ + 1);
+        float slopeX, slopeZ;
+        if (u + v <= 1.0f) {
+            slopeX = (c - a) / spacingX;
+            slopeZ = (b - a) / spacingZ;
+        }
+        else {
+            slopeX = (d - b) / spacingX;
+            slopeZ = (d - c) / spacingZ;
+        }
+
+        Vec3d normal = Vec3d(-slopeX, 1.0f, -slopeZ).normalize();
+        normal.w = 0.0f;
+        return normal;
+    }
+
+    // Nearest surface along a ray within maxDistance. Walks the height ranges from the whole grid
+    // down to single cells, nearer blocks first, and leaves out every block the ray passes by
+    Hit raycast(const Vec3d& origin, const Vec3d& direction, float maxDistance) const {
+        Hit best;
+        best.distance = maxDistance;
+        if (heights.empty())
+            return best;
+
+        Vec3d inverse = { 1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z };
+
+        struct Block {
+            int level; // -1 for a single cell
+            int x;
+            int z;
+        };
+        Block stack[stackSize];
+        int top = 0;
+        stack[top++] = { (int)levels.size() - 1, 0, 0 };
+
+        while (top > 0) {
+            Block block = stack[--top];
+
+            float low, high;
+            int cells = 1 << (block.level + 1);
+            if (block.level < 0) {
+                cellRange(block.x, block.z, low, high);
+            }
+            else {
+                const Level& level = levels[block.level];
+                low = level.low[(size_t)block.z * level.columns + block.x];
+                high = level.high[(size_t)block.z * level.columns + block.x];
+            }
+
+            int firstX = block.x * cells;
+            int firstZ = block.z * cells;
+            Vec3d boxMin = { originX + firstX * spacingX, low, originZ + firstZ * spacingZ };
+            Vec3d boxMax = { originX + min(firstX + cells, columns - 1) * spacingX, high, originZ + min(firstZ + cells, rows - 1) * spacingZ };
+            if (!hitsBox(origin, inverse, boxMin, boxMax, best.distance))
+                continue;
+
+            if (block.level < 0) {
+                intersectCell(block.x, block.z, origin, direction, best);
+                continue;
+            }
+
+            // Children pushed far to near, so the nearest comes off the stack first
+            int childLevel = block.level - 1;
+            int childColumns = childLevel < 0 ? columns - 1 : levels[childLevel].columns;
+            int childRows = childLevel < 0 ? rows - 1 : levels[childLevel].rows;
+            int flipX = direction.x < 0.0f ? 0 : 1;
+            int flipZ = direction.z < 0.0f ? 0 : 1;
+            for (int i = 0; i < 4; i++) {
+                int cx = block.x * 2 + ((i & 1) ^ flipX);
+                int cz = block.z * 2 + (((i >> 1) & 1) ^ flipZ);
+                if (cx < childColumns && cz < childRows)
+                    stack[top++] = { childLevel, cx, cz };
+            }
+        }
+
+        return best;
+    }
+
+    // Heights and height ranges, not counting the object itself
+    size_t memoryBytes() const {
+        size_t bytes = heights.size() * sizeof(float);
+        for (auto& level : levels)
+            bytes += (level.low.size() + level.high.size()) * sizeof(float);
+        return bytes;
+    }
+
+private:
+    float at(int x, int z) const {
+        return heights[(size_t)z * columns + x];
+    }
+
+    Vec3d point(int x, int z) const {
+        return Vec3d(originX + x * spacingX, at(x, z), originZ + z * spacingZ);
+    }
+
+    // Cell and position inside it, both clamped to the grid
+    void locate(float x, float z, int& cellX, int& cellZ, float& u, float& v) const {
+        float gx = min(max((x - originX) / spacingX, 0.0f), (float)(columns - 1));
+        float gz = min(max((z - originZ) / spacingZ, 0.0f), (float)(rows - 1));
+        cellX = min((int)gx, columns - 2);
+        cellZ = min((int)gz, rows - 2);
+        u = gx - cellX;
+        v = gz - cellZ;
+    }
+
+    void cellRange(int x, int z, float& low, float& high) const {
+        float a = at(x, z), b = at(x, z + 1), c = at(x + 1, z), d = at(x + 1, z + 1);
+        low = min(min(a, b), min(c, d));
+        high = max(max(a, b), max(c, d));
+    }
+
+    void buildLevels() {
+        levels.clear();
+
+        int levelColumns = columns - 1, levelRows = rows - 1;
+        do {
+            Level level;
+            level.columns = (levelColumns + 1) / 2;
+            level.rows = (levelRows + 1) / 2;
+            level.low.resize((size_t)level.columns * level.rows);
+            level.high.resize((size_t)level.columns * level.rows);
+
+            for (int z = 0; z < level.rows; z++) {
+                for (int x = 0; x < level.columns; x++) {
+                    float low = INFINITY, high = -INFINITY;
+                    for (int i = 0; i < 4; i++) {
+                        int cx = x * 2 + (i & 1), cz = z * 2 + (i >> 1);
+                        if (cx >= levelColumns || cz >= levelRows)
+                            continue;
+
+                        float childLow, childHigh;
+                        if (levels.empty()) {
+                            cellRange(cx, cz, childLow, childHigh);
+                        }
+                        else {
+                            const Level& child = levels.back();
+                            childLow = child.low[(size_t)cz * child.columns + cx];
+                            childHigh = child.high[(size_t)cz * child.columns + cx];
+                        }
+                        low = min(low, childLow);
+                        high = max(high, childHigh);
+                    }
+                    level.low[(size_t)z * level.columns + x] = low;
+                    level.high[(size_t)z * level.columns + x] = high;
+                }
+            }
+
+            levelColumns = level.columns;
+            levelRows = level.rows;
+            levels.push_back(std::move(level));
+        } while (levelColumns > 1 || levelRows > 1);
+    }
+
+    // Slab test, true when the ray enters the box before limit
+    static bool hitsBox(const Vec3d& origin, const Vec3d& inverse, const Vec3d& boxMin, const Vec3d& boxMax, float limit) {
+        float t0 = 0.0f, t1 = limit;
+        for (int axis = 0; axis < 3; axis++) {
+            float o = (&origin.x)[axis], inv = (&inverse.x)[axis];
+            float enter = ((&boxMin.x)[axis] - o) * inv;
+            float leave = ((&boxMax.x)[axis] - o) * inv;
+            if (enter > leave)
+                swap(enter, leave);
+
+            // A ray parallel to a slab gives NaN when it starts on its plane, which counts as inside
+            t0 = enter > t0 ? enter : t0;
+            t1 = leave < t1 ? leave : t1;
+            if (t0 > t1)
+                return false;
+        }
+        return true;
+    }
+
+    void intersectCell(int x, int z, const Vec3d& origin, const Vec3d& direction, Hit& best) const {
+        Vec3d a = point(x, z), b = point(x, z + 1), c = point(x + 1, z), d = point(x + 1, z + 1);
+        intersectTriangle(a, b, c, origin, direction, best);
+        intersectTriangle(c, b, d, origin, direction, best);
+    }
+
+    // Moller-Trumbore, from either side
+    static void intersectTriangle(const Vec3d& p0, const Vec3d& p1, const Vec3d& p2, const Vec3d& origin, const Vec3d& direction, Hit& best) {
+        Vec3d edge1 = p1 - p0;
+        Vec3d edge2 = p2 - p0;
+        Vec3d h = direction.cross(edge2);
+        float det = edge1.dot(h);
+        if (fabsf(det) < 1e-12f)
+            return;
+
+        float invDet = 1.0f / det;
+        Vec3d s = origin - p0;
+        float u = s.dot(h) * invDet;
+        if (u < 0.0f || u > 1.0f)
+            return;
+
+        Vec3d q = s.cross(edge1);
+        float v = direction.dot(q) * invDet;
+        if (v < 0.0f || u + v > 1.0f)
+            return;
+
+        float t = edge2.dot(q) * invDet;
+        if (t < 0.0f || t >= best.distance)
+            return;
+
+        best.hit = true;
+        best.distance = t;
+        best.position = origin + direction * t;
+        best.normal = edge1.cross(edge2).normalize();
+        best.normal.w = 0.0f;
+    }
+
+    // Sorts and merges the coordinates of one axis into its grid lines, false unless they are evenly spaced
+    static bool gridAxis(vector<float>& values, float& step) {
+        sort(values.begin(), values.end());
+
+        float extent = values.back() - values.front();
+        float tolerance = max(extent, 1.0f) * 1e-5f;
+
+        size_t kept = 1;
+        for (size_t i = 1; i < values.size(); i++) {
+            if (values[i] - values[kept - 1] > tolerance)
+                values[kept++] = values[i];
+        }
+        values.resize(kept);
+        if (kept < 2)
+            return false;
+
+        step = extent / (kept - 1);
+        for (size_t i = 0; i < kept; i++) {
+            if (fabsf(values[i] - (values.front() + step * i)) > step * 1e-3f)
+                return false;
+        }
+        return true;
+    }
+};
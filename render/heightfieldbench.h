@@ -0,0 +1,146 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <stdio.h>
+#include "heightfield.h"
+
+using namespace std;
+
+// Casts the same rays at a heightfield and, one triangle after another, at the mesh it renders as.
+// Checks both find the same hits and shows the time per ray and the memory each form takes.
+// Include after renderer3d.cpp
+class HeightfieldBenchmark {
+    string path;
+    float scale;
+
+    int rayCount = 2000;
+
+public:
+    // Without a path the terrain is made up, rolling hills on a 256 by 256 grid
+    HeightfieldBenchmark(string path, float scale) : path(path), scale(scale) {}
+
+    int run() {
+        Heightfield terrain;
+        if (path.empty()) {
+            terrain = hills();
+        }
+        else {
+            Mesh loaded;
+            if (!loaded.LoadFromObjectFile(path) || loaded.tris.empty()) {
+                printf("Cannot load %s\n", path.c_str());
+                return 1;
+            }
+            loaded.increaseSize(scale);
+            if (!terrain.fromMesh(loaded)) {
+                printf("%s is not a regular height grid\n", path.c_str());
+                return 1;
+            }
+        }
+
+        // The surface the heightfield describes, split the same way
+        Mesh mesh = terrain.toMesh();
+        printf("%s, %zu triangles, %d rays\n", path.empty() ? "hills" : path.c_str(), mesh.tris.size(), rayCount);
+        printf("%-12s %10zu bytes\n", "heightfield", terrain.memoryBytes());
+        printf("%-12s %10zu bytes\n", "triangles", mesh.tris.size() * sizeof(Triangle));
+
+        // Rays from above the terrain, half nearly straight down and half at a low angle
+        Vec3d low = mesh.tris[0].p[0], high = low;
+        for (auto& tri : mesh.tris) {
+            for (auto& p : tri.p) {
+                low = { min(low.x, p.x), min(low.y, p.y), min(low.z, p.z) };
+                high = { max(high.x, p.x), max(high.y, p.y), max(high.z, p.z) };
+            }
+        }
+
+        mt19937 random(7);
+        uniform_real_distribution<float> unit(0.0f, 1.0f);
+        vector<Vec3d> origins(rayCount), directions(rayCount);
+        for (int i = 0; i < rayCount; i++) {
+            origins[i] = { low.x + (high.x - low.x) * unit(random), high.y + 10.0f, low.z + (high.z - low.z) * unit(random) };
+            float spread = i % 2 ? 1.0f : 0.02f;
+            directions[i] = Vec3d((unit(random) - 0.5f) * spread, i % 2 ? -0.3f : -1.0f, (unit(random) - 0.5f) * spread).normalize();
+            directions[i].w = 0.0f;
+        }
+
+        const float maxDistance = 1e6f;
+        vector<Heightfield::Hit> fieldHits(rayCount);
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < rayCount; i++)
+            fieldHits[i] = terrain.raycast(origins[i], directions[i], maxDistance);
+        double fieldMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        vector<float> meshHits(rayCount);
+        start = chrono::steady_clock::now();
+        for (int i = 0; i < rayCount; i++)
+            meshHits[i] = nearestTriangle(mesh, origins[i], directions[i], maxDistance);
+        double meshMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        printf("%-12s %10.3f us per ray\n", "heightfield", fieldMs * 1000.0 / rayCount);
+        printf("%-12s %10.3f us per ray  %.0fx\n", "triangles", meshMs * 1000.0 / rayCount, meshMs / fieldMs);
+
+        // Every hit has to agree on the distance and lie on the grid at the height heightAt reports
+        int hits = 0, differ = 0, offGrid = 0;
+        for (int i = 0; i < rayCount; i++) {
+            const Heightfield::Hit& hit = fieldHits[i];
+            bool meshHit = meshHits[i] < maxDistance;
+            if (hit.hit != meshHit || (meshHit && fabsf(hit.distance - meshHits[i]) > 1e-3f * max(1.0f, meshHits[i]))) {
+                differ++;
+                continue;
+            }
+            if (!hit.hit)
+                continue;
+
+            hits++;
+            if (!terrain.contains(hit.position.x, hit.position.z) || fabsf(terrain.heightAt(hit.position.x, hit.position.z) - hit.position.y) > 1e-3f * max(1.0f, high.y - low.y))
+                offGrid++;
+        }
+
+        printf("%d hits, %d differ from the triangles, %d off the surface\n", hits, differ, offGrid);
+        return differ == 0 && offGrid == 0 ? 0 : 1;
+    }
+
+private:
+    static Heightfield hills() {
+        const int size = 256;
+        vector<float> heights((size_t)size * size);
+        for (int z = 0; z < size; z++) {
+            for (int x = 0; x < size; x++) {
+                heights[(size_t)z * size + x] = 8.0f * sinf(x * 0.05f) * cosf(z * 0.07f) + 3.0f * sinf((x + z) * 0.13f);
+            }
+        }
+
+        Heightfield terrain;
+        terrain.build(size, size, -0.5f * (size - 1), -0.5f * (size - 1), 1.0f, 1.0f, std::move(heights));
+        return terrain;
+    }
+
+    // Moller-Trumbore against every triangle, from either side, maxDistance when nothing is hit
+    static float nearestTriangle(const Mesh& mesh, const Vec3d& origin, const Vec3d& direction, float maxDistance) {
+        float nearest = maxDistance;
+        for (auto& tri : mesh.tris) {
+            Vec3d e1 = tri.p[1] - tri.p[0], e2 = tri.p[2] - tri.p[0];
+            Vec3d h = direction.cross(e2);
+            float det = e1.dot(h);
+            if (fabsf(det) < 1e-12f)
+                continue;
+
+            float inverse = 1.0f / det;
+            Vec3d s = origin - tri.p[0];
+            float u = s.dot(h) * inverse;
+            if (u < 0.0f || u > 1.0f)
+                continue;
+
+            Vec3d q = s.cross(e1);
+            float v = direction.dot(q) * inverse;
+            if (v < 0.0f || u + v > 1.0f)
+                continue;
+
+            float t = e2.dot(q) * inverse;
+            if (t >= 0.0f && t < nearest)
+                nearest = t;
+        }
+        return nearest;
+    }
+};
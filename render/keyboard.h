@@ -1,15 +1,49 @@
 #pragma once
 
 #include <GLFW/glfw3.h>
+#include <atomic>
+#include <cstdint>
+#include <vector>
 #include "math.h"
+#include "eventqueue.h"
 
+using namespace std;
+
+// Input as GLFW reported it, stamped with glfwGetTime when the callback ran
+struct InputEvent {
+    enum Type : uint8_t { Key, Button, Motion };
+
+    Type type = Key;
+    int code = 0;   // Key or mouse button
+    int action = 0; // GLFW_PRESS, GLFW_RELEASE or GLFW_REPEAT
+    Vec2f position; // Cursor position after a motion
+    Vec2f delta;    // Cursor movement since the previous motion event
+    double time = 0.0;
+};
+
+// Callbacks only queue events, the frame applies them all at once in processEvents before it
+// builds the camera. Key and button state then stays the same for the whole frame, presses
+// shorter than a frame are still seen by wasKeyPressed and every bit of mouse motion is summed
 class Keyboard {
 
 protected:
-    bool keys[GLFW_KEY_LAST];
-    bool buttons[GLFW_MOUSE_BUTTON_LAST];
+    bool keys[GLFW_KEY_LAST + 1] = {};
+    bool buttons[GLFW_MOUSE_BUTTON_LAST + 1] = {};
     Vec2f mousePosition;
 
+private:
+    SpscQueue<InputEvent, 1024> events;
+    atomic<uint64_t> droppedEvents{ 0 };
+
+    // Producer side, the last cursor position turns positions into movement
+    bool cursorKnown = false;
+    Vec2f lastCursor;
+
+    // Consumer side, what happened since the last processEvents
+    bool keysPressed[GLFW_KEY_LAST + 1] = {};
+    bool buttonsPressed[GLFW_MOUSE_BUTTON_LAST + 1] = {};
+    Vec2f mouseMotion;
+
 public:
 
     static void mouseButtonCallbackStatic(GLFWwindow* window, int button, int action, int mods) {
@@ -40,18 +74,71 @@ public:
         glfwSetKeyCallback(window, Keyboard::keyCallbackStatic);
     }
 
-    void resetMousePosition(float width, float height) {
-        mousePosition = { width / 2, height / 2 };
+    void queueKey(int key, int action) {
+        InputEvent event;
+        event.type = InputEvent::Key;
+        event.code = key;
+        event.action = action;
+        queue(event);
     }
 
-    void setMousePosition(Vec2f pos) {
-        mousePosition = pos;
+    void queueButton(int button, int action) {
+        InputEvent event;
+        event.type = InputEvent::Button;
+        event.code = button;
+        event.action = action;
+        queue(event);
+    }
+
+    void queueCursor(double x, double y) {
+        InputEvent event;
+        event.type = InputEvent::Motion;
+        event.position = { (float)x, (float)y };
+        event.delta = cursorKnown ? Vec2f((float)x - lastCursor.x, (float)y - lastCursor.y) : Vec2f();
+        cursorKnown = true;
+        lastCursor = event.position;
+        queue(event);
+    }
+
+    // Applies every queued event, call once at the start of a frame. Returns the time stamp of the
+    // oldest event taken, or a negative value when there was none. taken receives the events for a recording
+    double processEvents(vector<InputEvent>* taken = nullptr) {
+        beginFrame();
+        if (taken)
+            taken->clear();
+
+        double oldest = -1.0;
+        InputEvent event;
+        while (events.pop(event)) {
+            if (oldest < 0.0)
+                oldest = event.time;
+            apply(event);
+            if (taken)
+                taken->push_back(event);
+        }
+        return oldest;
+    }
+
+    // Instead of processEvents, the frame takes recorded input. Live events are thrown away
+    void replayEvents(const vector<InputEvent>& recorded, Vec2f motion) {
+        InputEvent event;
+        while (events.pop(event)) {}
+
+        beginFrame();
+        for (auto& e : recorded)
+            apply(e);
+        mouseMotion = motion;
     }
 
     Vec2f getMousePosition() {
         return mousePosition;
     }
 
+    // Cursor movement summed over the events of this frame
+    Vec2f getMouseMotion() {
+        return mouseMotion;
+    }
+
     bool isKeyPressed(int key) {
         return keys[key];
     }
@@ -60,16 +147,55 @@ public:
         return buttons[button];
     }
 
-    void setKeyPressed(int key, bool pressed) {
-        keys[key] = pressed;
+    // Went down during this frame's events, even if it was released again before the frame
+    bool wasKeyPressed(int key) {
+        return keysPressed[key];
     }
 
-    void setButtonPressed(int button, bool pressed) {
-        buttons[button] = pressed;
+    bool wasButtonPressed(int button) {
+        return buttonsPressed[button];
+    }
+
+    // Events lost because the frame did not take them before the queue filled up
+    uint64_t getDroppedEvents() const {
+        return droppedEvents;
     }
 
     virtual ~Keyboard() = default;
     virtual void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) = 0;
     virtual void cursorPosCallback(GLFWwindow* window, double xpos, double ypos) = 0;
     virtual void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) = 0;
-};
\ No newline at end of file
+
+private:
+    void apply(const InputEvent& event) {
+        bool pressed = event.action != GLFW_RELEASE;
+        switch (event.type) {
+        case InputEvent::Key:
+            if (event.code < 0 || event.code > GLFW_KEY_LAST) break;
+            keys[event.code] = pressed;
+            keysPressed[event.code] = keysPressed[event.code] || event.action == GLFW_PRESS;
+            break;
+        case InputEvent::Button:
+            if (event.code < 0 || event.code > GLFW_MOUSE_BUTTON_LAST) break;
+            buttons[event.code] = pressed;
+            buttonsPressed[event.code] = buttonsPressed[event.code] || event.action == GLFW_PRESS;
+            break;
+        case InputEvent::Motion:
+            mousePosition = event.position;
+            mouseMotion = mouseMotion + event.delta;
+            break;
+        }
+    }
+
+    void beginFrame() {
+        fill(begin(keysPressed), end(keysPressed), false);
+        fill(begin(buttonsPressed), end(buttonsPressed), false);
+        mouseMotion = Vec2f();
+    }
+
+    void queue(InputEvent& event) {
+        event.time = glfwGetTime();
+        if (!events.push(event))
+            droppedEvents++;
+    }
+};
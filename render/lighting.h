@@ -0,0 +1,224 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "math.h"
+#include "scene.h"
+
+using namespace std;
+
+// Point and spot lights sorted into a froxel grid: screen tiles times exponential depth slices
+// in view space. A light is listed in every cell its range sphere touches, so shading a point
+// only walks the few lights of its own cell and the cost stays flat as the light count grows.
+// The outer tiles reach out to infinity so points beside the screen still land in a cell
+class LightGrid {
+public:
+    static const int tilesX = 16;
+    static const int tilesY = 8;
+    static const int slices = 16;
+
+    struct ViewLight {
+        Vec3d position;
+        Vec3d direction;
+        Vec3d color;
+        float range;
+        float cosOuter;
+        float cosInner;
+        bool spot;
+    };
+
+private:
+    vector<ViewLight> viewLights;
+
+    // Light indices of every cell back to back, cell c owns [cellOffsets[c], cellOffsets[c + 1])
+    vector<uint32_t> cellOffsets;
+    vector<uint32_t> cellLights;
+
+    // Screen x = scaleX * view x / view z, likewise for y, the same mapping the projection ends in
+    float scaleX = 1.0f;
+    float scaleY = 1.0f;
+    float nearZ = 0.1f;
+    float farZ = 1000.0f;
+    float sliceScale = 1.0f;
+
+public:
+    size_t lightCount() const {
+        return viewLights.size();
+    }
+
+    void build(const vector<Light>& lights, const Mat4x4& viewMatrix, float scaleX, float scaleY, float nearZ, float farZ) {
+        this->scaleX = scaleX;
+        this->scaleY = scaleY;
+        this->nearZ = nearZ;
+        this->farZ = farZ;
+        sliceScale = slices / logf(farZ / nearZ);
+
+        viewLights.clear();
+        for (auto& light : lights) {
+            ViewLight viewLight;
+            viewLight.position = Mat4x4::MultiplyVector(viewMatrix, light.position);
+            Vec3d direction = light.direction;
+            direction.w = 0.0f;
+            viewLight.direction = Mat4x4::MultiplyVector(viewMatrix, direction).normalize();
+            viewLight.color = light.color * light.intensity;
+            viewLight.range = light.range;
+            viewLight.cosOuter = cosf(light.outerAngle);
+            viewLight.cosInner = cosf(light.innerAngle);
+            viewLight.spot = light.type == LightType::Spot;
+            viewLights.push_back(viewLight);
+        }
+
+        // Count first, then fill, so the lists end up in one contiguous array in light order
+        const int cells = tilesX * tilesY * slices;
+        cellOffsets.assign(cells + 1, 0);
+
+        for (int pass = 0; pass < 2; pass++) {
+            vector<uint32_t> cursor;
+            if (pass == 1) {
+                for (int c = 0; c < cells; c++)
+                    cellOffsets[c + 1] += cellOffsets[c];
+                cellLights.resize(cellOffsets[cells]);
+                cursor.assign(cellOffsets.begin(), cellOffsets.end() - 1);
+            }
+
+            for (uint32_t l = 0; l < viewLights.size(); l++) {
+                forEachCell(viewLights[l], [&](int cell) {
+                    if (pass == 0)
+                        cellOffsets[cell + 1]++;
+                    else
+                        cellLights[cursor[cell]++] = l;
+                });
+            }
+        }
+    }
+
+    // Summed light arriving at a view space point with the given view space normal
+    Vec3d shade(const Vec3d& position, const Vec3d& normal) const {
+        Vec3d result = { 0.0f, 0.0f, 0.0f };
+
+        int cell = cellAt(position);
+        if (cell < 0) {
+            // In front of the near slice or past the far one, only happens for clipped triangles
+            for (auto& light : viewLights)
+                result = result + contribution(light, position, normal);
+            return result;
+        }
+
+        for (uint32_t i = cellOffsets[cell]; i < cellOffsets[cell + 1]; i++)
+            result = result + contribution(viewLights[cellLights[i]], position, normal);
+        return result;
+    }
+
+    // Reference result over every light, for checking the grid
+    Vec3d shadeAll(const Vec3d& position, const Vec3d& normal) const {
+        Vec3d result = { 0.0f, 0.0f, 0.0f };
+        for (auto& light : viewLights)
+            result = result + contribution(light, position, normal);
+        return result;
+    }
+
+private:
+    // Smooth window that reaches exactly zero at the light range
+    static Vec3d contribution(const ViewLight& light, const Vec3d& position, const Vec3d& normal) {
+        Vec3d toLight = light.position - position;
+        float distanceSquared = toLight.dot(toLight);
+        float rangeSquared = light.range * light.range;
+        if (distanceSquared >= rangeSquared)
+            return { 0.0f, 0.0f, 0.0f };
+
+        Vec3d l = toLight * (1.0f / sqrtf(distanceSquared));
+        float lambert = normal.dot(l);
+        if (lambert <= 0.0f)
+            return { 0.0f, 0.0f, 0.0f };
+
+        float window = 1.0f - distanceSquared / rangeSquared;
+        float attenuation = window * window;
+
+        if (light.spot) {
+            float cosAngle = -l.dot(light.direction);
+            if (cosAngle <= light.cosOuter)
+                return { 0.0f, 0.0f, 0.0f };
+            float t = min((cosAngle - light.cosOuter) / max(light.cosInner - light.cosOuter, 1e-4f), 1.0f);
+            attenuation *= t * t * (3.0f - 2.0f * t);
+        }
+
+        return light.color * (lambert * attenuation);
+    }
+
+    int sliceAt(float z) const {
+        return (int)(logf(z / nearZ) * sliceScale);
+    }
+
+    float sliceNear(int slice) const {
+        return nearZ * expf(slice / sliceScale);
+    }
+
+    int cellAt(const Vec3d& p) const {
+        if (p.z < nearZ || p.z >= farZ)
+            return -1;
+
+        float sx = min(max(scaleX * p.x / p.z, -1.0f), 1.0f);
+        float sy = min(max(scaleY * p.y / p.z, -1.0f), 1.0f);
+
+        int tx = min((int)((sx + 1.0f) * 0.5f * tilesX), tilesX - 1);
+        int ty = min((int)((sy + 1.0f) * 0.5f * tilesY), tilesY - 1);
+        int slice = min(sliceAt(p.z), slices - 1);
+        return (slice * tilesY + ty) * tilesX + tx;
+    }
+
+    // Visits every cell whose view space box the light's range sphere touches
+    template<typename Visit>
+    void forEachCell(const ViewLight& light, Visit visit) const {
+        const Vec3d& c = light.position;
+        float r = light.range;
+
+        float zMin = max(c.z - r, nearZ), zMax = min(c.z + r, farZ * 0.9999f);
+        if (zMin > zMax)
+            return;
+
+        // Screen bounds of the sphere's box, x / z is monotonic in both so the corners bound it
+        float sxMin = 1e30f, sxMax = -1e30f, syMin = 1e30f, syMax = -1e30f;
+        for (float z : { zMin, zMax }) {
+            for (float x : { c.x - r, c.x + r }) {
+                sxMin = min(sxMin, scaleX * x / z);
+                sxMax = max(sxMax, scaleX * x / z);
+            }
+            for (float y : { c.y - r, c.y + r }) {
+                syMin = min(syMin, scaleY * y / z);
+                syMax = max(syMax, scaleY * y / z);
+            }
+        }
+
+        // Spheres beside the screen still reach the outer tiles, which extend to infinity
+        auto tile = [](float screen, int tiles) {
+            return min(max((int)floorf((screen + 1.0f) * 0.5f * tiles), 0), tiles - 1);
+        };
+        int tx0 = tile(sxMin, tilesX), tx1 = tile(sxMax, tilesX);
+        int ty0 = tile(syMin, tilesY), ty1 = tile(syMax, tilesY);
+        int s0 = max(0, sliceAt(zMin)), s1 = min(slices - 1, sliceAt(zMax));
+
+        for (int s = s0; s <= s1; s++) {
+            float z0 = sliceNear(s), z1 = sliceNear(s + 1);
+
+            for (int ty = ty0; ty <= ty1; ty++) {
+                float y0 = (ty * 2.0f / tilesY - 1.0f) / scaleY, y1 = ((ty + 1) * 2.0f / tilesY - 1.0f) / scaleY;
+
+                for (int tx = tx0; tx <= tx1; tx++) {
+                    float x0 = (tx * 2.0f / tilesX - 1.0f) / scaleX, x1 = ((tx + 1) * 2.0f / tilesX - 1.0f) / scaleX;
+
+                    // View space box of the cell, the frustum slice widens with depth
+                    float boxMinX = tx == 0 ? -1e30f : min(x0 * z0, x0 * z1);
+                    float boxMaxX = tx == tilesX - 1 ? 1e30f : max(x1 * z0, x1 * z1);
+                    float boxMinY = ty == 0 ? -1e30f : min(y0 * z0, y0 * z1);
+                    float boxMaxY = ty == tilesY - 1 ? 1e30f : max(y1 * z0, y1 * z1);
+
+                    float dx = max(max(boxMinX - c.x, 0.0f), c.x - boxMaxX);
+                    float dy = max(max(boxMinY - c.y, 0.0f), c.y - boxMaxY);
+                    float dz = max(max(z0 - c.z, 0.0f), c.z - z1);
+                    if (dx * dx + dy * dy + dz * dz <= r * r)
+                        visit((s * tilesY + ty) * tilesX + tx);
+                }
+            }
+        }
+    }
+};
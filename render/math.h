@@ -4,8 +4,21 @@
 #include <string>
 #include <strstream>
 #include <fstream>
-#include <strstream>
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+// SSE is part of every x64 target, 32 bit builds only get it when enabled
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define MATH_SSE 1
+#include <xmmintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MATH_SSE2 1
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -13,63 +26,73 @@ struct Vec2f {
     float x = 0;
     float y = 0;
 
-    Vec2f() = default;
+    constexpr Vec2f() = default;
+
+    constexpr Vec2f(float x, float y) : x(x), y(y) {}
+
+    constexpr Vec2f operator+(const Vec2f& other) const {
+        return Vec2f(x + other.x, y + other.y);
+    }
+
+    constexpr Vec2f operator-(const Vec2f& other) const {
+        return Vec2f(x - other.x, y - other.y);
+    }
 
-    Vec2f(float x, float y) : x(x), y(y) {}
+    constexpr Vec2f operator*(float scalar) const {
+        return Vec2f(x * scalar, y * scalar);
+    }
 };
 
-struct Vec3d {
+// Four floats aligned to 16 bytes so matrix code can load a whole vector in one SSE register,
+// w is 1 for points and 0 for directions
+struct alignas(16) Vec3d {
     float x = 0;
     float y = 0;
     float z = 0;
     float w = 1;
 
-    Vec3d() = default;
+    constexpr Vec3d() = default;
 
-    Vec3d(float x, float y) : x(x), y(y) {}
-    Vec3d(float x, float y, float z) : x(x), y(y), z(z) {}
-    Vec3d(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
+    constexpr Vec3d(float x, float y) : x(x), y(y) {}
+    constexpr Vec3d(float x, float y, float z) : x(x), y(y), z(z) {}
+    constexpr Vec3d(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
 
-    Vec3d operator+(const Vec3d& other) const {
+    constexpr Vec3d operator+(const Vec3d& other) const {
         return Vec3d(x + other.x, y + other.y, z + other.z);
     }
 
-    Vec3d operator-(const Vec3d& other) const {
+    constexpr Vec3d operator-(const Vec3d& other) const {
         return Vec3d(x - other.x, y - other.y, z - other.z);
     }
 
-    Vec3d operator*(float scalar) const {
+    constexpr Vec3d operator*(float scalar) const {
         return Vec3d(x * scalar, y * scalar, z * scalar);
     }
 
-    Vec3d operator/(float scalar) const {
-        if (scalar != 0) {
-            return Vec3d(x / scalar, y / scalar, z / scalar);
-        }
-        // Handle division by zero
-        throw std::runtime_error("Division by zero");
+    // Never throws, dividing by zero follows IEEE rules like any other float division
+    constexpr Vec3d operator/(float scalar) const {
+        return *this * (1.0f / scalar);
     }
 
-
-
-    float dot(const Vec3d& other) const {
+    constexpr float dot(const Vec3d& other) const {
         return x * other.x + y * other.y + z * other.z;
     }
 
     float length() const {
-        return std::sqrt(this->dot(*this));
+        return sqrtf(dot(*this));
     }
 
+    // Zero length vectors normalize to the zero vector instead of throwing
     Vec3d normalize() const {
-        float len = length();
-        if (len != 0) {
-            return *this / len;
-        }
-        // Handle zero vector
-        throw std::runtime_error("Normalization of a zero-length vector");
+        return normalizeOr(Vec3d(0.0f, 0.0f, 0.0f));
+    }
+
+    Vec3d normalizeOr(const Vec3d& fallback) const {
+        float lengthSquared = dot(*this);
+        return lengthSquared > 0.0f ? *this * (1.0f / sqrtf(lengthSquared)) : fallback;
     }
 
-    Vec3d cross(const Vec3d& other) const {
+    constexpr Vec3d cross(const Vec3d& other) const {
         return Vec3d(
             y * other.z - z * other.y,
             z * other.x - x * other.z,
@@ -77,12 +100,18 @@ struct Vec3d {
         );
     }
 
-    static Vec3d intersectPlane(const Vec3d& plane_p, const Vec3d& plane_n, const Vec3d& lineStart, const Vec3d& lineEnd) {
-        Vec3d plane_n_normalized = plane_n.normalize();
-        float plane_d = -plane_n_normalized.dot(plane_p);
-        float ad = lineStart.dot(plane_n_normalized);
-        float bd = lineEnd.dot(plane_n_normalized);
-        float t = (-plane_d - ad) / (bd - ad);
+    // Plane normal must already be normalised
+    static constexpr Vec3d intersectPlane(const Vec3d& plane_p, const Vec3d& plane_n, const Vec3d& lineStart, const Vec3d& lineEnd) {
+        float t = 0.0f;
+        return intersectPlane(plane_p, plane_n, lineStart, lineEnd, t);
+    }
+
+    // Also hands back how far along the line the intersection is, to interpolate vertex attributes
+    static constexpr Vec3d intersectPlane(const Vec3d& plane_p, const Vec3d& plane_n, const Vec3d& lineStart, const Vec3d& lineEnd, float& t) {
+        float plane_d = -plane_n.dot(plane_p);
+        float ad = lineStart.dot(plane_n);
+        float bd = lineEnd.dot(plane_n);
+        t = (-plane_d - ad) / (bd - ad);
         Vec3d lineStartToEnd = lineEnd - lineStart;
         Vec3d lineToIntersect = lineStartToEnd * t;
         return lineStart + lineToIntersect;
@@ -91,6 +120,7 @@ struct Vec3d {
 
 struct Triangle {
     Vec3d p[3];
+    Vec2f t[3]; // Texture coordinates, v runs down the texture
     Vec3d color;
 
     Vec3d getNormal() const {
@@ -108,26 +138,34 @@ struct Triangle {
         // Return signed shortest distance from point to plane, plane normal must be normalised
         auto dist = [&](Vec3d& p)
             {
-                Vec3d n = p.normalize();
                 return (plane_n.x * p.x + plane_n.y * p.y + plane_n.z * p.z - plane_n.dot(plane_p));
             };
 
         // Create two temporary storage arrays to classify points either side of plane
-        // If distance sign is positive, point lies on "inside" of plane
-        Vec3d* inside_points[3];  int nInsidePointCount = 0;
-        Vec3d* outside_points[3]; int nOutsidePointCount = 0;
+        // If distance sign is positive, point lies on "inside" of plane.
+        // Indices instead of pointers so the texture coordinates can follow their points
+        int inside_points[3];  int nInsidePointCount = 0;
+        int outside_points[3]; int nOutsidePointCount = 0;
 
         // Get signed distance of each point in triangle to plane
-        float d0 = dist(in_tri.p[0]);
-        float d1 = dist(in_tri.p[1]);
-        float d2 = dist(in_tri.p[2]);
+        for (int i = 0; i < 3; i++) {
+            if (dist(in_tri.p[i]) >= 0) { inside_points[nInsidePointCount++] = i; }
+            else { outside_points[nOutsidePointCount++] = i; }
+        }
 
-        if (d0 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[0]; }
-        else { outside_points[nOutsidePointCount++] = &in_tri.p[0]; }
-        if (d1 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[1]; }
-        else { outside_points[nOutsidePointCount++] = &in_tri.p[1]; }
-        if (d2 >= 0) { inside_points[nInsidePointCount++] = &in_tri.p[2]; }
-        else { outside_points[nOutsidePointCount++] = &in_tri.p[2]; }
+        // A new point where the edge from inside point a to outside point b crosses the plane
+        auto intersect = [&](int a, int b, Triangle& out_tri, int slot)
+            {
+                float t = 0.0f;
+                out_tri.p[slot] = Vec3d::intersectPlane(plane_p, plane_n, in_tri.p[a], in_tri.p[b], t);
+                out_tri.t[slot] = in_tri.t[a] + (in_tri.t[b] - in_tri.t[a]) * t;
+            };
+
+        auto keep = [&](int a, Triangle& out_tri, int slot)
+            {
+                out_tri.p[slot] = in_tri.p[a];
+                out_tri.t[slot] = in_tri.t[a];
+            };
 
         // Now classify triangle points, and break the input triangle into 
         // smaller output triangles if required. There are four possible
@@ -155,14 +193,16 @@ struct Triangle {
             // Triangle should be clipped. As two points lie outside
             // the plane, the triangle simply becomes a smaller triangle
 
+            // Copy appearance info to new triangle
+            out_tri1.color = in_tri.color;
 
             // The inside point is valid, so keep that...
-            out_tri1.p[0] = *inside_points[0];
+            keep(inside_points[0], out_tri1, 0);
 
             // but the two new points are at the locations where the 
             // original sides of the triangle (lines) intersect with the plane
-            out_tri1.p[1] = Vec3d::intersectPlane(plane_p, plane_n, *inside_points[0], *outside_points[0]);
-            out_tri1.p[2] = Vec3d::intersectPlane(plane_p, plane_n, *inside_points[0], *outside_points[1]);
+            intersect(inside_points[0], outside_points[0], out_tri1, 1);
+            intersect(inside_points[0], outside_points[1], out_tri1, 2);
 
             return 1; // Return the newly formed single triangle
         }
@@ -174,31 +214,463 @@ struct Triangle {
             // represent a quad with two new triangles
 
             // Copy appearance info to new triangles
-
+            out_tri1.color = in_tri.color;
+            out_tri2.color = in_tri.color;
 
             // The first triangle consists of the two inside points and a new
             // point determined by the location where one side of the triangle
             // intersects with the plane
-            out_tri1.p[0] = *inside_points[0];
-            out_tri1.p[1] = *inside_points[1];
-            out_tri1.p[2] = Vec3d::intersectPlane(plane_p, plane_n, *inside_points[0], *outside_points[0]);
+            keep(inside_points[0], out_tri1, 0);
+            keep(inside_points[1], out_tri1, 1);
+            intersect(inside_points[0], outside_points[0], out_tri1, 2);
 
             // The second triangle is composed of one of he inside points, a
             // new point determined by the intersection of the other side of the 
             // triangle and the plane, and the newly created point above
-            out_tri2.p[0] = *inside_points[1];
+            keep(inside_points[1], out_tri2, 0);
             out_tri2.p[1] = out_tri1.p[2];
-            out_tri2.p[2] = Vec3d::intersectPlane(plane_p, plane_n, *inside_points[1], *outside_points[0]);
+            out_tri2.t[1] = out_tri1.t[2];
+            intersect(inside_points[1], outside_points[0], out_tri2, 2);
 
             return 2; // Return two newly formed triangles which form a quad
         }
+
+        return 0;
+    }
+};
+
+// A contiguous range of a mesh's triangles with a normal cone bounding all of their facings
+struct Cluster {
+    uint32_t first = 0;
+    uint32_t count = 0;
+
+    Vec3d apex;
+    Vec3d axis;
+    float cutoff = 2.0f; // Above 1 when the normals spread too wide, the cone test then never passes
+
+    // The whole cluster faces away when the viewer looks at the apex from inside the cone
+    bool isBackfacing(const Vec3d& viewer) const {
+        Vec3d toApex = apex - viewer;
+        return toApex.dot(axis) >= cutoff * toApex.length();
     }
 };
 
+// A triangle and its face normal in 28 bytes instead of 112. Positions are 16 bit steps across
+// the mesh bounds, the normal is octahedral with 16 bits per axis and the color 8 bits per channel
+struct PackedTriangle {
+    uint16_t p[3][3];
+    uint16_t reserved = 0; // Lets the last corner load as a whole 8 bytes
+    uint32_t normal;
+    uint32_t color;
+
+    // Project onto the octahedron |x| + |y| + |z| = 1 and fold the lower half over the upper one.
+    // The error stays below 0.05 degrees, zero normals come back as +z
+    static uint32_t encodeNormal(const Vec3d& n) {
+        float length = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+        if (length == 0.0f)
+            return 0;
+
+        float u = n.x / length, v = n.y / length;
+        if (n.z < 0.0f) {
+            float foldU = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+            float foldV = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+            u = foldU;
+            v = foldV;
+        }
+
+        auto snorm = [](float f) { return (uint32_t)(uint16_t)(int16_t)lroundf(std::min(std::max(f, -1.0f), 1.0f) * 32767.0f); };
+        return snorm(u) | (snorm(v) << 16);
+    }
+
+    static Vec3d decodeNormal(uint32_t encoded) {
+        float u = (int16_t)(encoded & 0xFFFF) * (1.0f / 32767.0f);
+        float v = (int16_t)(encoded >> 16) * (1.0f / 32767.0f);
+        float z = 1.0f - fabsf(u) - fabsf(v);
+        if (z < 0.0f) {
+            float unfoldU = (1.0f - fabsf(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+            float unfoldV = (1.0f - fabsf(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+            u = unfoldU;
+            v = unfoldV;
+        }
+
+        Vec3d n = Vec3d(u, v, z).normalize();
+        n.w = 0.0f;
+        return n;
+    }
+};
+
+// Texture coordinates of a packed triangle, 16 bit steps across the mesh's texture coordinate bounds
+struct PackedTexCoords {
+    uint16_t t[3][2];
+};
+
+struct Mat4x4;
+
 struct Mesh {
 
     vector<Triangle> tris;
 
+    // Face normals parallel to tris, filled once by computeNormals when the mesh is loaded or shared
+    vector<Vec3d> normals;
+
+    // Triangles are reordered so every cluster is a contiguous range of tris
+    vector<Cluster> clusters;
+
+    static const uint32_t clusterSize = 64;
+
+    // Object space box around every vertex, filled by computeBounds
+    Vec3d boundsMin;
+    Vec3d boundsMax;
+
+    // Compressed storage, filled by compress() which drops tris and normals. A position is off by at
+    // most half a step, (boundsMax - boundsMin) / 65535 / 2 per axis
+    vector<PackedTriangle> packed;
+    vector<PackedTexCoords> packedTexCoords; // Empty when every texture coordinate is zero
+    Vec3d quantizeScale;
+    Vec2f texCoordMin;
+    Vec2f texCoordScale;
+
+    bool isCompressed() const {
+        return !packed.empty();
+    }
+
+    size_t triangleCount() const {
+        return packed.empty() ? tris.size() : packed.size();
+    }
+
+    // Readers that should work on either storage go through these
+    Vec3d position(size_t t, int corner) const {
+        if (packed.empty())
+            return tris[t].p[corner];
+
+        const uint16_t* q = packed[t].p[corner];
+        return Vec3d(boundsMin.x + q[0] * quantizeScale.x, boundsMin.y + q[1] * quantizeScale.y, boundsMin.z + q[2] * quantizeScale.z);
+    }
+
+    Vec3d normal(size_t t) const {
+        return packed.empty() ? normals[t] : PackedTriangle::decodeNormal(packed[t].normal);
+    }
+
+    void texCoords(size_t t, Vec2f out[3]) const {
+        for (int corner = 0; corner < 3; corner++) {
+            if (packed.empty())
+                out[corner] = tris[t].t[corner];
+            else if (packedTexCoords.empty())
+                out[corner] = Vec2f();
+            else
+                out[corner] = Vec2f(texCoordMin.x + packedTexCoords[t].t[corner][0] * texCoordScale.x, texCoordMin.y + packedTexCoords[t].t[corner][1] * texCoordScale.y);
+        }
+    }
+
+    Triangle triangle(size_t t) const {
+        if (packed.empty())
+            return tris[t];
+
+        Triangle tri;
+        for (int corner = 0; corner < 3; corner++)
+            tri.p[corner] = position(t, corner);
+        texCoords(t, tri.t);
+
+        uint32_t c = packed[t].color;
+        tri.color = Vec3d((c & 0xFF) / 255.0f, ((c >> 8) & 0xFF) / 255.0f, ((c >> 16) & 0xFF) / 255.0f);
+        return tri;
+    }
+
+    // m preceded by the dequantization when the mesh is compressed, pass the result to transformTriangle
+    Mat4x4 positionTransform(const Mat4x4& m) const;
+
+    // Corners of triangle t through a matrix from positionTransform. Packed corners are converted
+    // and transformed in the same pass, there is no separate decode step
+    void transformTriangle(size_t t, const Mat4x4& transform, Vec3d out[3]) const;
+
+    // The same with the storage form known up front, for loops that already checked isCompressed
+    template <bool Packed>
+    void transformTriangleAs(size_t t, const Mat4x4& transform, Vec3d out[3]) const;
+
+    // Swap tris and normals for the packed form. Normals, clusters and bounds are built from the
+    // full precision triangles first and stay as they are
+    void compress() {
+        if (isCompressed() || tris.empty())
+            return;
+
+        if (normals.size() != tris.size())
+            computeNormals();
+        computeBounds();
+
+        Vec3d extent = boundsMax - boundsMin;
+        quantizeScale = Vec3d(extent.x / 65535.0f, extent.y / 65535.0f, extent.z / 65535.0f);
+
+        auto quantize = [](float value, float offset, float scale) {
+            return scale > 0.0f ? (uint16_t)std::min(std::max(lroundf((value - offset) / scale), 0L), 65535L) : (uint16_t)0;
+        };
+        auto channel = [](float f) { return (uint32_t)(std::min(std::max(f, 0.0f), 1.0f) * 255.0f + 0.5f); };
+
+        bool hasTexCoords = false;
+        Vec2f uvMin = tris[0].t[0], uvMax = tris[0].t[0];
+        for (auto& tri : tris) {
+            for (auto& t : tri.t) {
+                hasTexCoords = hasTexCoords || t.x != 0.0f || t.y != 0.0f;
+                uvMin = Vec2f(std::min(uvMin.x, t.x), std::min(uvMin.y, t.y));
+                uvMax = Vec2f(std::max(uvMax.x, t.x), std::max(uvMax.y, t.y));
+            }
+        }
+        texCoordMin = uvMin;
+        texCoordScale = Vec2f((uvMax.x - uvMin.x) / 65535.0f, (uvMax.y - uvMin.y) / 65535.0f);
+
+        packed.resize(tris.size());
+        packedTexCoords.resize(hasTexCoords ? tris.size() : 0);
+
+        for (size_t i = 0; i < tris.size(); i++) {
+            const Triangle& tri = tris[i];
+            PackedTriangle& out = packed[i];
+
+            for (int corner = 0; corner < 3; corner++) {
+                out.p[corner][0] = quantize(tri.p[corner].x, boundsMin.x, quantizeScale.x);
+                out.p[corner][1] = quantize(tri.p[corner].y, boundsMin.y, quantizeScale.y);
+                out.p[corner][2] = quantize(tri.p[corner].z, boundsMin.z, quantizeScale.z);
+
+                if (hasTexCoords) {
+                    packedTexCoords[i].t[corner][0] = quantize(tri.t[corner].x, texCoordMin.x, texCoordScale.x);
+                    packedTexCoords[i].t[corner][1] = quantize(tri.t[corner].y, texCoordMin.y, texCoordScale.y);
+                }
+            }
+
+            out.normal = PackedTriangle::encodeNormal(normals[i]);
+            out.color = channel(tri.color.x) | (channel(tri.color.y) << 8) | (channel(tri.color.z) << 16) | 0xFF000000u;
+        }
+
+        vector<Triangle>().swap(tris);
+        vector<Vec3d>().swap(normals);
+    }
+
+    // Position along a 3D Hilbert curve through a 1024^3 grid, inputs are expected in [0, 1].
+    // Unlike a Morton curve it never jumps, consecutive codes are always neighboring cells
+    static uint32_t hilbertCode(float x, float y, float z) {
+        const int bits = 10;
+        auto quantize = [](float f) { return (uint32_t)min(max(f * 1023.0f, 0.0f), 1023.0f); };
+        uint32_t axes[3] = { quantize(x), quantize(y), quantize(z) };
+
+        // Skilling's transform of the coordinates into the curve's transposed form
+        for (uint32_t q = 1u << (bits - 1); q > 1; q >>= 1) {
+            uint32_t p = q - 1;
+            for (int i = 0; i < 3; i++) {
+                if (axes[i] & q) {
+                    axes[0] ^= p;
+                }
+                else {
+                    uint32_t t = (axes[0] ^ axes[i]) & p;
+                    axes[0] ^= t;
+                    axes[i] ^= t;
+                }
+            }
+        }
+        axes[1] ^= axes[0];
+        axes[2] ^= axes[1];
+        uint32_t t = 0;
+        for (uint32_t q = 1u << (bits - 1); q > 1; q >>= 1) {
+            if (axes[2] & q)
+                t ^= q - 1;
+        }
+        for (auto& axis : axes)
+            axis ^= t;
+
+        auto expand = [](uint32_t v) {
+            v = (v | (v << 16)) & 0x030000FF;
+            v = (v | (v << 8)) & 0x0300F00F;
+            v = (v | (v << 4)) & 0x030C30C3;
+            v = (v | (v << 2)) & 0x09249249;
+            return v;
+        };
+        return (expand(axes[0]) << 2) | (expand(axes[1]) << 1) | expand(axes[2]);
+    }
+
+    // Partition the triangles by dominant facing, then spatially along a Hilbert curve, so each
+    // chunk of clusterSize triangles is both compact and has a narrow normal cone and clusters
+    // that follow each other in memory lie next to each other. Inside a cluster the triangles are
+    // then walked across shared corners, see orderByAdjacency
+    void buildClusters() {
+        clusters.clear();
+        if (tris.empty()) return;
+
+        if (normals.size() != tris.size())
+            computeNormals();
+
+        Vec3d minBound = tris[0].p[0], maxBound = tris[0].p[0];
+        for (auto& tri : tris) {
+            for (auto& p : tri.p) {
+                minBound = { min(minBound.x, p.x), min(minBound.y, p.y), min(minBound.z, p.z) };
+                maxBound = { max(maxBound.x, p.x), max(maxBound.y, p.y), max(maxBound.z, p.z) };
+            }
+        }
+        Vec3d extent = maxBound - minBound;
+        Vec3d invExtent = { extent.x > 0 ? 1.0f / extent.x : 0.0f, extent.y > 0 ? 1.0f / extent.y : 0.0f, extent.z > 0 ? 1.0f / extent.z : 0.0f };
+
+        vector<uint64_t> keys(tris.size());
+        for (size_t i = 0; i < tris.size(); i++) {
+            const Vec3d& n = normals[i];
+            float ax = fabsf(n.x), ay = fabsf(n.y), az = fabsf(n.z);
+            uint64_t facing = ax >= ay && ax >= az ? (n.x < 0) : ay >= az ? 2 + (n.y < 0) : 4 + (n.z < 0);
+
+            Vec3d c = (tris[i].p[0] + tris[i].p[1] + tris[i].p[2]) * (1.0f / 3.0f) - minBound;
+            uint32_t code = hilbertCode(c.x * invExtent.x, c.y * invExtent.y, c.z * invExtent.z);
+
+            keys[i] = (facing << 61) | ((uint64_t)code << 31) | i;
+        }
+        sort(keys.begin(), keys.end());
+
+        vector<Triangle> sortedTris(tris.size());
+        vector<Vec3d> sortedNormals(tris.size());
+        for (size_t i = 0; i < keys.size(); i++) {
+            uint32_t from = (uint32_t)(keys[i] & 0x7FFFFFFF);
+            sortedTris[i] = tris[from];
+            sortedNormals[i] = normals[from];
+        }
+        tris.swap(sortedTris);
+        normals.swap(sortedNormals);
+
+        // Close a cluster at the size limit or where the facing bucket changes
+        uint32_t first = 0;
+        for (uint32_t i = 1; i <= (uint32_t)tris.size(); i++) {
+            if (i == tris.size() || i - first == clusterSize || (keys[i] >> 61) != (keys[first] >> 61)) {
+                orderByAdjacency(first, i - first);
+                clusters.push_back(buildCluster(first, i - first));
+                first = i;
+            }
+        }
+    }
+
+    // Reorders one cluster so each triangle shares as many corners as it can with the ones just
+    // before it, like a vertex cache optimizer would for an index buffer. Triangles here carry their
+    // own corners, so corners are matched by position. What this buys is locality: the rasterizer
+    // fills neighboring pixels one after another and the same corners are read back to back
+    void orderByAdjacency(uint32_t first, uint32_t count) {
+        if (count < 3)
+            return;
+
+        // Small ids for the distinct corner positions of the cluster
+        vector<Vec3d> corners;
+        vector<uint16_t> ids(count * 3);
+        for (uint32_t i = 0; i < count; i++) {
+            for (int c = 0; c < 3; c++) {
+                const Vec3d& p = tris[first + i].p[c];
+                size_t id = 0;
+                while (id < corners.size() && (corners[id].x != p.x || corners[id].y != p.y || corners[id].z != p.z))
+                    id++;
+                if (id == corners.size())
+                    corners.push_back(p);
+                ids[i * 3 + c] = (uint16_t)id;
+            }
+        }
+
+        // Corners used within the last recentWindow triangles score by how recently, the best
+        // scoring triangle goes next and ties keep the curve order
+        const int recentWindow = 8;
+        vector<int> lastUsed(corners.size(), -recentWindow);
+        vector<bool> placed(count, false);
+        vector<uint32_t> order;
+        order.reserve(count);
+
+        for (int step = 0; step < (int)count; step++) {
+            int bestScore = -1;
+            uint32_t best = 0;
+            for (uint32_t i = 0; i < count; i++) {
+                if (placed[i])
+                    continue;
+
+                int score = 0;
+                for (int c = 0; c < 3; c++)
+                    score += max(0, recentWindow - (step - lastUsed[ids[i * 3 + c]]));
+                if (score > bestScore) {
+                    bestScore = score;
+                    best = i;
+                }
+            }
+
+            placed[best] = true;
+            order.push_back(best);
+            for (int c = 0; c < 3; c++)
+                lastUsed[ids[best * 3 + c]] = step;
+        }
+
+        vector<Triangle> sortedTris(count);
+        vector<Vec3d> sortedNormals(count);
+        for (uint32_t i = 0; i < count; i++) {
+            sortedTris[i] = tris[first + order[i]];
+            sortedNormals[i] = normals[first + order[i]];
+        }
+        copy(sortedTris.begin(), sortedTris.end(), tris.begin() + first);
+        copy(sortedNormals.begin(), sortedNormals.end(), normals.begin() + first);
+    }
+
+    Cluster buildCluster(uint32_t first, uint32_t count) const {
+        Cluster cluster;
+        cluster.first = first;
+        cluster.count = count;
+
+        Vec3d axis = { 0, 0, 0 };
+        Vec3d minBound = tris[first].p[0], maxBound = tris[first].p[0];
+        for (uint32_t i = first; i < first + count; i++) {
+            axis = axis + normals[i];
+            for (auto& p : tris[i].p) {
+                minBound = { min(minBound.x, p.x), min(minBound.y, p.y), min(minBound.z, p.z) };
+                maxBound = { max(maxBound.x, p.x), max(maxBound.y, p.y), max(maxBound.z, p.z) };
+            }
+        }
+
+        float axisLength = axis.length();
+        if (axisLength == 0.0f) return cluster;
+        axis = axis * (1.0f / axisLength);
+
+        float minDot = 1.0f;
+        for (uint32_t i = first; i < first + count; i++) {
+            minDot = min(minDot, axis.dot(normals[i]));
+        }
+
+        // Cones close to or wider than a hemisphere would almost never cull
+        if (minDot <= 0.1f) return cluster;
+
+        // Push the apex back along the axis until it lies behind every triangle's plane
+        Vec3d center = (minBound + maxBound) * 0.5f;
+        float maxT = 0.0f;
+        for (uint32_t i = first; i < first + count; i++) {
+            float dc = (center - tris[i].p[0]).dot(normals[i]);
+            float dn = axis.dot(normals[i]);
+            maxT = max(maxT, dc / dn);
+        }
+
+        cluster.axis = axis;
+        cluster.apex = center - axis * maxT;
+        cluster.cutoff = sqrtf(1.0f - minDot * minDot);
+        return cluster;
+    }
+
+    void computeBounds() {
+        // The packed positions are relative to the bounds, they can no longer move
+        if (isCompressed())
+            return;
+
+        boundsMin = boundsMax = tris.empty() ? Vec3d(0.0f, 0.0f, 0.0f) : tris[0].p[0];
+        for (auto& tri : tris) {
+            for (auto& p : tri.p) {
+                boundsMin = { min(boundsMin.x, p.x), min(boundsMin.y, p.y), min(boundsMin.z, p.z) };
+                boundsMax = { max(boundsMax.x, p.x), max(boundsMax.y, p.y), max(boundsMax.z, p.z) };
+            }
+        }
+    }
+
+    void computeNormals() {
+        normals.resize(tris.size());
+
+        for (size_t i = 0; i < tris.size(); i++) {
+            Vec3d n = (tris[i].p[1] - tris[i].p[0]).cross(tris[i].p[2] - tris[i].p[0]);
+            float len = n.length();
+
+            // Degenerate triangles get a zero normal, which the backface test always rejects
+            normals[i] = len > 0.0f ? n * (1.0f / len) : Vec3d(0.0f, 0.0f, 0.0f);
+            normals[i].w = 0.0f;
+        }
+    }
+
     void moveMesh(Vec3d v) {
         for (auto& tri : tris) {
             for (auto& p : tri.p) {
@@ -207,6 +679,8 @@ struct Mesh {
 		}
 	}
 
+    // Positions, optional texture coordinates and faces as v, v/vt, v//vn or v/vt/vn.
+    // Faces with more than three corners are split into a fan
     bool LoadFromObjectFile(string sFilename)
     {
         ifstream f(sFilename);
@@ -215,6 +689,7 @@ struct Mesh {
 
 
         vector<Vec3d> verts;
+        vector<Vec2f> texCoords;
 
         while (!f.eof())
         {
@@ -226,21 +701,64 @@ struct Mesh {
 
             char junk;
 
-            if (line[0] == 'v')
+            if (line[0] == 'v' && line[1] == ' ')
             {
                 Vec3d v;
                 s >> junk >> v.x >> v.y >> v.z;
                 verts.push_back(v);
             }
 
+            if (line[0] == 'v' && line[1] == 't')
+            {
+                Vec2f t;
+                s >> junk >> junk >> t.x >> t.y;
+
+                // OBJ puts v = 0 at the bottom of the image, textures store their top row first
+                texCoords.push_back({ t.x, 1.0f - t.y });
+            }
+
             if (line[0] == 'f')
             {
-                int f[3];
-                s >> junk >> f[0] >> f[1] >> f[2];
-                tris.push_back({ verts[f[0] - 1], verts[f[1] - 1], verts[f[2] - 1] });
+                s >> junk;
+
+                int corners = 0;
+                int v[3], vt[3];
+                string token;
+
+                while (s >> token) {
+                    int vertex = atoi(token.c_str());
+                    size_t slash = token.find('/');
+                    int texCoord = slash != string::npos ? atoi(token.c_str() + slash + 1) : 0;
+
+                    if (vertex < 1 || vertex > (int)verts.size())
+                        break;
+                    if (texCoord < 1 || texCoord > (int)texCoords.size())
+                        texCoord = 0;
+
+                    if (corners < 3) {
+                        v[corners] = vertex;
+                        vt[corners] = texCoord;
+                    }
+                    else {
+                        v[1] = v[2];
+                        vt[1] = vt[2];
+                        v[2] = vertex;
+                        vt[2] = texCoord;
+                    }
+
+                    if (++corners >= 3) {
+                        Triangle tri = { verts[v[0] - 1], verts[v[1] - 1], verts[v[2] - 1] };
+                        for (int i = 0; i < 3; i++) {
+                            if (vt[i] > 0)
+                                tri.t[i] = texCoords[vt[i] - 1];
+                        }
+                        tris.push_back(tri);
+                    }
+                }
             }
         }
 
+        computeNormals();
         return true;
     }
 
@@ -301,23 +819,97 @@ struct Mesh {
         tris.push_back(top2);
         tris.push_back(bottom1);
         tris.push_back(bottom2);
+
+        // Every face maps the whole texture once
+        for (size_t i = tris.size() - 12; i < tris.size(); i += 2) {
+            tris[i].t[0] = { 0.0f, 0.0f };
+            tris[i].t[1] = { 0.0f, 1.0f };
+            tris[i].t[2] = { 1.0f, 0.0f };
+            tris[i + 1].t[0] = { 0.0f, 1.0f };
+            tris[i + 1].t[1] = { 1.0f, 1.0f };
+            tris[i + 1].t[2] = { 1.0f, 0.0f };
+        }
+
+        computeNormals();
 	}
 };
 
-struct Mat4x4 {
+// Row vector convention (v * M), each row is 16 byte aligned so it loads straight into an SSE register
+struct alignas(16) Mat4x4 {
     float m[4][4] = { 0 };
 
-    static Vec3d MultiplyVector(Mat4x4& m, Vec3d& i)
+    static Vec3d MultiplyVector(const Mat4x4& m, const Vec3d& i)
     {
         Vec3d v;
+#ifdef MATH_SSE
+        _mm_store_ps(&v.x, MultiplyRow(m, _mm_load_ps(&i.x)));
+#else
         v.x = i.x * m.m[0][0] + i.y * m.m[1][0] + i.z * m.m[2][0] + i.w * m.m[3][0];
         v.y = i.x * m.m[0][1] + i.y * m.m[1][1] + i.z * m.m[2][1] + i.w * m.m[3][1];
         v.z = i.x * m.m[0][2] + i.y * m.m[1][2] + i.z * m.m[2][2] + i.w * m.m[3][2];
         v.w = i.x * m.m[0][3] + i.y * m.m[1][3] + i.z * m.m[2][3] + i.w * m.m[3][3];
+#endif
         return v;
     }
 
-    static Mat4x4 MakeIdentity()
+    // Transform a run of vectors with the matrix rows kept in registers for the whole loop
+    static void MultiplyVectors(const Mat4x4& m, const Vec3d* in, Vec3d* out, size_t count)
+    {
+#ifdef MATH_SSE
+        __m128 r0 = _mm_load_ps(m.m[0]), r1 = _mm_load_ps(m.m[1]), r2 = _mm_load_ps(m.m[2]), r3 = _mm_load_ps(m.m[3]);
+        for (size_t n = 0; n < count; n++) {
+            __m128 v = _mm_load_ps(&in[n].x);
+            __m128 r = _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)), r0);
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)), r1));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)), r2));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)), r3));
+            _mm_store_ps(&out[n].x, r);
+        }
+#else
+        for (size_t n = 0; n < count; n++)
+            out[n] = MultiplyVector(m, in[n]);
+#endif
+    }
+
+    // Quantized positions, three uint16 per vertex, converted and transformed in one pass. m includes
+    // the dequantization (see MakeDequantize). Two bytes past the last vertex are read and ignored
+    static void MultiplyQuantized(const Mat4x4& m, const uint16_t* in, Vec3d* out, size_t count)
+    {
+#ifdef MATH_SSE2
+        __m128 r0 = _mm_load_ps(m.m[0]), r1 = _mm_load_ps(m.m[1]), r2 = _mm_load_ps(m.m[2]), r3 = _mm_load_ps(m.m[3]);
+        const __m128i keepXYZ = _mm_setr_epi16(-1, -1, -1, 0, 0, 0, 0, 0);
+        const __m128i oneW = _mm_setr_epi16(0, 0, 0, 1, 0, 0, 0, 0);
+        for (size_t n = 0; n < count; n++) {
+            __m128i q = _mm_loadl_epi64((const __m128i*)(in + n * 3));
+            q = _mm_or_si128(_mm_and_si128(q, keepXYZ), oneW);
+            __m128 v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(q, _mm_setzero_si128()));
+
+            __m128 r = _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)), r0);
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)), r1));
+            r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)), r2));
+            r = _mm_add_ps(r, r3);
+            _mm_store_ps(&out[n].x, r);
+        }
+#else
+        for (size_t n = 0; n < count; n++)
+            out[n] = Vec3d((float)in[n * 3], (float)in[n * 3 + 1], (float)in[n * 3 + 2]);
+        MultiplyVectors(m, out, out, count);
+#endif
+    }
+
+#ifdef MATH_SSE
+    // Row vector times matrix: v.x * row0 + v.y * row1 + v.z * row2 + v.w * row3
+    static __m128 MultiplyRow(const Mat4x4& m, __m128 v)
+    {
+        __m128 r = _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)), _mm_load_ps(m.m[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)), _mm_load_ps(m.m[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)), _mm_load_ps(m.m[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)), _mm_load_ps(m.m[3])));
+        return r;
+    }
+#endif
+
+    static constexpr Mat4x4 MakeIdentity()
     {
         Mat4x4 matrix;
         matrix.m[0][0] = 1.0f;
@@ -327,6 +919,20 @@ struct Mat4x4 {
         return matrix;
     }
 
+    // Quantized steps back to the space they were quantized in: value = offset + step * scale
+    static Mat4x4 MakeDequantize(const Vec3d& offset, const Vec3d& scale)
+    {
+        Mat4x4 matrix;
+        matrix.m[0][0] = scale.x;
+        matrix.m[1][1] = scale.y;
+        matrix.m[2][2] = scale.z;
+        matrix.m[3][0] = offset.x;
+        matrix.m[3][1] = offset.y;
+        matrix.m[3][2] = offset.z;
+        matrix.m[3][3] = 1.0f;
+        return matrix;
+    }
+
     static Mat4x4 MakeRotationX(float fAngleRad)
     {
         Mat4x4 matrix;
@@ -363,7 +969,7 @@ struct Mat4x4 {
         return matrix;
     }
 
-    static Mat4x4 MakeTranslation(float x, float y, float z)
+    static constexpr Mat4x4 MakeTranslation(float x, float y, float z)
     {
         Mat4x4 matrix;
         matrix.m[0][0] = 1.0f;
@@ -389,16 +995,36 @@ struct Mat4x4 {
         return matrix;
     }
 
-    static Mat4x4 MultiplyMatrix(Mat4x4& m1, Mat4x4& m2)
+    static Mat4x4 MultiplyMatrix(const Mat4x4& m1, const Mat4x4& m2)
     {
         Mat4x4 matrix;
+#ifdef MATH_SSE
+        // Each result row is the matching row of m1 taken as a vector through m2
+        for (int r = 0; r < 4; r++)
+            _mm_store_ps(matrix.m[r], MultiplyRow(m2, _mm_load_ps(m1.m[r])));
+#else
         for (int c = 0; c < 4; c++)
             for (int r = 0; r < 4; r++)
                 matrix.m[r][c] = m1.m[r][0] * m2.m[0][c] + m1.m[r][1] * m2.m[1][c] + m1.m[r][2] * m2.m[2][c] + m1.m[r][3] * m2.m[3][c];
+#endif
         return matrix;
     }
 
-    static Mat4x4 PointAt(Vec3d& pos, Vec3d& target, Vec3d& up)
+    // Same as MakeRotationX(pitch) * MakeRotationY(yaw) without building and multiplying both matrices
+    static Mat4x4 MakeRotationXY(float fPitchRad, float fYawRad)
+    {
+        float cx = cosf(fPitchRad), sx = sinf(fPitchRad);
+        float cy = cosf(fYawRad), sy = sinf(fYawRad);
+
+        Mat4x4 matrix;
+        matrix.m[0][0] = cy;        matrix.m[0][1] = 0.0f; matrix.m[0][2] = sy;
+        matrix.m[1][0] = -sx * sy;  matrix.m[1][1] = cx;   matrix.m[1][2] = sx * cy;
+        matrix.m[2][0] = -cx * sy;  matrix.m[2][1] = -sx;  matrix.m[2][2] = cx * cy;
+        matrix.m[3][3] = 1.0f;
+        return matrix;
+    }
+
+    static Mat4x4 PointAt(const Vec3d& pos, const Vec3d& target, const Vec3d& up)
     {
         // Calculate new forward direction
         Vec3d newForward = target - pos;
@@ -420,7 +1046,30 @@ struct Mat4x4 {
         return matrix;
     }
 
-    static Mat4x4 QuickInverse(Mat4x4& m) // Only for Rotation/Translation Matrices
+    static Mat4x4 InverseAffine(const Mat4x4& m) // Any rotation/scale/translation matrix, last column must be 0,0,0,1
+    {
+        float a = m.m[0][0], b = m.m[0][1], c = m.m[0][2];
+        float d = m.m[1][0], e = m.m[1][1], f = m.m[1][2];
+        float g = m.m[2][0], h = m.m[2][1], i = m.m[2][2];
+
+        float det = a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+        if (det == 0.0f)
+            return MakeIdentity();
+
+        float invDet = 1.0f / det;
+
+        Mat4x4 matrix;
+        matrix.m[0][0] = (e * i - f * h) * invDet; matrix.m[0][1] = (c * h - b * i) * invDet; matrix.m[0][2] = (b * f - c * e) * invDet;
+        matrix.m[1][0] = (f * g - d * i) * invDet; matrix.m[1][1] = (a * i - c * g) * invDet; matrix.m[1][2] = (c * d - a * f) * invDet;
+        matrix.m[2][0] = (d * h - e * g) * invDet; matrix.m[2][1] = (b * g - a * h) * invDet; matrix.m[2][2] = (a * e - b * d) * invDet;
+        matrix.m[3][0] = -(m.m[3][0] * matrix.m[0][0] + m.m[3][1] * matrix.m[1][0] + m.m[3][2] * matrix.m[2][0]);
+        matrix.m[3][1] = -(m.m[3][0] * matrix.m[0][1] + m.m[3][1] * matrix.m[1][1] + m.m[3][2] * matrix.m[2][1]);
+        matrix.m[3][2] = -(m.m[3][0] * matrix.m[0][2] + m.m[3][1] * matrix.m[1][2] + m.m[3][2] * matrix.m[2][2]);
+        matrix.m[3][3] = 1.0f;
+        return matrix;
+    }
+
+    static Mat4x4 QuickInverse(const Mat4x4& m) // Only for Rotation/Translation Matrices
     {
         Mat4x4 matrix;
         matrix.m[0][0] = m.m[0][0]; matrix.m[0][1] = m.m[1][0]; matrix.m[0][2] = m.m[2][0]; matrix.m[0][3] = 0.0f;
@@ -434,6 +1083,24 @@ struct Mat4x4 {
     }
 };
 
-
-
-
+inline Mat4x4 Mesh::positionTransform(const Mat4x4& m) const
+{
+    return packed.empty() ? m : Mat4x4::MultiplyMatrix(Mat4x4::MakeDequantize(boundsMin, quantizeScale), m);
+}
+
+inline void Mesh::transformTriangle(size_t t, const Mat4x4& transform, Vec3d out[3]) const
+{
+    if (packed.empty())
+        Mat4x4::MultiplyVectors(transform, tris[t].p, out, 3);
+    else
+        Mat4x4::MultiplyQuantized(transform, packed[t].p[0], out, 3);
+}
+
+template <bool Packed>
+inline void Mesh::transformTriangleAs(size_t t, const Mat4x4& transform, Vec3d out[3]) const
+{
+    if (Packed)
+        Mat4x4::MultiplyQuantized(transform, packed[t].p[0], out, 3);
+    else
+        Mat4x4::MultiplyVectors(transform, tris[t].p, out, 3);
+}
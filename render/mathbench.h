@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <stdio.h>
+#include "math.h"
+
+using namespace std;
+
+// Times the SSE backed math core against the scalar code it replaced: vector and matrix products
+// and normalize, each over the same inputs, and checks both give the same results
+class MathBenchmark {
+    size_t count = 1 << 20;
+    int timingRuns = 5;
+
+    vector<Vec3d> vectors;
+    vector<Mat4x4> matrices;
+    vector<Vec3d> vectorResults;
+    vector<Mat4x4> matrixResults;
+
+public:
+    int run() {
+        prepare();
+        printf("%zu inputs, best of %d runs\n", count, timingRuns);
+        printf("%-16s %10s %10s\n", "", "scalar", "SSE");
+
+        bool same = true;
+        same = compare("MultiplyVector",
+            [&]() { for (size_t i = 0; i < count; i++) vectorResults[i] = scalarMultiplyVector(matrices[i & 255], vectors[i]); },
+            [&]() { for (size_t i = 0; i < count; i++) vectorResults[i] = Mat4x4::MultiplyVector(matrices[i & 255], vectors[i]); },
+            [&]() { return vectorChecksum(); }) && same;
+
+        same = compare("MultiplyVectors",
+            [&]() { for (size_t i = 0; i < count; i++) vectorResults[i] = scalarMultiplyVector(matrices[0], vectors[i]); },
+            [&]() { Mat4x4::MultiplyVectors(matrices[0], vectors.data(), vectorResults.data(), count); },
+            [&]() { return vectorChecksum(); }) && same;
+
+        same = compare("MultiplyMatrix",
+            [&]() { for (size_t i = 0; i < count; i++) matrixResults[i & 255] = scalarMultiplyMatrix(matrices[i & 255], matrices[(i + 1) & 255]); },
+            [&]() { for (size_t i = 0; i < count; i++) matrixResults[i & 255] = Mat4x4::MultiplyMatrix(matrices[i & 255], matrices[(i + 1) & 255]); },
+            [&]() { return matrixChecksum(); }) && same;
+
+        same = compare("normalize",
+            [&]() { for (size_t i = 0; i < count; i++) vectorResults[i] = scalarNormalize(vectors[i]); },
+            [&]() { for (size_t i = 0; i < count; i++) vectorResults[i] = vectors[i].normalize(); },
+            [&]() { return vectorChecksum(); }) && same;
+
+        return same ? 0 : 1;
+    }
+
+private:
+    // Fixed generator so runs compare
+    void prepare() {
+        uint32_t seed = 12345;
+        auto random = [&seed]() {
+            seed = seed * 1664525u + 1013904223u;
+            return (seed >> 8) * (1.0f / 16777216.0f) * 2.0f - 1.0f;
+        };
+
+        vectors.resize(count);
+        for (auto& v : vectors)
+            v = Vec3d(random(), random(), random());
+
+        matrices.resize(256);
+        for (auto& m : matrices) {
+            for (auto& row : m.m)
+                for (auto& value : row)
+                    value = random();
+        }
+
+        vectorResults.resize(count);
+        matrixResults.resize(256);
+    }
+
+    // Runs both versions, prints the times and whether the results agree
+    template <typename Scalar, typename Fast, typename Checksum>
+    bool compare(const char* name, Scalar scalar, Fast fast, Checksum checksum) {
+        double scalarMs = time(scalar);
+        double scalarSum = checksum();
+        double fastMs = time(fast);
+        double fastSum = checksum();
+
+        // Summation order differs between the paths, so the results only agree to rounding
+        bool same = fabs(scalarSum - fastSum) <= 1e-4 * max(1.0, fabs(scalarSum));
+        printf("%-16s %7.3f ms %7.3f ms %6.2fx%s\n", name, scalarMs, fastMs, scalarMs / fastMs, same ? "" : "  results differ");
+        return same;
+    }
+
+    double vectorChecksum() const {
+        double sum = 0.0;
+        for (auto& v : vectorResults)
+            sum += v.x + v.y * 2.0 + v.z * 3.0 + v.w * 4.0;
+        return sum;
+    }
+
+    double matrixChecksum() const {
+        double sum = 0.0;
+        for (auto& m : matrixResults)
+            for (int r = 0; r < 4; r++)
+                for (int c = 0; c < 4; c++)
+                    sum += m.m[r][c] * (r * 4 + c + 1);
+        return sum;
+    }
+
+    // The scalar versions from before the math core used SSE, normalize without its exception
+    static Vec3d scalarMultiplyVector(const Mat4x4& m, const Vec3d& i) {
+        Vec3d v;
+        v.x = i.x * m.m[0][0] + i.y * m.m[1][0] + i.z * m.m[2][0] + i.w * m.m[3][0];
+        v.y = i.x * m.m[0][1] + i.y * m.m[1][1] + i.z * m.m[2][1] + i.w * m.m[3][1];
+        v.z = i.x * m.m[0][2] + i.y * m.m[1][2] + i.z * m.m[2][2] + i.w * m.m[3][2];
+        v.w = i.x * m.m[0][3] + i.y * m.m[1][3] + i.z * m.m[2][3] + i.w * m.m[3][3];
+        return v;
+    }
+
+    static Mat4x4 scalarMultiplyMatrix(const Mat4x4& m1, const Mat4x4& m2) {
+        Mat4x4 matrix;
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 4; r++)
+                matrix.m[r][c] = m1.m[r][0] * m2.m[0][c] + m1.m[r][1] * m2.m[1][c] + m1.m[r][2] * m2.m[2][c] + m1.m[r][3] * m2.m[3][c];
+        return matrix;
+    }
+
+    static Vec3d scalarNormalize(const Vec3d& v) {
+        float length = sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+        return length != 0.0f ? Vec3d(v.x / length, v.y / length, v.z / length) : Vec3d(0.0f, 0.0f, 0.0f);
+    }
+
+    template <typename F>
+    double time(F work) {
+        work();
+
+        double best = 1e30;
+        for (int run = 0; run < timingRuns; run++) {
+            auto start = chrono::steady_clock::now();
+            work();
+            best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+};
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <stdio.h>
+#include "framebuffer.h"
+
+using namespace std;
+
+// Compares a mesh in the order its file had, shuffled, and in the Morton order load time sorting
+// used before with the order Scene::addMesh leaves it in: how often a 16 entry vertex cache would
+// miss, how far apart consecutive triangles lie, how much of it the cluster cones reject and how
+// long a frame takes to rasterize and to trace. Include after renderer3d.cpp
+class MeshBenchmark {
+    string path;
+    float scale;
+
+    int width = 1280;
+    int height = 720;
+    int views = 16;
+    int timingRuns = 3;
+
+public:
+    // Without a path the mesh is a made up terrain grid, scale still applies
+    MeshBenchmark(string path, float scale) : path(path), scale(scale) {}
+
+    int run() {
+        Mesh loaded;
+        if (path.empty()) {
+            loaded = terrainGrid();
+        }
+        else if (!loaded.LoadFromObjectFile(path) || loaded.tris.empty()) {
+            printf("Cannot load %s\n", path.c_str());
+            return 1;
+        }
+        loaded.increaseSize(scale);
+        printf("%s, %zu triangles, %d views at %dx%d\n", path.empty() ? "terrain grid" : path.c_str(), loaded.tris.size(), views, width, height);
+
+        measure("file order", asLoaded(loaded));
+
+        // Exporters do not always write neighbours together, the same triangles in random order
+        Mesh shuffled = loaded;
+        shuffle(shuffled.tris.begin(), shuffled.tris.end(), mt19937(1));
+        measure("shuffled", asLoaded(shuffled));
+        measure("Morton", mortonOrdered(shuffled));
+
+        Scene scene;
+        measure("optimized", scene.addMesh(std::move(shuffled)));
+        return 0;
+    }
+
+private:
+    // 121 by 121 points half a unit apart, rolling hills, written row by row with two triangles per
+    // cell the way terrain exporters do
+    static Mesh terrainGrid() {
+        const int cells = 120;
+        auto point = [](int x, int z) {
+            float px = (x - cells / 2) * 0.5f, pz = (z - cells / 2) * 0.5f;
+            float py = 2.0f * sinf(px * 0.3f) * cosf(pz * 0.25f) + 1.5f * sinf(px * 0.11f + pz * 0.07f) - 3.0f;
+            return Vec3d(px, py, pz);
+        };
+
+        Mesh mesh;
+        for (int z = 0; z < cells; z++) {
+            for (int x = 0; x < cells; x++) {
+                Vec3d a = point(x, z), b = point(x + 1, z), c = point(x, z + 1), d = point(x + 1, z + 1);
+                mesh.tris.push_back({ a, c, b });
+                mesh.tris.push_back({ b, c, d });
+            }
+        }
+        return mesh;
+    }
+
+    // Clustered in chunks as the triangles come, so only the order differs from addMesh
+    static MeshRef asLoaded(const Mesh& loaded) {
+        Mesh mesh = loaded;
+        mesh.computeNormals();
+        mesh.computeBounds();
+        for (uint32_t first = 0; first < mesh.tris.size(); first += Mesh::clusterSize) {
+            uint32_t count = min((uint32_t)mesh.tris.size() - first, Mesh::clusterSize);
+            mesh.clusters.push_back(mesh.buildCluster(first, count));
+        }
+        return make_shared<const Mesh>(std::move(mesh));
+    }
+
+    // What buildClusters did before the Hilbert order and the walk by shared corners: triangles by
+    // dominant facing, then along a Morton curve, clusters closed at the size limit or a facing change
+    static MeshRef mortonOrdered(const Mesh& loaded) {
+        Mesh mesh = loaded;
+        mesh.computeNormals();
+
+        Vec3d minBound = mesh.tris[0].p[0], maxBound = minBound;
+        for (auto& tri : mesh.tris) {
+            for (auto& p : tri.p) {
+                minBound = { min(minBound.x, p.x), min(minBound.y, p.y), min(minBound.z, p.z) };
+                maxBound = { max(maxBound.x, p.x), max(maxBound.y, p.y), max(maxBound.z, p.z) };
+            }
+        }
+        Vec3d extent = maxBound - minBound;
+        Vec3d invExtent = { extent.x > 0 ? 1.0f / extent.x : 0.0f, extent.y > 0 ? 1.0f / extent.y : 0.0f, extent.z > 0 ? 1.0f / extent.z : 0.0f };
+
+        vector<uint64_t> keys(mesh.tris.size());
+        for (size_t i = 0; i < mesh.tris.size(); i++) {
+            Vec3d n = mesh.normal(i);
+            float ax = fabsf(n.x), ay = fabsf(n.y), az = fabsf(n.z);
+            uint64_t facing = ax >= ay && ax >= az ? (n.x < 0) : ay >= az ? 2 + (n.y < 0) : 4 + (n.z < 0);
+
+            Vec3d c = (mesh.tris[i].p[0] + mesh.tris[i].p[1] + mesh.tris[i].p[2]) * (1.0f / 3.0f) - minBound;
+            uint32_t code = mortonCode(c.x * invExtent.x, c.y * invExtent.y, c.z * invExtent.z);
+
+            keys[i] = (facing << 61) | ((uint64_t)code << 31) | i;
+        }
+        sort(keys.begin(), keys.end());
+
+        vector<Triangle> sorted(mesh.tris.size());
+        for (size_t i = 0; i < keys.size(); i++)
+            sorted[i] = mesh.tris[(uint32_t)(keys[i] & 0x7FFFFFFF)];
+        mesh.tris.swap(sorted);
+        mesh.computeNormals();
+        mesh.computeBounds();
+
+        uint32_t first = 0;
+        for (uint32_t i = 1; i <= (uint32_t)mesh.tris.size(); i++) {
+            if (i == mesh.tris.size() || i - first == Mesh::clusterSize || (keys[i] >> 61) != (keys[first] >> 61)) {
+                mesh.clusters.push_back(mesh.buildCluster(first, i - first));
+                first = i;
+            }
+        }
+        return make_shared<const Mesh>(std::move(mesh));
+    }
+
+    // Interleaves the low 10 bits of each coordinate, inputs are expected in [0, 1]
+    static uint32_t mortonCode(float x, float y, float z) {
+        auto expand = [](float f) {
+            uint32_t v = (uint32_t)min(max(f * 1023.0f, 0.0f), 1023.0f);
+            v = (v | (v << 16)) & 0x030000FF;
+            v = (v | (v << 8)) & 0x0300F00F;
+            v = (v | (v << 4)) & 0x030C30C3;
+            v = (v | (v << 2)) & 0x09249249;
+            return v;
+        };
+        return (expand(x) << 2) | (expand(y) << 1) | expand(z);
+    }
+
+    void measure(const char* name, MeshRef mesh) {
+        Scene scene;
+        scene.meshes.push_back(mesh);
+        scene.addInstance(mesh);
+
+        Vec3d center = (mesh->boundsMin + mesh->boundsMax) * 0.5f;
+        float extent = (mesh->boundsMax - mesh->boundsMin).length();
+
+        Renderer3d renderer(60.0f, (float)width, (float)height, scene);
+        renderer.setShadows(false);
+        Framebuffer image(width, height);
+
+        double rasterMs = 0.0, traceMs = 0.0, rejected = 0.0;
+        for (int view = 0; view < views; view++) {
+            // Turning in place above the middle, looking down and out
+            renderer.camera.vCameraPosition = { center.x, mesh->boundsMax.y + extent * 0.1f, center.z };
+            renderer.camera.fYaw = 6.2831853f * view / views;
+            renderer.camera.fPitch = 0.6f;
+
+            rasterMs += time([&]() { renderer.invalidate(); renderer.renderTo(image); });
+            traceMs += time([&]() { renderer.traceTo(image); });
+            rejected += rejectedByCones(*mesh, renderer.camera.vCameraPosition);
+        }
+
+        printf("%-12s %.3f cache misses per triangle, %.3f apart, %.1f%% rejected by cones, %.2f ms raster, %.2f ms traced\n",
+            name, missesPerTriangle(*mesh), meanStep(*mesh), 100.0 * rejected / views, rasterMs / views, traceMs / views);
+    }
+
+    // Average cache miss ratio of a 16 entry FIFO vertex cache, corners matched by position
+    static double missesPerTriangle(const Mesh& mesh) {
+        deque<Vec3d> cache;
+        size_t misses = 0;
+        for (size_t t = 0; t < mesh.triangleCount(); t++) {
+            for (int corner = 0; corner < 3; corner++) {
+                Vec3d p = mesh.position(t, corner);
+                bool hit = false;
+                for (auto& c : cache)
+                    hit = hit || (c.x == p.x && c.y == p.y && c.z == p.z);
+                if (hit)
+                    continue;
+
+                misses++;
+                cache.push_back(p);
+                if (cache.size() > 16)
+                    cache.pop_front();
+            }
+        }
+        return (double)misses / mesh.triangleCount();
+    }
+
+    // Mean distance between the centers of triangles next to each other in memory
+    static double meanStep(const Mesh& mesh) {
+        auto center = [&](size_t t) { return (mesh.position(t, 0) + mesh.position(t, 1) + mesh.position(t, 2)) * (1.0f / 3.0f); };
+
+        double total = 0.0;
+        for (size_t t = 1; t < mesh.triangleCount(); t++)
+            total += (center(t) - center(t - 1)).length();
+        return total / max((size_t)1, mesh.triangleCount() - 1);
+    }
+
+    static double rejectedByCones(const Mesh& mesh, const Vec3d& viewer) {
+        size_t count = 0;
+        for (auto& cluster : mesh.clusters) {
+            if (cluster.isBackfacing(viewer))
+                count += cluster.count;
+        }
+        return (double)count / mesh.triangleCount();
+    }
+
+    template <typename F>
+    double time(F draw) {
+        draw();
+
+        double best = 1e30;
+        for (int run = 0; run < timingRuns; run++) {
+            auto start = chrono::steady_clock::now();
+            draw();
+            best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+};
@@ -1,32 +1,59 @@
 #include "math.h"
+#include "scene.h"
+#include "heightfield.h"
+#include "bodies.h"
 #include <list>
 
 using namespace std;
 
 class PhysicsObject {
-	Mesh& mesh;
-	Mesh collidingMesh;
-	Vec3d previousPosition;
-	Vec3d position;
+	// Rendered copy of the object, placed through its instance transform instead of moving vertices
+	Scene& scene;
+	size_t instance;
 
-	Vec3d velocity = { 0,0,0 };
-	bool collidable = true;
+	// Collision geometry is shared and kept in object space, offset by position when tested
+	MeshRef collidingMesh;
+
+	// Position, velocity and sleep state live in the store, integrated there for all bodies at once.
+	// A sleeping body is not integrated or collided until something pushes it or a moving body runs into it
+	BodyStore* bodies;
+	BodyHandle body;
 	bool invisible = false;
 
+	// Share of its speed a body keeps per tick it touches the terrain
+	static constexpr float terrainFriction = 0.8f;
+	static constexpr float terrainMargin = 0.05f;
+
 public:
-	PhysicsObject(Mesh& mesh, Vec3d position) : mesh(mesh), position(position) {
-		previousPosition = position;
+	PhysicsObject(Scene& scene, BodyStore& bodies, size_t instance, Vec3d position) : scene(scene), instance(instance), bodies(&bodies) {
+		collidingMesh = scene.getInstance(instance).mesh;
+		body = bodies.create(position);
+		placeInstance();
 	}
 
 	void collide(PhysicsObject& p) {
-		if (!collidable || !p.isCollidable()) {
+		if (!isCollidable() || !p.isCollidable()) {
+			return;
+		}
+
+		if (!collidingMesh) {
 			return;
 		}
 
-		for (auto& tri : collidingMesh.tris) {
+		Vec3d position = getPosition();
+		Vec3d velocity = getVelocity();
+
+		for (size_t t = 0; t < collidingMesh->triangleCount(); t++) {
+			Triangle tri = toWorld(collidingMesh->triangle(t), position);
+
 			if (p.isCollidingWithTri(tri)) {
-				// Calculate the normal of the triangle
-				Vec3d normal = tri.getNormal();
+				// Only a moving body wakes this one or restarts its count, resting bodies touching let each other sleep
+				if (p.isMoving()) {
+					wake();
+				}
+
+				// Normals are precomputed on the shared mesh and unaffected by translation
+				Vec3d normal = collidingMesh->normal(t);
 
 				// Calculate the distance between the two objects
 				Vec3d distance = position - p.getPosition();
@@ -43,29 +70,45 @@ public:
 				// Set the new position and velocity of the object
 				position = newPosition;
 				velocity = newVelocity;
+				bodies->setPosition(body, position);
+				bodies->setVelocity(body, velocity);
 			}
 		}
 	}
 
 	bool isColliding(PhysicsObject& p) {
-		if (!collidable || !p.isCollidable()) {
+		if (!isCollidable() || !p.isCollidable()) {
 			return false;
 		}
 
-		for (auto& tri : collidingMesh.tris) {
-			if (p.isCollidingWithTri(tri)) {
+		if (!collidingMesh) {
+			return false;
+		}
+
+		Vec3d position = getPosition();
+		for (size_t t = 0; t < collidingMesh->triangleCount(); t++) {
+			if (p.isCollidingWithTri(toWorld(collidingMesh->triangle(t), position))) {
 				return true;
 			}
 		}
+
+		return false;
 	}
 
 	bool isCollidingWithTri(const Triangle& tri) const {
 		// Check if the distance between the object and the triangle is less than a threshold
 		const float collisionThreshold = 1.0f;
 
-		for (Triangle triColliding : collidingMesh.tris) {
+		if (!collidingMesh) {
+			return false;
+		}
+
+		Vec3d position = getPosition();
+		for (size_t t = 0; t < collidingMesh->triangleCount(); t++) {
+			Triangle triColliding = collidingMesh->triangle(t);
 			for (int i = 0; i < 3; ++i) {
-				float distance = calculateDistanceToTriangle(triColliding, tri.p[i]);
+				// Move the point into our object space rather than every triangle into world space
+				float distance = calculateDistanceToTriangle(triColliding, tri.p[i] - position);
 				if (distance < collisionThreshold) {
 					return true;
 				}
@@ -84,81 +127,227 @@ public:
 		return std::sqrt(dx * dx + dy * dy + dz * dz);
 	}
 
+	// Moves the rendered copy after the store integrated the body
 	void update() {
-		position = position + velocity;
-
-		Vec3d positionChange = position - previousPosition;
-		mesh.moveMesh(positionChange);
-		moveVertices(positionChange);
-		previousPosition = position;
+		if (bodies->hasMoved(body)) {
+			placeInstance();
+		}
 	}
 
-	void moveVertices(Vec3d positionChange) {
-		for (auto& tri : collidingMesh.tris) {
-			for (auto& vertex : tri.p) {
-				vertex = vertex + positionChange;
+	// Keeps the bottom of the body's bounds on the terrain. Four height lookups under its corners
+	// instead of testing triangles. Landing stops the motion into the ground and friction slows
+	// the rest, so the body comes to rest and can fall asleep
+	void collideTerrain(const Heightfield& terrain) {
+		if (isAsleep() || !isCollidable() || !collidingMesh) {
+			return;
+		}
+
+		Vec3d position = getPosition();
+		Vec3d velocity = getVelocity();
+
+		const Vec3d& low = collidingMesh->boundsMin;
+		const Vec3d& high = collidingMesh->boundsMax;
+
+		float ground = -INFINITY;
+		Vec3d under;
+		for (int i = 0; i < 4; i++) {
+			float x = position.x + (i & 1 ? high.x : low.x);
+			float z = position.z + (i & 2 ? high.z : low.z);
+			float height = terrain.heightAt(x, z);
+			if (height > ground) {
+				ground = height;
+				under = { x, 0.0f, z };
 			}
 		}
+
+		// Sliding along a slope leaves small gaps, a body that close still counts as touching
+		float depth = ground - (position.y + low.y);
+		if (depth < -terrainMargin) {
+			return;
+		}
+
+		if (depth > 0.0f) {
+			position.y += depth;
+			bodies->setPosition(body, position);
+			placeInstance();
+		}
+
+		Vec3d normal = terrain.normalAt(under.x, under.z);
+		float into = velocity.dot(normal);
+		if (into < 0.0f) {
+			velocity = velocity - normal * into;
+		}
+		velocity = velocity * terrainFriction;
+		velocity.w = 0.0f;
+		bodies->setVelocity(body, velocity);
+	}
+
+	// Fast enough to wake the bodies it touches
+	bool isMoving() const {
+		Vec3d velocity = getVelocity();
+		return velocity.dot(velocity) >= BodyStore::sleepSpeed * BodyStore::sleepSpeed;
+	}
+
+	bool isAsleep() const {
+		return bodies->isAsleep(body);
+	}
+
+	// Back to being simulated, also restarts the count toward sleeping
+	void wake() {
+		bodies->wake(body);
+	}
+
+	void placeInstance() {
+		Vec3d position = getPosition();
+		scene.setTransform(instance, Mat4x4::MakeTranslation(position.x, position.y, position.z));
+		bodies->markPlaced(body);
+	}
+
+	Triangle toWorld(const Triangle& localTri, const Vec3d& position) const {
+		Triangle tri = localTri;
+		for (auto& vertex : tri.p) {
+			vertex = vertex + position;
+		}
+		return tri;
 	}
 
 	void addGravity() {
+		Vec3d velocity = getVelocity();
 		velocity.y -= 0.981f;
+		bodies->setVelocity(body, velocity);
+		wake();
 	}
 
 	void setVelocity(Vec3d velocity) {
-		this->velocity = velocity;
+		bodies->setVelocity(body, velocity);
+		wake();
 	}
 
 	void setInvisible(bool invisible) {
 		this->invisible = invisible;
+		scene.setInvisible(instance, invisible);
 	}
 
 	bool isInvisible() {
 		return invisible;
 	}
 
-	bool isCollidable() {
-		return collidable;
+	bool isCollidable() const {
+		return bodies->isCollidable(body);
 	}
 
 	void setCollidable(bool collidable) {
-		this->collidable = collidable;
+		bodies->setCollidable(body, collidable);
+	}
+
+	const Mesh& getMesh() {
+		return *collidingMesh;
 	}
 
-	Mesh getMesh() {
-		return mesh;
+	size_t getInstance() {
+		return instance;
 	}
 
-	Vec3d getPosition() {
-		return position;
+	BodyHandle getBody() const {
+		return body;
+	}
+
+	Vec3d getPosition() const {
+		return bodies->getPosition(body);
+	}
+
+	Vec3d getVelocity() const {
+		return bodies->getVelocity(body);
+	}
+
+	// Moves the body without it travelling there, for restoring a saved state
+	void setPosition(Vec3d position) {
+		bodies->setPosition(body, position);
+		placeInstance();
 	}
 };
 
 
 class Physics3d {
 	vector<PhysicsObject>& physicsObjects;
-	vector<Mesh>& meshes;
+	Scene& scene;
+
+	// State of every body, physicsObjects hold handles into it
+	BodyStore bodies;
+
+	// Pulled off every awake body's vertical speed each tick. Off unless set, bodies fall through
+	// PhysicsObject::addGravity
+	float gravity = 0.0f;
+
+	// Bodies awake at the start of the tick, only pairs with one of them in it are tested
+	vector<size_t> awake;
+
+	// Static ground the bodies rest on, queried per body instead of collided as a mesh
+	const Heightfield* terrain = nullptr;
 
 public:
-	Physics3d(vector<Mesh>& meshes, vector<PhysicsObject>& physicsObjects) : meshes(meshes), physicsObjects(physicsObjects){
+	Physics3d(Scene& scene, vector<PhysicsObject>& physicsObjects) : scene(scene), physicsObjects(physicsObjects){
 		
 	}
 
-	void addPhysicsObject(PhysicsObject& physicsObject) {
-		physicsObjects.push_back(physicsObject);
+	// The heightfield has to outlive the simulation, null removes it
+	void setTerrain(const Heightfield* terrain) {
+		this->terrain = terrain;
+	}
+
+	// A body for a scene instance, simulated from the next update on
+	PhysicsObject& addPhysicsObject(size_t instance, Vec3d position) {
+		physicsObjects.emplace_back(scene, bodies, instance, position);
+		return physicsObjects.back();
+	}
+
+	void setGravity(float gravity) {
+		this->gravity = gravity;
 	}
 
+	// Sleeping bodies cost one test each and are not integrated at all. A sleeping body only checks
+	// for contact with moving bodies, which wakes it, two resting ones touching leave each other asleep
 	void update() {
-		for (auto& physicsObject : physicsObjects) {
-			physicsObject.update();
+		awake.clear();
+		for (size_t i = 0; i < physicsObjects.size(); i++) {
+			if (!physicsObjects[i].isAsleep()) {
+				awake.push_back(i);
+			}
 		}
 
-		for (auto& physicsObject : physicsObjects) {
-			for (auto& physicsObject2 : physicsObjects) {
-				if (&physicsObject != &physicsObject2) {
-					physicsObject.collide(physicsObject2);
+		bodies.integrate(gravity);
+
+		for (size_t i : awake) {
+			physicsObjects[i].update();
+			if (terrain) {
+				physicsObjects[i].collideTerrain(*terrain);
+			}
+		}
+
+		for (size_t i : awake) {
+			// Fell asleep in this tick's integrate
+			PhysicsObject& physicsObject = physicsObjects[i];
+			if (physicsObject.isAsleep()) {
+				continue;
+			}
+
+			for (size_t j = 0; j < physicsObjects.size(); j++) {
+				if (j == i) {
+					continue;
+				}
+
+				PhysicsObject& physicsObject2 = physicsObjects[j];
+				physicsObject.collide(physicsObject2);
+
+				// Awake ones collide in their own turn
+				if (physicsObject2.isAsleep() && physicsObject.isMoving()) {
+					physicsObject2.collide(physicsObject);
 				}
 			}
 		}
 	}
+
+	size_t getAwakeCount() const {
+		return awake.size();
+	}
 };
\ No newline at end of file
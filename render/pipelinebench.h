@@ -0,0 +1,141 @@
+#pragma once
+
+#include <chrono>
+#include <stdio.h>
+#include "framebuffer.h"
+
+using namespace std;
+
+// Times building the raster list with the pipeline variant each setup selects against the generic
+// pass that tests every choice per triangle, and checks both draw the same image.
+// Include after renderer3d.cpp
+class PipelineBenchmark {
+    int width = 1280;
+    int height = 720;
+    int timingRuns = 5;
+
+    struct Setup {
+        const char* name;
+        bool shadows;
+        bool lights;
+        bool textured;
+        bool inside; // Camera down among the cubes, the floor crosses the near plane
+    };
+
+public:
+    int run() {
+        Setup setups[] = {
+            { "plain", false, false, false, false },
+            { "shadowed", true, false, false, false },
+            { "local lights", false, true, false, false },
+            { "textured", false, false, true, false },
+            { "near clipped", false, false, false, true },
+            { "everything", true, true, true, true },
+        };
+
+        printf("%-14s %10s %12s %8s\n", "setup", "generic", "specialized", "");
+        int failed = 0;
+        for (auto& setup : setups) {
+            failed += measure(setup) ? 0 : 1;
+        }
+        return failed == 0 ? 0 : 1;
+    }
+
+private:
+    bool measure(const Setup& setup) {
+        Scene scene;
+        build(scene, setup);
+
+        Renderer3d renderer(60.0f, (float)width, (float)height, scene);
+        renderer.setShadows(setup.shadows);
+        if (setup.inside) {
+            renderer.camera.vCameraPosition = { 0.0f, 0.3f, 2.0f };
+            renderer.camera.fPitch = 0.1f;
+        }
+        else {
+            renderer.camera.vCameraPosition = { 0.0f, 8.0f, -6.0f };
+            renderer.camera.fPitch = 0.6f;
+        }
+
+        Framebuffer generic(width, height), specialized(width, height);
+
+        renderer.setSpecializedPipeline(false);
+        double genericMs = time(renderer);
+        renderer.renderTo(generic);
+
+        renderer.setSpecializedPipeline(true);
+        double specializedMs = time(renderer);
+        renderer.renderTo(specialized);
+
+        bool same = generic.color == specialized.color;
+        printf("%-14s %7.3f ms %9.3f ms %7.2fx%s\n", setup.name, genericMs, specializedMs, genericMs / specializedMs, same ? "" : "  images differ");
+        return same;
+    }
+
+    // A tessellated floor under rows of cubes
+    static void build(Scene& scene, const Setup& setup) {
+        Mesh floor;
+        const int cells = 64;
+        const float size = 0.5f;
+        for (int z = 0; z < cells; z++) {
+            for (int x = 0; x < cells; x++) {
+                Vec3d a(x * size, 0.0f, z * size), b((x + 1) * size, 0.0f, z * size);
+                Vec3d c(x * size, 0.0f, (z + 1) * size), d((x + 1) * size, 0.0f, (z + 1) * size);
+                floor.tris.push_back({ a, c, b });
+                floor.tris.push_back({ b, c, d });
+            }
+        }
+        size_t ground = scene.addInstance(scene.addMesh(std::move(floor)), Mat4x4::MakeTranslation(-16.0f, 0.0f, 0.0f));
+
+        Mesh cube;
+        cube.createCubeoid({ -0.3f, 0.0f, -0.3f }, { 0.3f, 0.6f, 0.3f });
+        MeshRef cubeRef = scene.addMesh(cube);
+        for (int z = 0; z < 16; z++) {
+            for (int x = -8; x < 8; x++) {
+                scene.addInstance(cubeRef, Mat4x4::MakeTranslation(x * 2.0f, 0.0f, 4.0f + z * 2.0f));
+            }
+        }
+
+        if (setup.textured) {
+            const int texels = 64;
+            vector<uint32_t> pixels(texels * texels);
+            for (int y = 0; y < texels; y++) {
+                for (int x = 0; x < texels; x++) {
+                    bool odd = ((x / 8) + (y / 8)) % 2 != 0;
+                    pixels[y * texels + x] = Framebuffer::packColor(odd ? Vec3d(1.0f, 0.9f, 0.2f) : Vec3d(0.1f, 0.3f, 0.8f));
+                }
+            }
+            shared_ptr<Texture> checker = Texture::fromPixels(texels, texels, pixels);
+            for (auto& instance : scene.instances) {
+                instance.material.texture = checker;
+            }
+        }
+
+        if (setup.lights) {
+            for (int i = 0; i < 32; i++) {
+                Light light;
+                light.position = { (i % 8) * 4.0f - 14.0f, 0.5f, 4.0f + (i / 8) * 7.0f };
+                light.color = { (i & 1) ? 1.0f : 0.3f, (i & 2) ? 1.0f : 0.3f, (i & 4) ? 1.0f : 0.3f };
+                light.range = 3.0f;
+                scene.addLight(light);
+            }
+        }
+
+        scene.getInstance(ground).material.color = { 0.5f, 0.5f, 0.5f };
+    }
+
+    // Best of a few full rebuilds of the raster list
+    double time(Renderer3d& renderer) {
+        renderer.invalidate();
+        renderer.prepare();
+
+        double best = 1e30;
+        for (int run = 0; run < timingRuns; run++) {
+            renderer.invalidate();
+            auto start = chrono::steady_clock::now();
+            renderer.prepare();
+            best = min(best, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        }
+        return best;
+    }
+};
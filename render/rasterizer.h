@@ -0,0 +1,479 @@
+#pragma once
+
+#include "math.h"
+#include "framebuffer.h"
+#include "texture.h"
+#include "cpu.h"
+
+using namespace std;
+
+// Half-space rasterizer, vertices are in pixel coordinates with depth in z (0 near, 1 far).
+// Edges are set up in 28.4 fixed point so neighbouring triangles never leave gaps or double
+// cover a pixel, then the bounding box is walked in 8x8 blocks: blocks outside an edge are
+// skipped, blocks inside all edges only run the depth test, and the rest evaluate coverage
+// and depth for a row of 8 pixels at once. Both windings are drawn, like the GL path.
+// Textured triangles share the same coverage and depth work and only shade the pixels that pass.
+// Targets without a color plane, like shadow maps, only get depth written
+class Rasterizer {
+public:
+    static const int subPixelBits = 4;
+    static const int subPixels = 1 << subPixelBits;
+    static const int blockSize = 8;
+
+    // Vertices further out than this are clipped first so every edge value fits its integer type
+    static constexpr float guardBand = 4096.0f;
+
+    static CpuPath getPath() {
+        return activePath();
+    }
+
+    // Pin a slower path than the CPU supports, e.g. to compare its output against the others
+    static void setPath(CpuPath path) {
+        activePath() = min(path, Cpu::getPath());
+    }
+
+    static void drawTriangle(Framebuffer& target, const Vec3d& v0, const Vec3d& v1, const Vec3d& v2, uint32_t color) {
+        Vertex v[3] = { { v0 }, { v1 }, { v2 } };
+        drawVertices(target, v, color, nullptr);
+    }
+
+    // Points carry 1/w of the clip space position in p.w and the texture coordinates come already
+    // multiplied by it, so they interpolate linearly across the screen. Texels are modulated by shade
+    static void drawTexturedTriangle(Framebuffer& target, const Vec3d p[3], const Vec2f t[3], const Vec3d& shade, const Texture& texture) {
+        Vertex v[3] = { { p[0], t[0] }, { p[1], t[1] }, { p[2], t[2] } };
+        Surface surface = { &texture, shade };
+        drawVertices(target, v, 0, &surface);
+    }
+
+private:
+    struct Vertex {
+        Vec3d p;
+        Vec2f t;
+    };
+
+    struct Surface {
+        const Texture* texture;
+        Vec3d shade;
+    };
+
+    // An attribute interpolated across the triangle, relative to pixel (minX, minY) to keep the terms small
+    struct Plane {
+        float origin = 0.0f, stepX = 0.0f, stepY = 0.0f;
+
+        float at(int dx, int dy) const {
+            return origin + stepX * dx + stepY * dy;
+        }
+    };
+
+    // Edge i is opposite vertex i, value = a * px + b * py + c at the center of pixel (px, py),
+    // positive inside. c already includes the fill rule bias
+    struct Setup {
+        int64_t a[3], b[3], c[3];
+        int minX, minY, maxX, maxY;
+
+        // Vertex i of the edges is vertex order[i] of the input, the winding flip swaps two
+        int order[3];
+        double invArea;
+
+        // Depth at pixel centers
+        Plane depth;
+
+        float depthAt(int px, int py) const {
+            return depth.at(px - minX, py - minY);
+        }
+    };
+
+    // u/w, v/w and 1/w are affine in screen space, dividing them back per pixel keeps the texture
+    // from swimming when triangles are seen at an angle
+    struct TextureShader {
+        const Texture* texture;
+        Vec3d shade;
+        Plane q, uq, vq;
+        int minX, minY;
+        float width, height;
+
+        uint32_t shadePixel(int px, int py) const {
+            int dx = px - minX, dy = py - minY;
+            float invQ = 1.0f / q.at(dx, dy);
+            float u = uq.at(dx, dy) * invQ;
+            float v = vq.at(dx, dy) * invQ;
+
+            // Screen space derivatives of the texel position pick the mip level
+            float dudx = (uq.stepX - u * q.stepX) * invQ * width;
+            float dvdx = (vq.stepX - v * q.stepX) * invQ * height;
+            float dudy = (uq.stepY - u * q.stepY) * invQ * width;
+            float dvdy = (vq.stepY - v * q.stepY) * invQ * height;
+            float rho = max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy);
+            float lod = rho > 1.0f ? 0.5f * log2f(rho) : 0.0f;
+
+            Vec3d texel = texture->sample(u, v, lod);
+            return Framebuffer::packColor({ texel.x * shade.x, texel.y * shade.y, texel.z * shade.z });
+        }
+    };
+
+    static CpuPath& activePath() {
+        static CpuPath path = Cpu::getPath();
+        return path;
+    }
+
+    static void drawVertices(Framebuffer& target, const Vertex v[3], uint32_t color, const Surface* surface) {
+        if (outsideGuardBand(target, v[0].p) || outsideGuardBand(target, v[1].p) || outsideGuardBand(target, v[2].p)) {
+            drawClipped(target, v, color, surface);
+            return;
+        }
+
+        drawSingle(target, v[0], v[1], v[2], color, surface);
+    }
+
+    static void drawSingle(Framebuffer& target, const Vertex& v0, const Vertex& v1, const Vertex& v2, uint32_t color, const Surface* surface) {
+        Setup setup;
+        if (!setupTriangle(target, v0.p, v1.p, v2.p, setup))
+            return;
+
+        if (!surface) {
+            drawSetup(target, setup, color, nullptr);
+            return;
+        }
+
+        TextureShader shader;
+        shader.texture = surface->texture;
+        shader.shade = surface->shade;
+        shader.q = makePlane(setup, v0.p.w, v1.p.w, v2.p.w);
+        shader.uq = makePlane(setup, v0.t.x, v1.t.x, v2.t.x);
+        shader.vq = makePlane(setup, v0.t.y, v1.t.y, v2.t.y);
+        shader.minX = setup.minX;
+        shader.minY = setup.minY;
+        shader.width = (float)surface->texture->baseWidth();
+        shader.height = (float)surface->texture->baseHeight();
+        drawSetup(target, setup, color, &shader);
+    }
+
+    static void drawSetup(Framebuffer& target, const Setup& setup, uint32_t color, const TextureShader* shader) {
+        switch (getPath()) {
+#ifdef CPU_X86
+        case CpuPath::AVX2: drawBlocksAVX2(target, setup, color, shader); break;
+        case CpuPath::SSE2: drawBlocksSSE2(target, setup, color, shader); break;
+#endif
+        default: drawBlocksScalar(target, setup, color, shader); break;
+        }
+    }
+
+    static bool outsideGuardBand(const Framebuffer& target, const Vec3d& v) {
+        return !(v.x >= -guardBand && v.x <= target.width + guardBand && v.y >= -guardBand && v.y <= target.height + guardBand);
+    }
+
+    static bool setupTriangle(const Framebuffer& target, const Vec3d& v0, const Vec3d& v1, const Vec3d& v2, Setup& s) {
+        int64_t x[3] = { llroundf(v0.x * subPixels), llroundf(v1.x * subPixels), llroundf(v2.x * subPixels) };
+        int64_t y[3] = { llroundf(v0.y * subPixels), llroundf(v1.y * subPixels), llroundf(v2.y * subPixels) };
+
+        int64_t area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+        if (area == 0)
+            return false;
+
+        s.order[0] = 0;
+        s.order[1] = 1;
+        s.order[2] = 2;
+
+        // Flip to one winding so inside is always positive
+        if (area < 0) {
+            swap(x[1], x[2]);
+            swap(y[1], y[2]);
+            swap(s.order[1], s.order[2]);
+            area = -area;
+        }
+
+        s.minX = max(0, (int)((min(x[0], min(x[1], x[2])) >> subPixelBits)));
+        s.minY = max(0, (int)((min(y[0], min(y[1], y[2])) >> subPixelBits)));
+        s.maxX = min(target.width - 1, (int)((max(x[0], max(x[1], x[2])) + subPixels - 1) >> subPixelBits));
+        s.maxY = min(target.height - 1, (int)((max(y[0], max(y[1], y[2])) + subPixels - 1) >> subPixelBits));
+        if (s.minX > s.maxX || s.minY > s.maxY)
+            return false;
+
+        for (int i = 0; i < 3; i++) {
+            int j = (i + 1) % 3, k = (i + 2) % 3;
+            int64_t dx = x[k] - x[j];
+            int64_t dy = y[k] - y[j];
+
+            // E(P) = dx * (P.y - y[j]) - dy * (P.x - x[j]), P at pixel center (px + 0.5) * subPixels
+            s.a[i] = -dy * subPixels;
+            s.b[i] = dx * subPixels;
+            s.c[i] = dx * (subPixels / 2 - y[j]) - dy * (subPixels / 2 - x[j]);
+
+            // Top-left rule: pixels exactly on an edge only belong to the triangle on its top or left side
+            bool topLeft = (dy == 0 && dx > 0) || dy < 0;
+            if (!topLeft)
+                s.c[i] -= 1;
+        }
+
+        s.invArea = 1.0 / (double)area;
+        s.depth = makePlane(s, v0.z, v1.z, v2.z);
+
+        return true;
+    }
+
+    // From the barycentric weights, value = sum(E_i * value_i) / area, values in input vertex order
+    static Plane makePlane(const Setup& s, float value0, float value1, float value2) {
+        float input[3] = { value0, value1, value2 };
+        float v[3] = { input[s.order[0]], input[s.order[1]], input[s.order[2]] };
+
+        Plane plane;
+        plane.stepX = (float)((s.a[0] * v[0] + s.a[1] * v[1] + s.a[2] * v[2]) * s.invArea);
+        plane.stepY = (float)((s.b[0] * v[0] + s.b[1] * v[1] + s.b[2] * v[2]) * s.invArea);
+        double atZero = (s.c[0] * (double)v[0] + s.c[1] * (double)v[1] + s.c[2] * (double)v[2]) * s.invArea;
+        plane.origin = (float)(atZero + (double)plane.stepX * s.minX + (double)plane.stepY * s.minY);
+        return plane;
+    }
+
+    // 0 outside, 1 partially covered, 2 fully inside. Edge values at the block origin come back
+    // clamped to 32 bits: edges crossing the block are small anyway, and an edge the block lies
+    // entirely inside stays positive after the clamp since it moves less than 2^27 across a block
+    static int classifyBlock(const Setup& s, int bx, int by, int32_t e[3]) {
+        const int64_t span = blockSize - 1;
+        const int64_t limit = 1 << 30;
+        bool full = true;
+
+        for (int i = 0; i < 3; i++) {
+            int64_t value = s.a[i] * bx + s.b[i] * by + s.c[i];
+            int64_t maxValue = value + max<int64_t>(s.a[i], 0) * span + max<int64_t>(s.b[i], 0) * span;
+            int64_t minValue = value + min<int64_t>(s.a[i], 0) * span + min<int64_t>(s.b[i], 0) * span;
+
+            if (maxValue < 0)
+                return 0;
+            if (minValue < 0)
+                full = false;
+
+            e[i] = (int32_t)min(max(value, -limit), limit);
+        }
+
+        return full ? 2 : 1;
+    }
+
+    template<typename Row>
+    static void forEachBlock(Framebuffer& target, const Setup& s, Row row) {
+        int startX = s.minX & ~(blockSize - 1);
+        int startY = s.minY & ~(blockSize - 1);
+
+        for (int by = startY; by <= s.maxY; by += blockSize) {
+            int rows = min(blockSize, target.height - by);
+
+            for (int bx = startX; bx <= s.maxX; bx += blockSize) {
+                int32_t e[3];
+                int coverage = classifyBlock(s, bx, by, e);
+                if (coverage == 0) continue;
+
+                int columns = min(blockSize, target.width - bx);
+
+                for (int r = 0; r < rows; r++) {
+                    int32_t rowEdges[3] = {
+                        e[0] + (int32_t)s.b[0] * r,
+                        e[1] + (int32_t)s.b[1] * r,
+                        e[2] + (int32_t)s.b[2] * r,
+                    };
+                    float z = s.depthAt(bx, by + r);
+                    row(bx, by + r, columns, coverage == 2, rowEdges, z);
+                }
+            }
+        }
+    }
+
+    // Every path computes depth as row depth + column * step, so they all write identical images
+    static void drawBlocksScalar(Framebuffer& target, const Setup& s, uint32_t color, const TextureShader* shader) {
+        int32_t stepX[3] = { (int32_t)s.a[0], (int32_t)s.a[1], (int32_t)s.a[2] };
+        const bool depthOnly = target.color.empty();
+
+        forEachBlock(target, s, [&](int x, int y, int columns, bool full, const int32_t* e, float z) {
+            size_t index = (size_t)y * target.width + x;
+
+            for (int c = 0; c < columns; c++, index++) {
+                bool covered = full || ((e[0] + stepX[0] * c) | (e[1] + stepX[1] * c) | (e[2] + stepX[2] * c)) >= 0;
+                float depth = z + (float)c * s.depth.stepX;
+
+                if (covered && depth < target.depth[index]) {
+                    target.depth[index] = depth;
+                    if (!depthOnly)
+                        target.color[index] = shader ? shader->shadePixel(x + c, y) : color;
+                }
+            }
+        });
+    }
+
+#ifdef CPU_X86
+    // A block row is handled as two groups of 4 pixels
+    static void drawBlocksSSE2(Framebuffer& target, const Setup& s, uint32_t color, const TextureShader* shader) {
+        const __m128i colorValue = _mm_set1_epi32((int)color);
+        const __m128i minusOne = _mm_set1_epi32(-1);
+        const bool depthOnly = target.color.empty();
+
+        __m128i lanes[2] = { _mm_setr_epi32(0, 1, 2, 3), _mm_setr_epi32(4, 5, 6, 7) };
+        __m128 laneZ[2];
+        __m128i stepX[2][3];
+        for (int h = 0; h < 2; h++) {
+            laneZ[h] = _mm_mul_ps(_mm_cvtepi32_ps(lanes[h]), _mm_set1_ps(s.depth.stepX));
+            for (int i = 0; i < 3; i++) {
+                int32_t a = (int32_t)s.a[i], first = h * 4;
+                stepX[h][i] = _mm_setr_epi32(a * first, a * (first + 1), a * (first + 2), a * (first + 3));
+            }
+        }
+
+        forEachBlock(target, s, [&](int x, int y, int columns, bool full, const int32_t* e, float z) {
+            size_t rowIndex = (size_t)y * target.width + x;
+
+            for (int h = 0; h * 4 < columns; h++) {
+                size_t index = rowIndex + h * 4;
+
+                __m128i mask = _mm_cmplt_epi32(lanes[h], _mm_set1_epi32(columns));
+                if (!full) {
+                    __m128i e0 = _mm_add_epi32(_mm_set1_epi32(e[0]), stepX[h][0]);
+                    __m128i e1 = _mm_add_epi32(_mm_set1_epi32(e[1]), stepX[h][1]);
+                    __m128i e2 = _mm_add_epi32(_mm_set1_epi32(e[2]), stepX[h][2]);
+                    mask = _mm_and_si128(mask, _mm_cmpgt_epi32(_mm_or_si128(_mm_or_si128(e0, e1), e2), minusOne));
+                }
+
+                __m128 zv = _mm_add_ps(_mm_set1_ps(z), laneZ[h]);
+
+                if (columns - h * 4 >= 4) {
+                    __m128 depth = _mm_loadu_ps(&target.depth[index]);
+                    __m128i pass = _mm_and_si128(mask, _mm_castps_si128(_mm_cmplt_ps(zv, depth)));
+
+                    __m128 passF = _mm_castsi128_ps(pass);
+                    _mm_storeu_ps(&target.depth[index], _mm_or_ps(_mm_and_ps(passF, zv), _mm_andnot_ps(passF, depth)));
+
+                    if (shader) {
+                        int bits = _mm_movemask_ps(passF);
+                        for (int l = 0; l < 4; l++) {
+                            if (bits & (1 << l))
+                                target.color[index + l] = shader->shadePixel(x + h * 4 + l, y);
+                        }
+                    }
+                    else if (!depthOnly) {
+                        __m128i* dst = (__m128i*)&target.color[index];
+                        __m128i old = _mm_loadu_si128(dst);
+                        _mm_storeu_si128(dst, _mm_or_si128(_mm_and_si128(pass, colorValue), _mm_andnot_si128(pass, old)));
+                    }
+                }
+                else {
+                    // Right edge of the framebuffer, finish the last few pixels one by one
+                    alignas(16) int32_t m[4];
+                    alignas(16) float zs[4];
+                    _mm_store_si128((__m128i*)m, mask);
+                    _mm_store_ps(zs, zv);
+                    for (int l = 0; l < columns - h * 4; l++) {
+                        if (m[l] && zs[l] < target.depth[index + l]) {
+                            target.depth[index + l] = zs[l];
+                            if (!depthOnly)
+                                target.color[index + l] = shader ? shader->shadePixel(x + h * 4 + l, y) : color;
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    CPU_TARGET_AVX2 static void drawBlocksAVX2(Framebuffer& target, const Setup& s, uint32_t color, const TextureShader* shader) {
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256 laneZ = _mm256_mul_ps(_mm256_cvtepi32_ps(lanes), _mm256_set1_ps(s.depth.stepX));
+        const __m256i colorValue = _mm256_set1_epi32((int)color);
+        const __m256i minusOne = _mm256_set1_epi32(-1);
+        const bool depthOnly = target.color.empty();
+
+        __m256i stepX[3];
+        for (int i = 0; i < 3; i++)
+            stepX[i] = _mm256_mullo_epi32(_mm256_set1_epi32((int32_t)s.a[i]), lanes);
+
+        int startX = s.minX & ~(blockSize - 1);
+        int startY = s.minY & ~(blockSize - 1);
+
+        for (int by = startY; by <= s.maxY; by += blockSize) {
+            int rows = min(blockSize, target.height - by);
+
+            for (int bx = startX; bx <= s.maxX; bx += blockSize) {
+                int32_t e[3];
+                int coverage = classifyBlock(s, bx, by, e);
+                if (coverage == 0) continue;
+
+                int columns = min(blockSize, target.width - bx);
+                __m256i columnMask = _mm256_cmpgt_epi32(_mm256_set1_epi32(columns), lanes);
+
+                __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(e[0]), stepX[0]);
+                __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(e[1]), stepX[1]);
+                __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(e[2]), stepX[2]);
+                __m256i stepY0 = _mm256_set1_epi32((int32_t)s.b[0]);
+                __m256i stepY1 = _mm256_set1_epi32((int32_t)s.b[1]);
+                __m256i stepY2 = _mm256_set1_epi32((int32_t)s.b[2]);
+
+                for (int r = 0; r < rows; r++) {
+                    size_t index = (size_t)(by + r) * target.width + bx;
+                    __m256 zv = _mm256_add_ps(_mm256_set1_ps(s.depthAt(bx, by + r)), laneZ);
+
+                    __m256i mask = columnMask;
+                    if (coverage == 1)
+                        mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(_mm256_or_si256(_mm256_or_si256(e0, e1), e2), minusOne));
+
+                    if (!_mm256_testz_si256(mask, mask)) {
+                        __m256 depth = _mm256_maskload_ps(&target.depth[index], mask);
+                        __m256i pass = _mm256_and_si256(mask, _mm256_castps_si256(_mm256_cmp_ps(zv, depth, _CMP_LT_OQ)));
+
+                        _mm256_maskstore_ps(&target.depth[index], pass, zv);
+
+                        if (shader) {
+                            int bits = _mm256_movemask_ps(_mm256_castsi256_ps(pass));
+                            for (int l = 0; l < 8; l++) {
+                                if (bits & (1 << l))
+                                    target.color[index + l] = shader->shadePixel(bx + l, by + r);
+                            }
+                        }
+                        else if (!depthOnly) {
+                            _mm256_maskstore_epi32((int*)&target.color[index], pass, colorValue);
+                        }
+                    }
+
+                    e0 = _mm256_add_epi32(e0, stepY0);
+                    e1 = _mm256_add_epi32(e1, stepY1);
+                    e2 = _mm256_add_epi32(e2, stepY2);
+                }
+            }
+        }
+    }
+#endif
+
+    // Sutherland-Hodgman against the guard band. Depth, 1/w and the divided texture coordinates
+    // are all affine in screen space so they interpolate linearly
+    static void drawClipped(Framebuffer& target, const Vertex v[3], uint32_t color, const Surface* surface) {
+        Vertex polygon[9] = { v[0], v[1], v[2] };
+        int count = 3;
+
+        const float bounds[4] = { -guardBand, target.width + guardBand, -guardBand, target.height + guardBand };
+
+        for (int plane = 0; plane < 4 && count > 0; plane++) {
+            Vertex input[9];
+            copy(polygon, polygon + count, input);
+            int inputCount = count;
+            count = 0;
+
+            auto distance = [&](const Vertex& v) {
+                float d = plane < 2 ? v.p.x : v.p.y;
+                return plane % 2 == 0 ? d - bounds[plane] : bounds[plane] - d;
+            };
+
+            for (int i = 0; i < inputCount; i++) {
+                const Vertex& a = input[i];
+                const Vertex& b = input[(i + 1) % inputCount];
+                float da = distance(a), db = distance(b);
+
+                if (da >= 0)
+                    polygon[count++] = a;
+                if ((da >= 0) != (db >= 0)) {
+                    float f = da / (da - db);
+                    Vertex& out = polygon[count++];
+                    out.p = a.p + (b.p - a.p) * f;
+                    out.p.w = a.p.w + (b.p.w - a.p.w) * f;
+                    out.t = a.t + (b.t - a.t) * f;
+                }
+            }
+        }
+
+        for (int i = 1; i + 1 < count; i++) {
+            drawSingle(target, polygon[0], polygon[i], polygon[i + 1], color, surface);
+        }
+    }
+};
\ No newline at end of file
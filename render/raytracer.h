@@ -0,0 +1,763 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include "math.h"
+#include "scene.h"
+#include "framebuffer.h"
+#include "texture.h"
+#include "lighting.h"
+
+using namespace std;
+
+// Lane mask of a four wide comparison
+struct Mask4 {
+#ifdef MATH_SSE
+    __m128 m;
+
+    Mask4(__m128 m) : m(m) {}
+
+    Mask4 operator&(Mask4 other) const { return _mm_and_ps(m, other.m); }
+    Mask4 operator|(Mask4 other) const { return _mm_or_ps(m, other.m); }
+    Mask4 andNot(Mask4 other) const { return _mm_andnot_ps(other.m, m); }
+    int bits() const { return _mm_movemask_ps(m); }
+
+    static Mask4 fromBits(int bits) {
+        const uint32_t ones = ~0u, zeros = 0;
+        alignas(16) float lanes[4];
+        for (int i = 0; i < 4; i++)
+            memcpy(&lanes[i], bits & (1 << i) ? &ones : &zeros, sizeof(float));
+        return _mm_load_ps(lanes);
+    }
+#else
+    int lanes;
+
+    Mask4(int lanes) : lanes(lanes) {}
+
+    Mask4 operator&(Mask4 other) const { return lanes & other.lanes; }
+    Mask4 operator|(Mask4 other) const { return lanes | other.lanes; }
+    Mask4 andNot(Mask4 other) const { return lanes & ~other.lanes; }
+    int bits() const { return lanes; }
+
+    static Mask4 fromBits(int bits) {
+        return bits;
+    }
+#endif
+
+    bool any() const { return bits() != 0; }
+};
+
+// Four floats in one SSE register where the target has it, so the packet code is written once
+struct Float4 {
+#ifdef MATH_SSE
+    __m128 v;
+
+    Float4() : v(_mm_setzero_ps()) {}
+    Float4(__m128 v) : v(v) {}
+    Float4(float s) : v(_mm_set1_ps(s)) {}
+    Float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+    float operator[](int lane) const {
+        alignas(16) float f[4];
+        _mm_store_ps(f, v);
+        return f[lane];
+    }
+
+    // To 16 byte aligned memory
+    void store(float* f) const { _mm_store_ps(f, v); }
+
+    Float4 operator+(Float4 o) const { return _mm_add_ps(v, o.v); }
+    Float4 operator-(Float4 o) const { return _mm_sub_ps(v, o.v); }
+    Float4 operator*(Float4 o) const { return _mm_mul_ps(v, o.v); }
+    Float4 operator/(Float4 o) const { return _mm_div_ps(v, o.v); }
+    Mask4 operator<(Float4 o) const { return _mm_cmplt_ps(v, o.v); }
+    Mask4 operator<=(Float4 o) const { return _mm_cmple_ps(v, o.v); }
+    Mask4 operator>(Float4 o) const { return _mm_cmpgt_ps(v, o.v); }
+    Mask4 operator>=(Float4 o) const { return _mm_cmpge_ps(v, o.v); }
+
+    static Float4 lesser(Float4 a, Float4 b) { return _mm_min_ps(a.v, b.v); }
+    static Float4 greater(Float4 a, Float4 b) { return _mm_max_ps(a.v, b.v); }
+    static Float4 select(Mask4 mask, Float4 a, Float4 b) { return _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v)); }
+
+    float minLane() const {
+        __m128 m = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtss_f32(_mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+
+    float maxLane() const {
+        __m128 m = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtss_f32(_mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+#else
+    float v[4];
+
+    Float4() : v{ 0.0f, 0.0f, 0.0f, 0.0f } {}
+    Float4(float s) : v{ s, s, s, s } {}
+    Float4(float a, float b, float c, float d) : v{ a, b, c, d } {}
+
+    float operator[](int lane) const { return v[lane]; }
+    void store(float* f) const { for (int i = 0; i < 4; i++) f[i] = v[i]; }
+
+    template<typename Op>
+    static Float4 apply(Float4 a, Float4 b, Op op) {
+        Float4 r;
+        for (int i = 0; i < 4; i++) r.v[i] = op(a.v[i], b.v[i]);
+        return r;
+    }
+
+    template<typename Op>
+    static Mask4 compare(Float4 a, Float4 b, Op op) {
+        int bits = 0;
+        for (int i = 0; i < 4; i++) bits |= op(a.v[i], b.v[i]) ? 1 << i : 0;
+        return bits;
+    }
+
+    Float4 operator+(Float4 o) const { return apply(*this, o, [](float a, float b) { return a + b; }); }
+    Float4 operator-(Float4 o) const { return apply(*this, o, [](float a, float b) { return a - b; }); }
+    Float4 operator*(Float4 o) const { return apply(*this, o, [](float a, float b) { return a * b; }); }
+    Float4 operator/(Float4 o) const { return apply(*this, o, [](float a, float b) { return a / b; }); }
+    Mask4 operator<(Float4 o) const { return compare(*this, o, [](float a, float b) { return a < b; }); }
+    Mask4 operator<=(Float4 o) const { return compare(*this, o, [](float a, float b) { return a <= b; }); }
+    Mask4 operator>(Float4 o) const { return compare(*this, o, [](float a, float b) { return a > b; }); }
+    Mask4 operator>=(Float4 o) const { return compare(*this, o, [](float a, float b) { return a >= b; }); }
+
+    static Float4 lesser(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return y < x ? y : x; }); }
+    static Float4 greater(Float4 a, Float4 b) { return apply(a, b, [](float x, float y) { return x < y ? y : x; }); }
+    static Float4 select(Mask4 mask, Float4 a, Float4 b) {
+        Float4 r;
+        for (int i = 0; i < 4; i++) r.v[i] = mask.lanes & (1 << i) ? a.v[i] : b.v[i];
+        return r;
+    }
+
+    float minLane() const { return std::min(std::min(v[0], v[1]), std::min(v[2], v[3])); }
+    float maxLane() const { return std::max(std::max(v[0], v[1]), std::max(v[2], v[3])); }
+#endif
+};
+
+// Ray caster over the scene's world space triangles. A bounding volume hierarchy built with binned
+// surface area heuristic splits is traced by packets of four rays, one 2x2 pixel quad, so every
+// node and triangle test serves four rays in one SSE instruction stream. Frames are split into
+// tiles that worker threads pull from a shared counter. Shading follows the rasterizer: flat
+// material color, the directional light with a shadow ray and the local lights of the light grid
+class RayTracer {
+public:
+    static const int tileSize = 16;
+
+    // Primary rays go through pixel centers, pixel (x, y) looks along topLeft + stepX * x + stepY * y.
+    // Distances along these rays are view depths when forward has unit length
+    struct View {
+        Vec3d origin;
+        Vec3d topLeft;
+        Vec3d stepX;
+        Vec3d stepY;
+    };
+
+    struct Hit {
+        bool hit = false;
+        size_t instance = 0;
+        uint32_t triangle = 0; // Index into the instance's mesh
+        float distance = 0.0f;
+        Vec3d point;
+    };
+
+private:
+    struct Node {
+        float minX, minY, minZ;
+        uint32_t first; // First triangle of a leaf, left child of an inner node with the right one after it
+        float maxX, maxY, maxZ;
+        uint32_t count; // Zero for inner nodes
+    };
+
+    // World space triangle in the form the intersection test wants
+    struct Tri {
+        Vec3d p0, e1, e2;
+    };
+
+    // Everything shading needs, parallel to tris
+    struct TriInfo {
+        uint32_t instance;
+        uint32_t triangle;
+        Vec3d normal;
+        float texelDensity; // Texture coordinate area per world area
+    };
+
+    struct Packet {
+        Float4 ox, oy, oz;
+        Float4 dx, dy, dz;
+        Float4 ix, iy, iz;
+        Float4 t, u, v;
+        uint32_t tri[4];
+
+        void setRays(const Vec3d o[4], const Vec3d d[4]) {
+            // Axis parallel rays get a huge but finite inverse so slab tests never see 0 * inf
+            auto inverse = [](float f) { return 1.0f / (fabsf(f) > 1e-20f ? f : 1e-20f); };
+
+            ox = Float4(o[0].x, o[1].x, o[2].x, o[3].x);
+            oy = Float4(o[0].y, o[1].y, o[2].y, o[3].y);
+            oz = Float4(o[0].z, o[1].z, o[2].z, o[3].z);
+            dx = Float4(d[0].x, d[1].x, d[2].x, d[3].x);
+            dy = Float4(d[0].y, d[1].y, d[2].y, d[3].y);
+            dz = Float4(d[0].z, d[1].z, d[2].z, d[3].z);
+            ix = Float4(inverse(d[0].x), inverse(d[1].x), inverse(d[2].x), inverse(d[3].x));
+            iy = Float4(inverse(d[0].y), inverse(d[1].y), inverse(d[2].y), inverse(d[3].y));
+            iz = Float4(inverse(d[0].z), inverse(d[1].z), inverse(d[2].z), inverse(d[3].z));
+        }
+    };
+
+    vector<Node> nodes;
+    vector<Tri> tris;
+    vector<TriInfo> infos;
+
+    uint64_t builtVersion = 0;
+    bool built = false;
+    uint64_t rayCount = 0;
+    bool texturesPending = false;
+    int threadCount = 0; // Tile workers per frame, 0 for one per hardware thread
+
+    static constexpr float noHit = 1e30f;
+
+public:
+    // Callers that already run frames in parallel keep each one on fewer threads
+    void setThreadCount(int count) {
+        threadCount = count;
+    }
+
+    // Rebuilds the hierarchy when the scene changed since the last call, transforms must be up to date
+    void update(const Scene& scene) {
+        if (built && scene.getVersion() == builtVersion)
+            return;
+
+        build(scene);
+        builtVersion = scene.getVersion();
+        built = true;
+    }
+
+    // lights may be null, otherwise it was built for viewMatrix
+    void render(Framebuffer& target, const Scene& scene, const View& view, const Vec3d& lightDirection, bool shadows,
+                const LightGrid* lights, const Mat4x4& viewMatrix) {
+        texturesPending = false;
+        for (auto& instance : scene.instances) {
+            const Texture* texture = instance.material.texture.get();
+            if (texture && !texture->ready.load(memory_order_acquire) && !texture->failed.load(memory_order_acquire))
+                texturesPending = true;
+        }
+
+        int tilesX = (target.width + tileSize - 1) / tileSize;
+        int tilesY = (target.height + tileSize - 1) / tileSize;
+        int tileCount = tilesX * tilesY;
+
+        atomic<int> nextTile{ 0 };
+        atomic<uint64_t> rays{ 0 };
+
+        auto work = [&]() {
+            uint64_t traced = 0;
+            for (int tile = nextTile++; tile < tileCount; tile = nextTile++) {
+                int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+                traced += renderTile(target, scene, view, lightDirection, shadows, lights, viewMatrix, x0, y0);
+            }
+            rays += traced;
+        };
+
+        int workers = max(1, min(threadCount > 0 ? threadCount : (int)thread::hardware_concurrency(), tileCount));
+        vector<future<void>> jobs;
+        for (int i = 1; i < workers; i++)
+            jobs.push_back(async(launch::async, work));
+        work();
+        for (auto& job : jobs)
+            job.get();
+
+        rayCount = rays;
+    }
+
+    // Closest triangle along a single ray, for picking
+    Hit trace(const Vec3d& origin, const Vec3d& direction) const {
+        // A packet of four copies of the same ray, the one traversal serves both uses
+        Packet packet = makePacket();
+        Vec3d origins[4] = { origin, origin, origin, origin };
+        Vec3d directions[4] = { direction, direction, direction, direction };
+        packet.setRays(origins, directions);
+        intersect(packet, Mask4::fromBits(1));
+
+        Hit hit;
+        if (packet.t[0] >= noHit)
+            return hit;
+
+        hit.hit = true;
+        hit.instance = infos[packet.tri[0]].instance;
+        hit.triangle = infos[packet.tri[0]].triangle;
+        hit.distance = packet.t[0];
+        hit.point = origin + direction * hit.distance;
+        return hit;
+    }
+
+    // Primary and shadow rays of the last render
+    uint64_t getRayCount() const {
+        return rayCount;
+    }
+
+    // Whether the last render drew textured instances untextured because their textures were still loading
+    bool hasPendingTextures() const {
+        return texturesPending;
+    }
+
+private:
+    static Packet makePacket() {
+        Packet packet;
+        packet.t = Float4(noHit);
+        for (auto& tri : packet.tri)
+            tri = 0;
+        return packet;
+    }
+
+    uint64_t renderTile(Framebuffer& target, const Scene& scene, const View& view, const Vec3d& lightDirection, bool shadows,
+                        const LightGrid* lights, const Mat4x4& viewMatrix, int x0, int y0) const {
+        uint64_t traced = 0;
+        int x1 = min(x0 + tileSize, target.width), y1 = min(y0 + tileSize, target.height);
+
+        // Footprint of a pixel one unit along a primary ray, picks the texture level
+        float pixelSize = sqrtf(view.stepX.dot(view.stepX));
+
+        for (int y = y0; y < y1; y += 2) {
+            for (int x = x0; x < x1; x += 2) {
+                Packet packet = makePacket();
+                int valid = 0;
+                Vec3d origins[4] = { view.origin, view.origin, view.origin, view.origin };
+                Vec3d directions[4];
+
+                for (int lane = 0; lane < 4; lane++) {
+                    int px = x + (lane & 1), py = y + (lane >> 1);
+                    if (px < x1 && py < y1)
+                        valid |= 1 << lane;
+
+                    directions[lane] = view.topLeft + view.stepX * (float)px + view.stepY * (float)py;
+                }
+                packet.setRays(origins, directions);
+
+                intersect(packet, Mask4::fromBits(valid));
+                traced += laneCount(valid);
+
+                int hits = (packet.t < Float4(noHit)).bits() & valid;
+                alignas(16) float t[4], u[4], v[4];
+                packet.t.store(t);
+                packet.u.store(u);
+                packet.v.store(v);
+
+                // Directional light term and a shadow packet for the lanes facing the light
+                float shade[4] = { 0.1f, 0.1f, 0.1f, 0.1f };
+                Vec3d points[4];
+                Vec3d starts[4] = { view.origin, view.origin, view.origin, view.origin };
+                Vec3d towardLight[4] = { lightDirection, lightDirection, lightDirection, lightDirection };
+                int shadowLanes = 0;
+
+                for (int lane = 0; lane < 4; lane++) {
+                    if (!(hits & (1 << lane))) continue;
+
+                    const TriInfo& info = infos[packet.tri[lane]];
+                    points[lane] = view.origin + directions[lane] * t[lane];
+                    shade[lane] = max(0.1f, lightDirection.dot(info.normal));
+
+                    if (shadows && shade[lane] > 0.1f) {
+                        starts[lane] = points[lane] + info.normal * (0.001f * (1.0f + t[lane]));
+                        shadowLanes |= 1 << lane;
+                    }
+                }
+
+                if (shadowLanes) {
+                    Packet shadow = makePacket();
+                    shadow.setRays(starts, towardLight);
+                    int blocked = occluded(shadow, Mask4::fromBits(shadowLanes)).bits();
+                    for (int lane = 0; lane < 4; lane++)
+                        if (blocked & (1 << lane)) shade[lane] = 0.1f;
+                    traced += laneCount(shadowLanes);
+                }
+
+                for (int lane = 0; lane < 4; lane++) {
+                    if (!(valid & (1 << lane))) continue;
+
+                    int px = x + (lane & 1), py = y + (lane >> 1);
+                    size_t pixel = (size_t)py * target.width + px;
+
+                    if (!(hits & (1 << lane))) {
+                        target.color[pixel] = Framebuffer::packColor({ 0.0f, 0.0f, 0.0f });
+                        continue;
+                    }
+
+                    const TriInfo& info = infos[packet.tri[lane]];
+                    const MeshInstance& instance = scene.instances[info.instance];
+                    const Vec3d& material = instance.material.color;
+
+                    Vec3d light = { shade[lane], shade[lane], shade[lane] };
+                    if (lights && lights->lightCount() > 0) {
+                        Vec3d normal = info.normal;
+                        normal.w = 0.0f;
+                        light = light + lights->shade(Mat4x4::MultiplyVector(viewMatrix, points[lane]), Mat4x4::MultiplyVector(viewMatrix, normal));
+                    }
+                    Vec3d color = { material.x * light.x, material.y * light.y, material.z * light.z };
+
+                    const Texture* texture = instance.material.texture.get();
+                    if (texture && texture->ready.load(memory_order_acquire)) {
+                        Vec2f uvs[3];
+                        instance.mesh->texCoords(info.triangle, uvs);
+                        Vec2f uv = uvs[0] * (1.0f - u[lane] - v[lane]) + uvs[1] * u[lane] + uvs[2] * v[lane];
+
+                        // Texels under the pixel: its footprint grows with distance and stretches at grazing angles
+                        Vec3d direction = directions[lane].normalize();
+                        float cosine = max(fabsf(direction.dot(info.normal)), 0.05f);
+                        float footprint = t[lane] * pixelSize;
+                        float texels = info.texelDensity * texture->baseWidth() * texture->baseHeight() * footprint * footprint / cosine;
+                        float lod = texels > 1.0f ? 0.5f * log2f(texels) : 0.0f;
+
+                        Vec3d texel = texture->sample(uv.x, uv.y, lod);
+                        color = { texel.x * color.x, texel.y * color.y, texel.z * color.z };
+                    }
+
+                    target.color[pixel] = Framebuffer::packColor(color);
+                }
+            }
+        }
+
+        return traced;
+    }
+
+    static int laneCount(int bits) {
+        return (bits & 1) + ((bits >> 1) & 1) + ((bits >> 2) & 1) + ((bits >> 3) & 1);
+    }
+
+    // Slab test of the packet against a node's box, near receives the entry distances
+    static Mask4 hitBox(const Node& node, const Packet& p, Float4& near) {
+        Float4 tx0 = (Float4(node.minX) - p.ox) * p.ix, tx1 = (Float4(node.maxX) - p.ox) * p.ix;
+        Float4 ty0 = (Float4(node.minY) - p.oy) * p.iy, ty1 = (Float4(node.maxY) - p.oy) * p.iy;
+        Float4 tz0 = (Float4(node.minZ) - p.oz) * p.iz, tz1 = (Float4(node.maxZ) - p.oz) * p.iz;
+
+        near = Float4::greater(Float4::greater(Float4::lesser(tx0, tx1), Float4::lesser(ty0, ty1)), Float4::greater(Float4::lesser(tz0, tz1), Float4(0.0f)));
+        Float4 far = Float4::lesser(Float4::lesser(Float4::greater(tx0, tx1), Float4::greater(ty0, ty1)), Float4::lesser(Float4::greater(tz0, tz1), p.t));
+        return near <= far;
+    }
+
+    // Moller-Trumbore of one triangle against all four rays, returns the lanes it is closer for
+    static Mask4 hitTriangle(const Tri& tri, const Packet& p, Float4& t, Float4& u, Float4& v) {
+        Float4 e1x(tri.e1.x), e1y(tri.e1.y), e1z(tri.e1.z);
+        Float4 e2x(tri.e2.x), e2y(tri.e2.y), e2z(tri.e2.z);
+
+        Float4 px = p.dy * e2z - p.dz * e2y;
+        Float4 py = p.dz * e2x - p.dx * e2z;
+        Float4 pz = p.dx * e2y - p.dy * e2x;
+        Float4 invDet = Float4(1.0f) / (e1x * px + e1y * py + e1z * pz);
+
+        Float4 sx = p.ox - Float4(tri.p0.x), sy = p.oy - Float4(tri.p0.y), sz = p.oz - Float4(tri.p0.z);
+        u = (sx * px + sy * py + sz * pz) * invDet;
+
+        Float4 qx = sy * e1z - sz * e1y;
+        Float4 qy = sz * e1x - sx * e1z;
+        Float4 qz = sx * e1y - sy * e1x;
+        v = (p.dx * qx + p.dy * qy + p.dz * qz) * invDet;
+        t = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+        // A zero determinant turns the terms into infinities or NaN, which fail every comparison below
+        return (u >= Float4(0.0f)) & (v >= Float4(0.0f)) & (u + v <= Float4(1.0f)) & (t > Float4(0.01f)) & (t < p.t);
+    }
+
+    // A node waiting on the traversal stack with the nearest distance any active ray enters it at
+    struct StackEntry {
+        uint32_t node;
+        float near;
+    };
+
+    // Nodes deeper than this stay leaves however many triangles they hold. Traversal pops a node
+    // before pushing its two children, so the stack never holds more than one entry per level plus one
+    static const int maxDepth = 64;
+    static const int stackSize = 128;
+    static_assert(maxDepth + 1 <= stackSize, "the traversal stack must fit the deepest tree");
+
+    // Closest hits of the active lanes, front to back through the hierarchy. Nodes popped behind
+    // every lane's current hit are skipped without touching their children
+    void intersect(Packet& p, Mask4 active) const {
+        if (nodes.empty())
+            return;
+
+        Float4 near;
+        Mask4 root = hitBox(nodes[0], p, near) & active;
+        if (!root.any())
+            return;
+
+        StackEntry stack[stackSize];
+        int depth = 0;
+        stack[depth++] = { 0, Float4::select(root, near, Float4(noHit)).minLane() };
+        float farthest = Float4::select(active, p.t, Float4(0.0f)).maxLane();
+
+        while (depth > 0) {
+            StackEntry entry = stack[--depth];
+            if (entry.near > farthest) continue;
+
+            const Node& node = nodes[entry.node];
+            if (node.count == 0) {
+                pushChildren(node, p, active, stack, depth);
+                continue;
+            }
+
+            bool closer = false;
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                Float4 t, u, v;
+                Mask4 hit = hitTriangle(tris[i], p, t, u, v) & active;
+                int lanes = hit.bits();
+                if (!lanes) continue;
+
+                p.t = Float4::select(hit, t, p.t);
+                p.u = Float4::select(hit, u, p.u);
+                p.v = Float4::select(hit, v, p.v);
+                for (int lane = 0; lane < 4; lane++)
+                    if (lanes & (1 << lane)) p.tri[lane] = i;
+                closer = true;
+            }
+
+            if (closer)
+                farthest = Float4::select(active, p.t, Float4(0.0f)).maxLane();
+        }
+    }
+
+    // Lanes whose ray hits anything at all, shadow rays stop at the first one
+    Mask4 occluded(const Packet& p, Mask4 active) const {
+        Mask4 remaining = active;
+        if (nodes.empty())
+            return Mask4::fromBits(0);
+
+        Float4 near;
+        Mask4 root = hitBox(nodes[0], p, near) & active;
+        if (!root.any())
+            return Mask4::fromBits(0);
+
+        StackEntry stack[stackSize];
+        int depth = 0;
+        stack[depth++] = { 0, 0.0f };
+
+        while (depth > 0) {
+            const Node& node = nodes[stack[--depth].node];
+
+            if (node.count == 0) {
+                pushChildren(node, p, remaining, stack, depth);
+                continue;
+            }
+
+            for (uint32_t i = node.first; i < node.first + node.count; i++) {
+                Float4 t, u, v;
+                remaining = remaining.andNot(hitTriangle(tris[i], p, t, u, v));
+                if (!remaining.any())
+                    return active;
+            }
+        }
+
+        return active.andNot(remaining);
+    }
+
+    // Pushes the children some active lane enters, the nearer one last so it is visited first
+    void pushChildren(const Node& node, const Packet& p, Mask4 active, StackEntry* stack, int& depth) const {
+        Float4 nearLeft, nearRight;
+        Mask4 left = hitBox(nodes[node.first], p, nearLeft) & active;
+        Mask4 right = hitBox(nodes[node.first + 1], p, nearRight) & active;
+        bool hitLeft = left.any(), hitRight = right.any();
+
+        if (hitLeft && hitRight) {
+            float l = Float4::select(left, nearLeft, Float4(noHit)).minLane();
+            float r = Float4::select(right, nearRight, Float4(noHit)).minLane();
+            if (l <= r) {
+                stack[depth++] = { node.first + 1, r };
+                stack[depth++] = { node.first, l };
+            }
+            else {
+                stack[depth++] = { node.first, l };
+                stack[depth++] = { node.first + 1, r };
+            }
+        }
+        else if (hitLeft) {
+            stack[depth++] = { node.first, Float4::select(left, nearLeft, Float4(noHit)).minLane() };
+        }
+        else if (hitRight) {
+            stack[depth++] = { node.first + 1, Float4::select(right, nearRight, Float4(noHit)).minLane() };
+        }
+    }
+
+    struct Bounds {
+        Vec3d min = { noHit, noHit, noHit };
+        Vec3d max = { -noHit, -noHit, -noHit };
+
+        void grow(const Vec3d& p) {
+            min = { std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z) };
+            max = { std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z) };
+        }
+
+        void grow(const Bounds& b) {
+            if (b.min.x > b.max.x) return;
+            grow(b.min);
+            grow(b.max);
+        }
+
+        float area() const {
+            if (min.x > max.x) return 0.0f;
+            Vec3d e = max - min;
+            return e.x * e.y + e.y * e.z + e.z * e.x;
+        }
+    };
+
+    void build(const Scene& scene) {
+        vector<Tri> worldTris;
+        vector<TriInfo> worldInfos;
+        vector<Bounds> triBounds;
+        vector<Vec3d> centroids;
+
+        for (size_t instanceIndex = 0; instanceIndex < scene.instances.size(); instanceIndex++) {
+            const MeshInstance& instance = scene.instances[instanceIndex];
+            if (!instance.mesh || instance.invisible) continue;
+
+            const Mesh& mesh = *instance.mesh;
+            Mat4x4 transform = mesh.positionTransform(instance.transform);
+            for (uint32_t t = 0; t < mesh.triangleCount(); t++) {
+                Vec3d p[3];
+                mesh.transformTriangle(t, transform, p);
+
+                Vec3d e1 = p[1] - p[0], e2 = p[2] - p[0];
+                Vec3d cross = e1.cross(e2);
+                float worldArea = sqrtf(cross.dot(cross));
+                if (worldArea <= 0.0f) continue;
+
+                Vec2f uvs[3];
+                mesh.texCoords(t, uvs);
+                Vec2f t1 = uvs[1] - uvs[0], t2 = uvs[2] - uvs[0];
+                float uvArea = fabsf(t1.x * t2.y - t1.y * t2.x);
+
+                worldTris.push_back({ p[0], e1, e2 });
+                worldInfos.push_back({ (uint32_t)instanceIndex, t, cross * (1.0f / worldArea), uvArea / worldArea });
+
+                Bounds b;
+                b.grow(p[0]); b.grow(p[1]); b.grow(p[2]);
+                triBounds.push_back(b);
+                centroids.push_back((p[0] + p[1] + p[2]) * (1.0f / 3.0f));
+            }
+        }
+
+        vector<uint32_t> order(worldTris.size());
+        for (uint32_t i = 0; i < order.size(); i++)
+            order[i] = i;
+
+        nodes.clear();
+        nodes.reserve(worldTris.size() * 2);
+        if (!worldTris.empty()) {
+            nodes.push_back({});
+            nodes[0].first = 0;
+            nodes[0].count = (uint32_t)worldTris.size();
+
+            // Node index and its depth below the root
+            vector<pair<uint32_t, int>> pending = { { 0, 0 } };
+            while (!pending.empty()) {
+                auto next = pending.back();
+                pending.pop_back();
+                split(next.first, next.second, order, triBounds, centroids, pending);
+            }
+        }
+
+        // Triangles move into leaf order so a leaf reads one contiguous run
+        tris.resize(order.size());
+        infos.resize(order.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            tris[i] = worldTris[order[i]];
+            infos[i] = worldInfos[order[i]];
+        }
+    }
+
+    // Sets the node's box and splits it at the cheapest of a few binned planes if that beats a leaf
+    void split(uint32_t index, int depth, vector<uint32_t>& order, const vector<Bounds>& triBounds, const vector<Vec3d>& centroids, vector<pair<uint32_t, int>>& pending) {
+        const int binCount = 12;
+        const int maxLeafSize = 4;
+
+        uint32_t first = nodes[index].first, count = nodes[index].count;
+
+        Bounds box, centroidBox;
+        for (uint32_t i = first; i < first + count; i++) {
+            box.grow(triBounds[order[i]]);
+            centroidBox.grow(centroids[order[i]]);
+        }
+
+        Node& node = nodes[index];
+        node.minX = box.min.x; node.minY = box.min.y; node.minZ = box.min.z;
+        node.maxX = box.max.x; node.maxY = box.max.y; node.maxZ = box.max.z;
+
+        if (count <= 2 || depth >= maxDepth)
+            return;
+
+        float bestCost = noHit;
+        int bestAxis = -1, bestSplit = 0;
+
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = (&centroidBox.min.x)[axis], hi = (&centroidBox.max.x)[axis];
+            float scale = binCount / (hi - lo);
+            // Centroids closer together than a float can divide by are as good as on one plane
+            if (hi <= lo || !isfinite(scale)) continue;
+
+            Bounds bins[binCount];
+            int counts[binCount] = {};
+
+            for (uint32_t i = first; i < first + count; i++) {
+                int bin = min(binCount - 1, (int)(((&centroids[order[i]].x)[axis] - lo) * scale));
+                bins[bin].grow(triBounds[order[i]]);
+                counts[bin]++;
+            }
+
+            // Sweep from the right to get the area and count of every right side, then from the left
+            float rightArea[binCount];
+            int rightCount[binCount];
+            Bounds right;
+            int rightSum = 0;
+            for (int b = binCount - 1; b > 0; b--) {
+                right.grow(bins[b]);
+                rightSum += counts[b];
+                rightArea[b] = right.area();
+                rightCount[b] = rightSum;
+            }
+
+            Bounds left;
+            int leftSum = 0;
+            for (int b = 1; b < binCount; b++) {
+                left.grow(bins[b - 1]);
+                leftSum += counts[b - 1];
+                if (leftSum == 0 || rightCount[b] == 0) continue;
+
+                float cost = leftSum * left.area() + rightCount[b] * rightArea[b];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        float leafCost = count * box.area();
+        if (bestAxis < 0 || (bestCost >= leafCost && count <= maxLeafSize))
+            return;
+
+        float lo = (&centroidBox.min.x)[bestAxis];
+        float scale = binCount / ((&centroidBox.max.x)[bestAxis] - lo);
+        auto middle = partition(order.begin() + first, order.begin() + first + count, [&](uint32_t tri) {
+            return min(binCount - 1, (int)(((&centroids[tri].x)[bestAxis] - lo) * scale)) < bestSplit;
+        });
+        uint32_t leftCount = (uint32_t)(middle - (order.begin() + first));
+
+        uint32_t child = (uint32_t)nodes.size();
+        nodes.push_back({});
+        nodes.push_back({});
+        nodes[child].first = first;
+        nodes[child].count = leftCount;
+        nodes[child + 1].first = first + leftCount;
+        nodes[child + 1].count = count - leftCount;
+
+        nodes[index].first = child;
+        nodes[index].count = 0;
+
+        pending.push_back({ child, depth + 1 });
+        pending.push_back({ child + 1, depth + 1 });
+    }
+};
@@ -2,16 +2,29 @@
 #include <GL/gl.h>
 #include <iostream>
 #include <chrono>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <list>
 #include "math.h"
 #include "keyboard.h"
 #include "camera.h"
 #include "fps.h"
 #include "renderer3d.cpp"
+#include "golden.h"
+#include "capture.h"
+#include "batch.h"
+#include "meshbench.h"
+#include "pipelinebench.h"
+#include "bodybench.h"
+#include "mathbench.h"
+#include "heightfieldbench.h"
+#include "session.h"
+#include "resolution.h"
 
 using namespace std;
 
+#ifdef _WIN32
 // Put console window on second monitor (if available)
 BOOL CALLBACK MonitorEnumProc(HMONITOR hMonitor, HDC hdcMonitor, LPRECT lprcMonitor, LPARAM dwData) {
     MONITORINFOEX monitorInfo;
@@ -28,19 +41,24 @@ BOOL CALLBACK MonitorEnumProc(HMONITOR hMonitor, HDC hdcMonitor, LPRECT lprcMoni
     }
     return TRUE;  // Continue enumeration
 }
+#endif
+
+// Ends the process, on Windows together with its console window
+void exitApplication() {
+#ifdef _WIN32
+    FreeConsole();
+    HWND consoleWindow = GetConsoleWindow();
+    PostMessage(consoleWindow, WM_CLOSE, 0, 0);
+    ExitProcess(0);
+#else
+    exit(0);
+#endif
+}
 
 class KeyboardE : public Keyboard {
     static KeyboardE* instance;
 
-    KeyboardE() {
-        for (int i = 0; i < GLFW_KEY_LAST; i++) {
-            keys[i] = false;
-        }
-
-        for (int i = 0; i < GLFW_MOUSE_BUTTON_LAST; i++) {
-            buttons[i] = false;
-        }
-    };
+    KeyboardE() = default;
 
 public:
     static KeyboardE* getInstance() { 
@@ -50,30 +68,22 @@ public:
         return instance;
     }
 
+    // The callbacks only queue, the state changes when the frame calls processEvents
     void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods) override {
-        KeyboardE* keyboard = KeyboardE::getInstance();
-        if (action == GLFW_PRESS) {
-            keyboard->setButtonPressed(button, true);
-        }
-        else if (action == GLFW_RELEASE) {
-            keyboard->setButtonPressed(button, false);
-        }
+        queueButton(button, action);
     }
 
     void cursorPosCallback(GLFWwindow* window, double xpos, double ypos) override {
-        KeyboardE* keyboard = KeyboardE::getInstance();
+        queueCursor(xpos, ypos);
+    }
 
-        keyboard->setMousePosition({ (float)xpos, (float)ypos });
+    void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) override {
+        queueKey(key, action);
     }
 
-    void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
-        KeyboardE* keyboard = KeyboardE::getInstance();
-        if (action == GLFW_PRESS) {
-            keyboard->setKeyPressed(key, true);
-        }
-        else if (action == GLFW_RELEASE) {
-            keyboard->setKeyPressed(key, false);
-        }
+    // Held now or tapped since the last frame, so a short tap still moves one step
+    bool isKeyActive(int key) {
+        return isKeyPressed(key) || wasKeyPressed(key);
     }
 
     void handleKeyboardInput(Renderer3d& renderer, float fElapsedTime) {
@@ -81,64 +91,55 @@ public:
 
         Vec3d vForward = renderer.camera.vLookDir * 0.2f;
 
-        if (keyboard->isKeyPressed(GLFW_KEY_W)) {
+        if (keyboard->isKeyActive(GLFW_KEY_W)) {
             renderer.camera.vCameraPosition = renderer.camera.vCameraPosition + vForward;
         }
 
-        if (keyboard->isKeyPressed(GLFW_KEY_S)) {
+        if (keyboard->isKeyActive(GLFW_KEY_S)) {
             renderer.camera.vCameraPosition = renderer.camera.vCameraPosition - vForward;
         }
 
-        if (keyboard->isKeyPressed(GLFW_KEY_A)) {
+        if (keyboard->isKeyActive(GLFW_KEY_A)) {
             renderer.camera.vCameraPosition = renderer.camera.vCameraPosition + vForward.cross(renderer.camera.vUp).normalize() * 0.2f;
         }
 
-        if (keyboard->isKeyPressed(GLFW_KEY_D)) {
+        if (keyboard->isKeyActive(GLFW_KEY_D)) {
             renderer.camera.vCameraPosition = renderer.camera.vCameraPosition - vForward.cross(renderer.camera.vUp).normalize() * 0.2f;
         }
 
-        if (keyboard->isKeyPressed(GLFW_KEY_SPACE)) {
+        if (keyboard->isKeyActive(GLFW_KEY_SPACE)) {
             renderer.camera.vCameraPosition.y += 0.2f;
         }
 
-        if (keyboard->isKeyPressed(GLFW_KEY_LEFT_SHIFT)) {
+        if (keyboard->isKeyActive(GLFW_KEY_LEFT_SHIFT)) {
             renderer.camera.vCameraPosition.y -= 0.2f;
         }
 
-        if (keyboard->isKeyPressed(GLFW_KEY_ESCAPE)) {
+        if (keyboard->isKeyActive(GLFW_KEY_ESCAPE)) {
             glfwSetWindowShouldClose(glfwGetCurrentContext(), GLFW_TRUE);
             KeyboardE::cleanup();
             glfwDestroyWindow(glfwGetCurrentContext());
             glfwTerminate();
-            FreeConsole();
-            HWND consoleWindow = GetConsoleWindow();
-            PostMessage(consoleWindow, WM_CLOSE, 0, 0);
-            ExitProcess(0);
+            exitApplication();
         }
     }
 
+    // The disabled cursor moves without bounds, so the summed motion is used as is and the
+    // cursor never has to be put back in the middle
     void handleMouseInput(Renderer3d& renderer, float fElapsedTime) {
         KeyboardE* keyboard = KeyboardE::getInstance();
 
-        Vec2f mousePosition = keyboard->getMousePosition();
-
-        int screenWidth = renderer.screenWidth;
-        int screenHeight = renderer.screenHeight;
+        Vec2f motion = keyboard->getMouseMotion();
         float sensitivity = 0.003f;
-        int mouseX = mousePosition.x;
-        int mouseY = mousePosition.y;
 
-        renderer.camera.fYaw -= sensitivity * (mouseX - screenWidth / 2);
-        renderer.camera.fPitch += sensitivity * (mouseY - screenHeight / 2);
+        renderer.camera.fYaw -= sensitivity * motion.x;
+        renderer.camera.fPitch += sensitivity * motion.y;
 
         if (renderer.camera.fPitch < -1.5f)
             renderer.camera.fPitch = -1.5f;
 
         if (renderer.camera.fPitch > 1.5f)
             renderer.camera.fPitch = 1.5f;
-
-        keyboard->setMousePosition({ (float)screenWidth / 2, (float)screenHeight / 2 });
-        glfwSetCursorPos(glfwGetCurrentContext(), (float)screenWidth / 2, (float)screenHeight / 2);
     }
 
     static void cleanup() {
@@ -154,9 +155,12 @@ KeyboardE* KeyboardE::instance = nullptr;
 
 class RenderApp {
 private:
-    vector<Mesh> renderedMeshes;
+    Scene scene;
     vector<PhysicsObject> physicsObjects;
 
+    // The ground bodies collide with, queried by position instead of as a mesh
+    Heightfield terrain;
+
     unique_ptr<Renderer3d> renderer;
     unique_ptr <Physics3d> physics;
 
@@ -167,10 +171,89 @@ private:
     int screenWidth;
     int screenHeight;
 
+    const double idleWaitSeconds = 1.0 / 60.0;
+
+    // Time stamp of the oldest input the frame being drawn has taken, negative when it took none
+    double frameInputTime = -1.0;
+
+    // F9 starts and stops writing every drawn frame out, see setCapture
+    string capturePath = "capture";
+    CaptureFormat captureFormat = CaptureFormat::PNG;
+    bool captureAtStart = false;
+    unique_ptr<FrameCapture> capture;
+    bool captureDropping = false;
+
+    // --record logs the start state and the input of every tick, --replay feeds such a log back
+    // in place of live input and times every frame it draws, see setRecord and setReplay
+    string recordPath;
+    SessionRecorder recorder;
+    bool recording = false;
+    vector<InputEvent> frameEvents;
+
+    unique_ptr<SessionPlayer> player;
+    bool headless = false;
+    bool sessionEnded = false;
+    size_t replayedTicks = 0;
+    FrameTimings timings;
+    string timingsPath;
+
+    // What a headless replay draws into instead of the window
+    Framebuffer offscreen;
+
+    // Traced frames in the window drop their resolution to stay within the budget, see setFrameBudget
+    ResolutionScaler resolution;
+    bool scaleResolution = true;
+
+    // --scene draws a scene file instead of the mountains, its textures come in while it runs
+    string scenePath;
+    unique_ptr<TextureLoader> textureLoader;
+
 public:
     RenderApp() : window(nullptr), screenWidth(0), screenHeight(0), renderer(nullptr), physics(nullptr) {}
 
+    // Capture from the first frame on, path is the file for Y4M and the name prefix for image sequences
+    void setCapture(const string& path, CaptureFormat format) {
+        capturePath = path;
+        captureFormat = format;
+        captureAtStart = true;
+    }
+
+    // Frame time traced frames aim for, 0 always traces at the full window size
+    void setFrameBudget(double ms) {
+        ResolutionSettings settings;
+        settings.budgetMs = ms;
+        resolution = ResolutionScaler(settings);
+        scaleResolution = ms > 0.0;
+    }
+
+    void setRecord(const string& path) {
+        recordPath = path;
+    }
+
+    void setScene(const string& path) {
+        scenePath = path;
+    }
+
+    // Plays a recorded session back, headless without a window at the recorded size as fast as it
+    // goes. The frame times are reported at the end and written to timingsFile when there is one
+    bool setReplay(const string& path, bool withoutWindow, const string& timingsFile) {
+        player = std::make_unique<SessionPlayer>();
+        if (!player->open(path)) {
+            cout << player->error << endl;
+            player.reset();
+            return false;
+        }
+
+        headless = withoutWindow;
+        timingsPath = timingsFile;
+        return true;
+    }
+
     int run() {
+        if (player && headless) {
+            return runHeadless();
+        }
+
         if (!initializeGLFW()) {
             return -1;
         }
@@ -180,19 +263,34 @@ public:
             return -1;
         }
 
-        initialize();
+        if (!initialize()) {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+            return 1;
+        }
 
-        while (!glfwWindowShouldClose(window)) {
+        while (!glfwWindowShouldClose(window) && !sessionEnded) {
             double deltaTime = fpsCounter.currentTime - fpsCounter.lastTime;
 
             glfwMakeContextCurrent(window);
-            glClear(GL_COLOR_BUFFER_BIT);
 
-            handleTick((float)deltaTime);
-            fpsCounter.update();
+            if (handleTick((float)deltaTime)) {
+                fpsCounter.update();
+
+                glfwSwapBuffers(window);
+
+                // The swap returning is as close to the picture showing as GL lets us see
+                if (frameInputTime >= 0.0) {
+                    fpsCounter.addInputLatency(glfwGetTime() - frameInputTime);
+                }
 
-            glfwSwapBuffers(window);
-            glfwPollEvents();
+                glfwPollEvents();
+            }
+            else {
+                // Nothing changed, the last frame stays on screen and the thread sleeps until input arrives.
+                // The timeout keeps held keys moving the camera
+                glfwWaitEventsTimeout(idleWaitSeconds);
+            }
         }
 
         cleanup();
@@ -215,8 +313,16 @@ private:
         screenWidth = mode->width;
         screenHeight = mode->height;
 
+        // A replay draws at the size it was recorded at, the projection depends on it
+        if (player) {
+            screenWidth = player->start.width;
+            screenHeight = player->start.height;
+        }
+
+#ifdef _WIN32
         int monitorCount = 0;
         EnumDisplayMonitors(NULL, NULL, MonitorEnumProc, reinterpret_cast<LPARAM>(&monitorCount));
+#endif
 
         glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
         glfwWindowHint(GLFW_DECORATED, GLFW_FALSE);
@@ -226,50 +332,439 @@ private:
         return window != nullptr;
     }
 
-    void initialize() {
+    bool initialize() {
         glfwGetWindowSize(window, &screenWidth, &screenHeight);
 
+        if (!initializeScene()) {
+            return false;
+        }
+
+        // Initialize other components
+        KeyboardE* keyboard = KeyboardE::getInstance();
+        keyboard->setCallbacks(window);
+
+        glfwMakeContextCurrent(window);
+        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+
+        if (captureAtStart) {
+            startCapture();
+        }
+        return true;
+    }
+
+    // Renderer, physics and scene, the same for the window and a headless replay
+    bool initializeScene() {
         // Initialize renderer
-        renderer = std::make_unique<Renderer3d>(60.0f, screenWidth, screenHeight, renderedMeshes);
-        physics = std::make_unique<Physics3d>(renderedMeshes, physicsObjects);
+        renderer = std::make_unique<Renderer3d>(60.0f, screenWidth, screenHeight, scene);
+        physics = std::make_unique<Physics3d>(scene, physicsObjects);
+
+        if (!scenePath.empty()) {
+            textureLoader = std::make_unique<TextureLoader>();
+            SceneFile sceneFile;
+            sceneFile.textureLoader = textureLoader.get();
+            if (!sceneFile.load(scenePath, scene)) {
+                cout << scenePath << ": " << sceneFile.error << endl;
+                return false;
+            }
+            renderer->setLightDirection(sceneFile.sunDirection);
+            return startSession();
+        }
 
         // Initialize meshes and objects
         Mesh mesh;
         mesh.LoadFromObjectFile("mountains.obj");
         mesh.increaseSize(5.0f);
-        renderedMeshes.push_back(mesh);
+        if (terrain.fromMesh(mesh)) {
+            physics->setTerrain(&terrain);
+        }
+        scene.addInstance(scene.addMesh(std::move(mesh), true));
 
-        // Initialize other components
-        KeyboardE* keyboard = KeyboardE::getInstance();
-        keyboard->setCallbacks(window);
+        return startSession();
+    }
 
-        glfwMakeContextCurrent(window);
-        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    // The recorded ticks back to back, every frame drawn into an offscreen buffer
+    int runHeadless() {
+        screenWidth = player->start.width;
+        screenHeight = player->start.height;
+        offscreen.resize(screenWidth, screenHeight);
+
+        if (!initializeScene()) {
+            return 1;
+        }
+
+        if (captureAtStart) {
+            startCapture();
+        }
+
+        while (!sessionEnded) {
+            handleTick(0.0f);
+        }
+
+        stopCapture();
+        finishSession();
+        return 0;
     }
 
-    void handleTick(float fElapsedTime) {
+    // Both sides need the scene built: the recording stores its counts, the replay checks them
+    bool startSession() {
+        if (!recordPath.empty()) {
+            recording = recorder.open(recordPath, currentStart());
+            cout << (recording ? "Recording session to " : "Cannot record session to ") << recordPath << endl;
+        }
+
+        if (!player) {
+            return true;
+        }
+
+        const SessionStart& start = player->start;
+        bool sameScene = start.instanceCount == scene.getInstanceCount() && start.triangleCount == scene.getTriangleCount() && start.bodies.size() == physicsObjects.size();
+        for (size_t i = 0; sameScene && i < start.bodies.size(); i++) {
+            sameScene = start.bodies[i].instance == physicsObjects[i].getInstance();
+        }
+        if (!sameScene) {
+            cout << "The session was recorded with a different scene" << endl;
+            return false;
+        }
+
+        renderer->camera.vCameraPosition = start.cameraPosition;
+        renderer->camera.fYaw = start.yaw;
+        renderer->camera.fPitch = start.pitch;
+        renderer->setRayTraced(start.rayTraced);
+        renderer->setShadows(start.shadows);
+        renderer->setLightDirection(start.lightDirection);
+
+        for (size_t i = 0; i < start.bodies.size(); i++) {
+            physicsObjects[i].setPosition(start.bodies[i].position);
+            physicsObjects[i].setVelocity(start.bodies[i].velocity);
+        }
+        return true;
+    }
+
+    SessionStart currentStart() {
+        SessionStart start;
+        start.width = screenWidth;
+        start.height = screenHeight;
+        start.cameraPosition = renderer->camera.vCameraPosition;
+        start.yaw = renderer->camera.fYaw;
+        start.pitch = renderer->camera.fPitch;
+        start.rayTraced = renderer->isRayTraced();
+        start.shadows = renderer->hasShadows();
+        start.lightDirection = renderer->getLightDirection();
+        start.instanceCount = (uint32_t)scene.getInstanceCount();
+        start.triangleCount = scene.getTriangleCount();
+        for (auto& body : physicsObjects) {
+            start.bodies.push_back({ (uint32_t)body.getInstance(), body.getPosition(), body.getVelocity() });
+        }
+        return start;
+    }
+
+    // Closes the recording, or reports on the replay
+    void finishSession() {
+        if (recording) {
+            recording = false;
+            if (!recorder.close()) {
+                cout << "Session log " << recordPath << " could not be written completely" << endl;
+            }
+        }
+
+        if (player) {
+            cout << "Replayed " << replayedTicks << " tick(s)" << endl;
+            timings.report();
+            if (!timingsPath.empty() && !timings.save(timingsPath)) {
+                cout << "Cannot write frame times to " << timingsPath << endl;
+            }
+            player.reset();
+        }
+    }
+
+    // Returns whether a frame was drawn
+    bool handleTick(float fElapsedTime) {
         KeyboardE* keyboard = KeyboardE::getInstance();
+        auto tickStart = chrono::steady_clock::now();
+
+        if (player) {
+            // The recorded input and time step replace the live ones, escape in the window ends the replay early
+            SessionFrame frame;
+            if (!player->nextFrame(frame) || (!headless && glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)) {
+                sessionEnded = true;
+                return false;
+            }
+            replayedTicks++;
+
+            keyboard->replayEvents(frame.events, frame.motion);
+            fElapsedTime = frame.elapsed;
+            frameInputTime = -1.0;
+
+            // Escape ended the recording, it ends the replay instead of the process
+            if (keyboard->isKeyActive(GLFW_KEY_ESCAPE)) {
+                sessionEnded = true;
+                return false;
+            }
+        }
+        else {
+            // Everything queued since the last tick lands before the camera moves and the matrices are built
+            frameInputTime = keyboard->processEvents(recording ? &frameEvents : nullptr);
+            if (recording) {
+                recorder.writeFrame(fElapsedTime, frameEvents);
+            }
+        }
+
+        // Escape exits the process right away, the queued frames and the session log have to be on disk before
+        if (keyboard->isKeyActive(GLFW_KEY_ESCAPE)) {
+            stopCapture();
+            finishSession();
+        }
 
-        renderer->drawEvent();
         keyboard->handleKeyboardInput(*renderer, fElapsedTime);
         keyboard->handleMouseInput(*renderer, fElapsedTime);
+
+        // T switches between rasterizing and ray tracing the window
+        if (keyboard->wasKeyPressed(GLFW_KEY_T)) {
+            renderer->setRayTraced(!renderer->isRayTraced());
+            resolution.reset();
+        }
+
+        // Left click reports what is under the crosshair
+        if (keyboard->wasButtonPressed(GLFW_MOUSE_BUTTON_LEFT)) {
+            RayTracer::Hit hit = renderer->pick(screenWidth / 2.0f, screenHeight / 2.0f);
+            if (hit.hit) {
+                cout << "Picked instance " << hit.instance << ", triangle " << hit.triangle << " at distance " << hit.distance << endl;
+            }
+            else {
+                cout << "Nothing under the crosshair" << endl;
+            }
+        }
+
+        if (keyboard->wasKeyPressed(GLFW_KEY_F9)) {
+            if (capture) {
+                stopCapture();
+            }
+            else {
+                startCapture();
+            }
+        }
+
+        physics->update();
+
+        // A recording gets every tick, also the ones where the picture stands still
+        if (!renderer->isDirty() && !capture) {
+            return false;
+        }
+
+        if (headless) {
+            renderer->drawTo(offscreen);
+        }
+        else {
+            auto drawStart = chrono::steady_clock::now();
+            glClear(GL_COLOR_BUFFER_BIT);
+            renderer->drawEvent();
+            scaleTracedFrames(chrono::duration<double, milli>(chrono::steady_clock::now() - drawStart).count());
+        }
+        captureFrame();
+
+        // Input, physics and drawing, the swap is left out as it waits for the display
+        if (player) {
+            timings.add(replayedTicks - 1, chrono::duration<double, milli>(chrono::steady_clock::now() - tickStart).count());
+        }
+        return true;
+    }
+
+    // Rasterized frames cost the same at any size, only traced ones are measured and scaled
+    void scaleTracedFrames(double drawMs) {
+        if (!scaleResolution || !renderer->isRayTraced()) {
+            return;
+        }
+
+        if (resolution.addFrame(drawMs)) {
+            renderer->setRenderScale(resolution.getScale());
+            cout << "Tracing at " << (int)(resolution.getScale() * 100.0f + 0.5f) << "% of the window for " << resolution.getBudget() << " ms frames" << endl;
+        }
+    }
+
+    void startCapture() {
+        capture = std::make_unique<FrameCapture>(capturePath, captureFormat, screenWidth, screenHeight);
+        cout << "Capturing to " << capturePath << endl;
+    }
+
+    void stopCapture() {
+        if (!capture) {
+            return;
+        }
+
+        capture->stop();
+        FrameCapture::Stats stats = capture->getStats();
+        cout << "Captured " << stats.written << " frame(s), " << stats.dropped << " dropped" << (stats.failed ? ", stopped by a write error" : "") << endl;
+        capture.reset();
+    }
+
+    // Reads the finished back buffer into a free capture slot, the frame is dropped when there is none.
+    // Encoding and writing happen on the capture thread, but the GL read back itself is still
+    // synchronous: glReadPixels into client memory waits for the frame to finish drawing. Only
+    // GL 1.1 is loaded here, an asynchronous read through a pixel buffer object would need the
+    // 2.1 entry points fetched at startup
+    void captureFrame() {
+        if (!capture) {
+            return;
+        }
+
+        Framebuffer* frame = capture->acquire();
+        if (!frame) {
+            // Report the first drop of every run of them, the total comes when capture stops
+            if (!captureDropping) {
+                cout << "Capture writer is behind, dropping frames" << endl;
+            }
+            captureDropping = true;
+            return;
+        }
+        captureDropping = false;
+
+        if (headless) {
+            copy(offscreen.color.begin(), offscreen.color.end(), frame->color.begin());
+            capture->submit();
+            return;
+        }
+
+        glReadPixels(0, 0, frame->width, frame->height, GL_RGBA, GL_UNSIGNED_BYTE, frame->color.data());
+        capture->submit(true);
     }
 
     void cleanup() {
+        stopCapture();
+        finishSession();
         glfwSetWindowShouldClose(glfwGetCurrentContext(), GLFW_TRUE);
         KeyboardE::cleanup();
         glfwDestroyWindow(glfwGetCurrentContext());
         glfwTerminate();
-        FreeConsole();
-        HWND consoleWindow = GetConsoleWindow();
-        PostMessage(consoleWindow, WM_CLOSE, 0, 0);
-        ExitProcess(0);
+        exitApplication();
     }
 };
 
-int main() {
+int main(int argc, char** argv) {
+    // render --golden <directory> [--update] checks the software pipeline against stored images,
+    // the repository keeps them in render/goldens
+    if (argc >= 3 && string(argv[1]) == "--golden") {
+        bool update = argc >= 4 && string(argv[3]) == "--update";
+        return GoldenCheck(argv[2], update).run() == 0 ? 0 : 1;
+    }
+
+    // render --math-bench compares the SSE math core with the scalar code it replaced
+    if (argc >= 2 && string(argv[1]) == "--math-bench") {
+        return MathBenchmark().run();
+    }
+
+    // render --mesh-bench [file.obj] [scale] shows what the load time triangle reordering gains, on a
+    // made up terrain grid at scale 5 unless given a mesh
+    if (argc >= 2 && string(argv[1]) == "--mesh-bench") {
+        return MeshBenchmark(argc >= 3 ? argv[2] : "", argc >= 4 ? (float)atof(argv[3]) : argc >= 3 ? 1.0f : 5.0f).run();
+    }
+
+    // render --pipeline-bench compares the specialized raster list passes with the generic one
+    if (argc >= 2 && string(argv[1]) == "--pipeline-bench") {
+        return PipelineBenchmark().run();
+    }
+
+    // render --body-bench [count] times integrating that many bodies per tick, a million by default
+    if (argc >= 2 && string(argv[1]) == "--body-bench") {
+        return BodyBenchmark(argc >= 3 ? (size_t)atoll(argv[2]) : 1000000).run();
+    }
+
+    // render --heightfield-bench [file.obj] [scale] compares heightfield ray casts with testing every
+    // triangle, on made up hills unless given a terrain mesh
+    if (argc >= 2 && string(argv[1]) == "--heightfield-bench") {
+        return HeightfieldBenchmark(argc >= 3 ? argv[2] : "", argc >= 4 ? (float)atof(argv[3]) : 1.0f).run();
+    }
+
+    // render --batch <scene> <camera path> <output prefix> [--size WxH] [--fps N] [--fov degrees]
+    //        [--threads N] [--format ppm|png] [--traced]
+    // renders every frame of the path without opening a window
+    if (argc >= 5 && string(argv[1]) == "--batch") {
+        BatchSettings settings;
+        settings.scenePath = argv[2];
+        settings.cameraPath = argv[3];
+        settings.outputPrefix = argv[4];
+
+        for (int i = 5; i < argc; i++) {
+            string option = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (option == "--size" && hasValue && sscanf(argv[i + 1], "%dx%d", &settings.width, &settings.height) == 2) i++;
+            else if (option == "--fps" && hasValue) settings.framesPerSecond = (float)atof(argv[++i]);
+            else if (option == "--fov" && hasValue) settings.fov = (float)atof(argv[++i]);
+            else if (option == "--threads" && hasValue) settings.threads = atoi(argv[++i]);
+            else if (option == "--format" && hasValue) {
+                string format = argv[++i];
+                if (format != "ppm" && format != "png") {
+                    printf("Unknown format %s\n", format.c_str());
+                    return 1;
+                }
+                settings.format = format == "ppm" ? CaptureFormat::PPM : CaptureFormat::PNG;
+            }
+            else if (option == "--traced") settings.rayTraced = true;
+            else {
+                printf("Unknown batch option %s\n", option.c_str());
+                return 1;
+            }
+        }
+
+        if (settings.width <= 0 || settings.height <= 0 || settings.framesPerSecond <= 0.0f) {
+            printf("Batch size and frame rate have to be positive\n");
+            return 1;
+        }
+
+        return BatchRender(settings).run();
+    }
+
     RenderApp app;
 
+    // render [--capture <path> [ppm|png|y4m]] [--record <log>] [--replay <log> [--headless] [--timings <file.csv>]]
+    //        [--frame-budget <ms>] [--scene <file>]
+    // --capture writes from the first frame on, F9 stops and restarts it. --record logs the session's
+    // input, --replay plays a log back and reports the frame times. Traced frames lower their
+    // resolution to fit --frame-budget, 16.6 ms unless given, 0 turns that off. --scene draws a scene
+    // file in place of the mountains
+    string replayPath, timingsPath;
+    bool headless = false, record = false;
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (option == "--capture" && hasValue) {
+            string path = argv[++i];
+            string format = i + 1 < argc && argv[i + 1][0] != '-' ? argv[++i] : "png";
+            if (format != "ppm" && format != "png" && format != "y4m") {
+                printf("Unknown format %s\n", format.c_str());
+                return 1;
+            }
+            app.setCapture(path, format == "ppm" ? CaptureFormat::PPM : format == "y4m" ? CaptureFormat::Y4M : CaptureFormat::PNG);
+        }
+        else if (option == "--record" && hasValue) {
+            app.setRecord(argv[++i]);
+            record = true;
+        }
+        else if (option == "--replay" && hasValue) replayPath = argv[++i];
+        else if (option == "--headless") headless = true;
+        else if (option == "--timings" && hasValue) timingsPath = argv[++i];
+        else if (option == "--frame-budget" && hasValue) app.setFrameBudget(atof(argv[++i]));
+        else if (option == "--scene" && hasValue) app.setScene(argv[++i]);
+        else {
+            printf("Unknown option %s\n", option.c_str());
+            return 1;
+        }
+    }
+
+    if (headless && replayPath.empty()) {
+        printf("--headless needs --replay\n");
+        return 1;
+    }
+
+    if (!replayPath.empty()) {
+        if (record) {
+            printf("A replay cannot be recorded again\n");
+            return 1;
+        }
+        if (!app.setReplay(replayPath, headless, timingsPath)) {
+            return 1;
+        }
+    }
+
     return app.run();
 }
 
@@ -1,17 +1,117 @@
 #include "math.h"
 #include "keyboard.h"
 #include "camera.h"
+#include "scene.h"
+#include "framebuffer.h"
+#include "rasterizer.h"
+#include "lighting.h"
+#include "shadows.h"
+#include "raytracer.h"
 #include "physics3d.cpp"
-#include <list>
+#include <memory>
+#include <utility>
 
 using namespace std;
 
+// GL 1.2, the headers Windows ships stop at 1.1
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+
+// How a pipeline variant treats an optional stage. Skip and Run leave no test for the stage in the
+// variant's loop, Test decides per triangle the way the generic path does
+enum class Stage { Skip, Run, Test };
+
+template <Stage S>
+inline bool runs(bool enabled) {
+    return S == Stage::Run || (S == Stage::Test && enabled);
+}
+
+constexpr Stage fixedStage(size_t variant, size_t bit) {
+    return variant & bit ? Stage::Run : Stage::Skip;
+}
+
 class Renderer3d {
-    vector<Mesh>& meshes;
+    Scene& scene;
+
+    vector<Triangle> vecTrianglesToRaster;
+    vector<const Texture*> rasterTextures; // Parallel to vecTrianglesToRaster, null when untextured
+    vector<uint32_t> drawOrder;
+
+    // Projected triangles of one instance, kept until the camera, light or the instance changes
+    struct InstanceCache {
+        uint64_t version = 0;
+        bool valid = false;
+        bool texturePending = false; // Rebuilt once the texture finishes loading
+        const Texture* texture = nullptr;
+        vector<Triangle> tris;
+
+        // World space triangles between culling and shading, kept so rebuilds never allocate
+        vector<uint32_t> visibleTris;
+        vector<Triangle> transformedTris;
+
+        // Per triangle light terms, valid while the mesh and the light seen from the instance stay the
+        // same. Kept per instance, rotated copies of one mesh each see the light from their own side
+        weak_ptr<const Mesh> shadedMesh;
+        Vec3d shadedLight;
+        vector<float> shades;
+    };
+    vector<InstanceCache> instanceCaches;
+
+    // Instances transformed this build and waiting for the shadow maps before they are shaded
+    struct RebuiltInstance {
+        const MeshRef* mesh;
+        size_t instance;
+    };
+    vector<RebuiltInstance> rebuiltInstances;
+
+    uint64_t builtVersion = 0;
+    uint64_t builtLightsVersion = 0;
+    bool viewDirty = true;
+    bool texturesPending = false;
+    bool orderDirty = true;
+
+    // What the shading pass of one instance works with, every choice made before its loop starts
+    struct ShadeJob {
+        const Mesh* mesh;
+        const MeshInstance* instance;
+        InstanceCache* cache;
+        const vector<float>* shades;
+        Mat4x4 instanceView;
+        bool shadowed, localLights, nearClip, textured;
+    };
+
+    // One compiled shading pass per combination of the per instance choices, picked per instance.
+    // The generic pass tests them per triangle and is kept to compare against
+    using ShadePass = void (Renderer3d::*)(const ShadeJob&);
+    enum { shadowedBit = 1, localLightsBit = 2, nearClipBit = 4, texturedBit = 8, variantCount = 16 };
+    bool specializedPipeline = true;
+
+    Vec3d lightDirection;
+
+    // Scene lights binned in view space, rebuilt with the view
+    LightGrid lightGrid;
+
+    ShadowCascades shadows;
+    bool shadowsEnabled = true;
+
+    // Alternative to rasterizing, the window shows traceTarget instead of the GL triangles
+    RayTracer rayTracer;
+    bool rayTraced = false;
+    Framebuffer traceTarget;
+
+    // Traced frames are rendered at this fraction of the window size, then scaled up to it by GL
+    float renderScale = 1.0f;
+    GLuint scaleTexture = 0;
+    int scaleTextureWidth = 0;
+    int scaleTextureHeight = 0;
+
+    // Distance of the near plane, triangles are clipped against it in view space
+    static constexpr float nearPlane = 0.01f;
 
-    Mat4x4 worldMatrix;
     Mat4x4 viewMatrix;
     Mat4x4 projectionMatrix;
+    Mat4x4 cameraMatrix;
 
 public:
     Camera camera;
@@ -19,154 +119,560 @@ public:
     float screenWidth;
     float screenHeight;
 
-    Renderer3d(float ffov, float width, float height, vector<Mesh>& meshes)
-        : screenWidth(width), screenHeight(height), meshes(meshes) {
+    Renderer3d(float ffov, float width, float height, Scene& scene)
+        : screenWidth(width), screenHeight(height), scene(scene) {
+
+        projectionMatrix = Mat4x4::MakeProjection(ffov, width / height, nearPlane, 1000.0f);
+        setLightDirection({ 0.0f, 1.0f, -1.0f });
+    }
+
+    void setLightDirection(Vec3d direction) {
+        lightDirection = direction.normalize();
+        lightDirection.w = 0.0f;
+        viewDirty = true;
+    }
+
+    Vec3d getLightDirection() const {
+        return lightDirection;
+    }
+
+    void setShadows(bool enabled) {
+        shadowsEnabled = enabled;
+        viewDirty = true;
+    }
+
+    bool hasShadows() const {
+        return shadowsEnabled;
+    }
+
+    void setRayTraced(bool enabled) {
+        rayTraced = enabled;
+        viewDirty = true;
+    }
+
+    // False runs every instance through the generic pass, for measuring what the variants gain
+    void setSpecializedPipeline(bool enabled) {
+        specializedPipeline = enabled;
+        viewDirty = true;
+    }
+
+    bool isSpecializedPipeline() const {
+        return specializedPipeline;
+    }
+
+    bool isRayTraced() const {
+        return rayTraced;
+    }
+
+    // Takes effect with the next traced frame, a frame already on screen is not redrawn for it
+    void setRenderScale(float scale) {
+        renderScale = min(max(scale, 0.05f), 1.0f);
+    }
+
+    float getRenderScale() const {
+        return renderScale;
+    }
+
+    // Threads one traced frame is split across, 0 for all of them
+    void setTraceThreads(int count) {
+        rayTracer.setThreadCount(count);
+    }
+
+    // Primary and shadow rays of the last traced frame
+    uint64_t getRayCount() const {
+        return rayTracer.getRayCount();
+    }
+
+    // Whether the next frame would differ from the last one built
+    bool isDirty() const {
+        return viewDirty || camera.isDirty() || scene.getLightsVersion() != builtLightsVersion || scene.getVersion() != builtVersion || texturesPending;
+    }
 
-        projectionMatrix = Mat4x4::MakeProjection(ffov, width / height, 0.01f, 1000.0f);
+    // Drop every cached instance, the next frame rebuilds the whole scene
+    void invalidate() {
+        viewDirty = true;
     }
 
     void drawEvent() {
-        drawMeshes();
+        if (rayTraced)
+            drawTraced();
+        else
+            drawMeshes();
 
         //draw downwards trig in middle of screen with edge at the middle with size of x 
         float x = 0.005f;
         drawTriangle({ -x, -x, 0.0f }, { x, -x, 0.0f }, { 0.0f, x, 0.0f }, { 1.0f, 0.0f, 0.0f });
     }
 
+    // Render the scene without GL into an offscreen buffer, mapped to pixels the same way the window would show it
+    void renderTo(Framebuffer& target) {
+        buildRasterList();
+
+        target.clear(Framebuffer::packColor({ 0.0f, 0.0f, 0.0f }));
+
+        for (size_t i = 0; i < vecTrianglesToRaster.size(); i++) {
+            const Triangle& triToRaster = vecTrianglesToRaster[i];
+            Vec3d pixels[3] = { toPixels(target, triToRaster.p[0]), toPixels(target, triToRaster.p[1]), toPixels(target, triToRaster.p[2]) };
+
+            if (rasterTextures[i])
+                Rasterizer::drawTexturedTriangle(target, pixels, triToRaster.t, triToRaster.color, *rasterTextures[i]);
+            else
+                Rasterizer::drawTriangle(target, pixels[0], pixels[1], pixels[2], Framebuffer::packColor(triToRaster.color));
+        }
+    }
+
+    // Transform, cull, light and project without drawing anything, the part of renderTo before the rasterizer
+    void prepare() {
+        buildRasterList();
+    }
+
+    // What drawEvent would show, drawn into an offscreen buffer instead of the window
+    void drawTo(Framebuffer& target) {
+        if (rayTraced) {
+            traceTo(target);
+            markTraced();
+        }
+        else {
+            renderTo(target);
+        }
+    }
+
+    // Ray trace the scene into an offscreen buffer with the same camera and pixel mapping as renderTo
+    void traceTo(Framebuffer& target) {
+        scene.updateTransforms();
+        setupMatrices();
+        buildLightGrid();
+
+        rayTracer.update(scene);
+        rayTracer.render(target, scene, makeView(target.width, target.height), lightDirection, shadowsEnabled, &lightGrid, viewMatrix);
+    }
+
+    // The nearest surface under a window pixel
+    RayTracer::Hit pick(float x, float y) {
+        scene.updateTransforms();
+        setupMatrices();
+        rayTracer.update(scene);
+
+        RayTracer::View view = makeView((int)screenWidth, (int)screenHeight);
+        return rayTracer.trace(view.origin, view.topLeft + view.stepX * x + view.stepY * y);
+    }
+
 private:
+    // Traces the window frame and hands it to GL. The raster caches are left alone and rebuilt
+    // in full once rasterizing resumes
+    void drawTraced() {
+        int width = max(1, (int)(screenWidth * renderScale + 0.5f));
+        int height = max(1, (int)(screenHeight * renderScale + 0.5f));
+        if (traceTarget.width != width || traceTarget.height != height)
+            traceTarget.resize(width, height);
+
+        traceTo(traceTarget);
+        markTraced();
+
+        if (width == (int)screenWidth && height == (int)screenHeight) {
+            // Rows are stored top down, GL reads them bottom up
+            glRasterPos2f(-1.0f, 1.0f);
+            glPixelZoom(1.0f, -1.0f);
+            glDrawPixels(traceTarget.width, traceTarget.height, GL_RGBA, GL_UNSIGNED_BYTE, traceTarget.color.data());
+        }
+        else {
+            drawScaled(traceTarget);
+        }
+    }
+
+    // A smaller frame goes up as a texture and is stretched over the window, GL filters it
+    // bilinearly for next to nothing. The texture is only reallocated when the size changes
+    void drawScaled(const Framebuffer& frame) {
+        if (!scaleTexture) {
+            glGenTextures(1, &scaleTexture);
+            glBindTexture(GL_TEXTURE_2D, scaleTexture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        glBindTexture(GL_TEXTURE_2D, scaleTexture);
+
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        if (frame.width != scaleTextureWidth || frame.height != scaleTextureHeight) {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, frame.width, frame.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, frame.color.data());
+            scaleTextureWidth = frame.width;
+            scaleTextureHeight = frame.height;
+        }
+        else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame.width, frame.height, GL_RGBA, GL_UNSIGNED_BYTE, frame.color.data());
+        }
+
+        // The first row is the top of the window
+        glEnable(GL_TEXTURE_2D);
+        glColor3f(1.0f, 1.0f, 1.0f);
+        glBegin(GL_QUADS);
+        glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, 1.0f);
+        glTexCoord2f(1.0f, 0.0f); glVertex2f(1.0f, 1.0f);
+        glTexCoord2f(1.0f, 1.0f); glVertex2f(1.0f, -1.0f);
+        glTexCoord2f(0.0f, 1.0f); glVertex2f(-1.0f, -1.0f);
+        glEnd();
+        glDisable(GL_TEXTURE_2D);
+    }
+
+    // A traced frame is built from the current state as much as a rasterized one
+    void markTraced() {
+        camera.clearDirty();
+        builtVersion = scene.getVersion();
+        builtLightsVersion = scene.getLightsVersion();
+        viewDirty = false;
+        texturesPending = rayTracer.hasPendingTextures();
+    }
+
+    // Primary rays through the pixel centers of a target, matching the projection the rasterizer uses
+    RayTracer::View makeView(int width, int height) const {
+        float scaleX = 0.5f * projectionMatrix.m[0][0];
+        float scaleY = 0.5f * projectionMatrix.m[1][1];
+
+        Vec3d right = { cameraMatrix.m[0][0], cameraMatrix.m[0][1], cameraMatrix.m[0][2] };
+        Vec3d up = { cameraMatrix.m[1][0], cameraMatrix.m[1][1], cameraMatrix.m[1][2] };
+        Vec3d forward = { cameraMatrix.m[2][0], cameraMatrix.m[2][1], cameraMatrix.m[2][2] };
+
+        RayTracer::View view;
+        view.origin = camera.vCameraPosition;
+        view.stepX = right * (2.0f / (width * scaleX));
+        view.stepY = up * (-2.0f / (height * scaleY));
+        view.topLeft = forward + right * ((1.0f / width - 1.0f) / scaleX) + up * ((1.0f - 1.0f / height) / scaleY);
+        return view;
+    }
+
+    void buildLightGrid() {
+        // Same screen mapping as the projection followed by the halving in drawTransformedTriangle
+        lightGrid.build(scene.lights, viewMatrix, 0.5f * projectionMatrix.m[0][0], 0.5f * projectionMatrix.m[1][1], 0.1f, 1000.0f);
+    }
+
     void drawMeshes() {
-        setupMatrices();
+        buildRasterList();
+
+        // The painter's order only changes with the raster list
+        if (orderDirty) {
+            // Sort indices rather than whole triangles, the textures stay parallel to the raster list
+            drawOrder.resize(vecTrianglesToRaster.size());
+            for (uint32_t i = 0; i < drawOrder.size(); i++) {
+                drawOrder[i] = i;
+            }
+
+            sort(drawOrder.begin(), drawOrder.end(), [this](uint32_t i1, uint32_t i2) {
+                const Triangle& t1 = vecTrianglesToRaster[i1];
+                const Triangle& t2 = vecTrianglesToRaster[i2];
+                float z1 = (t1.p[0].z + t1.p[1].z + t1.p[2].z) / 3.0f;
+                float z2 = (t2.p[0].z + t2.p[1].z + t2.p[2].z) / 3.0f;
+                return z1 > z2;
+            });
+
+            orderDirty = false;
+        }
 
-        vector<Triangle> vecTrianglesToRaster;
+        // GL draws flat colors only, textures are left to the software rasterizer
+        for (uint32_t i : drawOrder) {
+            const Triangle& triToRaster = vecTrianglesToRaster[i];
+            drawTriangle(triToRaster.p[0], triToRaster.p[1], triToRaster.p[2], triToRaster.color);
+        }
+    }
 
-        for (auto mesh : meshes) {
-            for (auto tri : mesh.tris) {
-                // Will be rendering in 3 stages
-                Triangle triProjected, triTransformed, triViewed;
+    // Normalized device coordinates to pixels, row 0 at the top. w keeps the 1/w of the projection
+    static Vec3d toPixels(const Framebuffer& target, const Vec3d& p) {
+        return Vec3d((p.x + 1.0f) * 0.5f * target.width, (1.0f - p.y) * 0.5f * target.height, p.z, p.w);
+    }
 
-                // Apply world matrix to each vertex
-                for (int i = 0; i < 3; i++) {
-                    triTransformed.p[i] = Mat4x4::MultiplyVector(worldMatrix, tri.p[i]);
-                }
+    // Transform, cull, light, clip and project the scene into vecTrianglesToRaster. Instances keep their
+    // projected triangles until the camera, the light or the instance itself changes, so a still frame
+    // rebuilds nothing and a moving object only redoes its own triangles
+    void buildRasterList() {
+        scene.updateTransforms();
+
+        bool viewChanged = viewDirty || camera.isDirty() || scene.getLightsVersion() != builtLightsVersion;
+        if (!viewChanged && scene.getVersion() == builtVersion && !texturesPending)
+            return;
+
+        if (viewChanged) {
+            setupMatrices();
+            camera.clearDirty();
+            buildLightGrid();
+            builtLightsVersion = scene.getLightsVersion();
+        }
 
-                Vec3d normal = triTransformed.getNormal();
-                Vec3d vCameraRay = triTransformed.p[0] - camera.vCameraPosition;
+        // Stale shadow cascades render on worker threads while this thread culls and transforms.
+        // A new shadow map can darken any instance, so every instance is shaded again then
+        const auto& batches = scene.getBatches();
+        if (shadowsEnabled && shadows.begin(scene, lightDirection, camera.vCameraPosition))
+            viewChanged = true;
+
+        instanceCaches.resize(scene.instances.size());
+        texturesPending = false;
+        rebuiltInstances.clear();
+
+        for (auto& batch : batches) {
+            const Mesh& mesh = *batch.mesh;
+
+            for (size_t instanceIndex : batch.instances) {
+                const MeshInstance& instance = scene.instances[instanceIndex];
+                InstanceCache& cache = instanceCaches[instanceIndex];
+
+                if (!viewChanged && cache.valid && cache.version == instance.version && !cache.texturePending)
+                    continue;
+
+                cache.tris.clear();
+                cache.valid = true;
+                cache.version = instance.version;
+
+                // Until the loader has finished the instance draws with its plain color
+                const Texture* texture = instance.material.texture.get();
+                cache.texturePending = texture && !texture->ready.load(memory_order_acquire) && !texture->failed.load(memory_order_acquire);
+                cache.texture = texture && texture->ready.load(memory_order_acquire) ? texture : nullptr;
+
+                if (instance.invisible) continue;
+
+                Vec3d cameraLocal = Mat4x4::MultiplyVector(Mat4x4::InverseAffine(instance.transform), camera.vCameraPosition);
+                cullBackfaces(mesh, cameraLocal, cache.visibleTris);
+
+                bool textured = cache.texture != nullptr;
+                if (!specializedPipeline)
+                    transformBatch<Stage::Test, Stage::Test>(mesh, instance.transform, cache.visibleTris, cache.transformedTris, textured);
+                else if (mesh.isCompressed())
+                    textured ? transformBatch<Stage::Run, Stage::Run>(mesh, instance.transform, cache.visibleTris, cache.transformedTris, true)
+                             : transformBatch<Stage::Run, Stage::Skip>(mesh, instance.transform, cache.visibleTris, cache.transformedTris, false);
+                else
+                    textured ? transformBatch<Stage::Skip, Stage::Run>(mesh, instance.transform, cache.visibleTris, cache.transformedTris, true)
+                             : transformBatch<Stage::Skip, Stage::Skip>(mesh, instance.transform, cache.visibleTris, cache.transformedTris, false);
+                rebuiltInstances.push_back({ &batch.mesh, instanceIndex });
+            }
+        }
 
-                // Only draw triangles that face the camera (backface culling)
-                float dotProduct = normal.dot(vCameraRay);
+        if (shadowsEnabled)
+            shadows.finish();
 
-                if (dotProduct >= 0.0f) continue;
+        bool localLights = lightGrid.lightCount() > 0;
 
-                // Get shading of triangle
-                Vec3d light_direction = { 0.0f, 1.0f, -1.0f };
-                light_direction = light_direction.normalize();
-                float dp = max(0.1f, light_direction.dot(normal));
+        static const ShadePass* shadePasses = makeShadePasses(make_index_sequence<variantCount>());
 
-                triTransformed.color = { dp, dp, dp };
+        for (auto& rebuilt : rebuiltInstances) {
+            const Mesh& mesh = **rebuilt.mesh;
+            const MeshInstance& instance = scene.instances[rebuilt.instance];
+            InstanceCache& cache = instanceCaches[rebuilt.instance];
+            const Mat4x4& instanceMatrix = instance.transform;
 
-                // Apply view matrix to each vertex
-                for (int i = 0; i < 3; i++) {
-                    triViewed.p[i] = Mat4x4::MultiplyVector(viewMatrix, triTransformed.p[i]);
-                }
+            // Bring the light into object space instead of every normal into world space
+            Vec3d lightLocal = Mat4x4::MultiplyVector(Mat4x4::InverseAffine(instanceMatrix), lightDirection).normalize();
 
-                triViewed.color = triTransformed.color;
+            ShadeJob job;
+            job.mesh = &mesh;
+            job.instance = &instance;
+            job.cache = &cache;
+            job.shades = &getShading(cache, *rebuilt.mesh, lightLocal);
+            job.instanceView = localLights ? Mat4x4::MultiplyMatrix(instanceMatrix, viewMatrix) : Mat4x4();
+            job.shadowed = shadowsEnabled;
+            job.localLights = localLights;
+            job.nearClip = crossesNearPlane(mesh, instanceMatrix);
+            job.textured = cache.texture != nullptr;
 
-                // Clip triangles against near plane
-                int nClippedTriangles = 0;
-                Triangle clipped[2];
-                nClippedTriangles = Triangle::clipAgainstPlane({ 0.0f, 0.0f, 0.01f }, { 0.0f, 0.0f, 1.0f }, triViewed, clipped[0], clipped[1]);
+            if (!specializedPipeline) {
+                shadeInstance<Stage::Test, Stage::Test, Stage::Test, Stage::Test>(job);
+                continue;
+            }
 
-                for (int n = 0; n < nClippedTriangles; n++) {
-                    Triangle clippedTriangle = clipped[n];
-                    Triangle triProjected;
+            size_t variant = (job.shadowed ? shadowedBit : 0) | (job.localLights ? localLightsBit : 0) |
+                (job.nearClip ? nearClipBit : 0) | (job.textured ? texturedBit : 0);
+            (this->*shadePasses[variant])(job);
+        }
+
+        // Stitch the instance lists back together in scene order
+        vecTrianglesToRaster.clear();
+        rasterTextures.clear();
 
-                    // Apply projection matrix to each vertex
-                    for (int i = 0; i < 3; i++) {
-                        triProjected.p[i] = Mat4x4::MultiplyVector(projectionMatrix, clippedTriangle.p[i]);
-                        triProjected.p[i] = triProjected.p[i] / triProjected.p[i].w;
-                    }
+        for (auto& cache : instanceCaches) {
+            texturesPending = texturesPending || cache.texturePending;
+            vecTrianglesToRaster.insert(vecTrianglesToRaster.end(), cache.tris.begin(), cache.tris.end());
+            rasterTextures.insert(rasterTextures.end(), cache.tris.size(), cache.texture);
+        }
 
-                    // Scale and shift to screen space
-                    for (int i = 0; i < 3; i++) {
-                        triProjected.p[i].x *= 0.5f;
-                        triProjected.p[i].y *= 0.5f;
-                    }
+        builtVersion = scene.getVersion();
+        viewDirty = false;
+        orderDirty = true;
+    }
 
-                    triProjected.color = clippedTriangle.color;
+    template <size_t... Variants>
+    static const ShadePass* makeShadePasses(index_sequence<Variants...>) {
+        static const ShadePass passes[] = {
+            &Renderer3d::shadeInstance<fixedStage(Variants, shadowedBit), fixedStage(Variants, localLightsBit),
+                fixedStage(Variants, nearClipBit), fixedStage(Variants, texturedBit)>...
+        };
+        return passes;
+    }
+
+    // Light, shadow and project the transformed triangles of one instance into its cache
+    template <Stage Shadows, Stage LocalLights, Stage NearClip, Stage TexCoords>
+    void shadeInstance(const ShadeJob& job) {
+        const Mesh& mesh = *job.mesh;
+        const MeshInstance& instance = *job.instance;
+        InstanceCache& cache = *job.cache;
+        const vector<float>& shades = *job.shades;
+
+        for (size_t v = 0; v < cache.visibleTris.size(); v++) {
+            Triangle& triTransformed = cache.transformedTris[v];
+            uint32_t t = cache.visibleTris[v];
+            float shade = shades[t];
+
+            // Faces turned away from the light are at the ambient floor already, shadowed or not
+            if (runs<Shadows>(job.shadowed) && shade > 0.1f) {
+                Vec3d center = (triTransformed.p[0] + triTransformed.p[1] + triTransformed.p[2]) * (1.0f / 3.0f);
+                Vec3d normal = mesh.normal(t);
+                normal.w = 0.0f;
+                normal = Mat4x4::MultiplyVector(instance.transform, normal).normalize();
+                shade = max(0.1f, shade * shadows.visibility(center, normal));
+            }
 
-                    // Add to the list
-                    vecTrianglesToRaster.push_back(triProjected);
-                }
+            triTransformed.color = instance.material.color * shade;
 
+            if (runs<LocalLights>(job.localLights)) {
+                Vec3d light = shadeLocalLights(mesh, t, job.instanceView);
+                const Vec3d& color = instance.material.color;
+                triTransformed.color = { color.x * (shade + light.x), color.y * (shade + light.y), color.z * (shade + light.z) };
             }
+
+            drawTransformedTriangle<NearClip, TexCoords>(triTransformed, cache.tris, job.nearClip, job.textured);
+        }
+    }
+
+    // Whether any part of the instance can be closer than the near plane. Instances entirely in front
+    // of it go through a pass without the clip test
+    bool crossesNearPlane(const Mesh& mesh, const Mat4x4& instanceMatrix) const {
+        Mat4x4 instanceView = Mat4x4::MultiplyMatrix(instanceMatrix, viewMatrix);
+        for (int corner = 0; corner < 8; corner++) {
+            Vec3d p = {
+                corner & 1 ? mesh.boundsMax.x : mesh.boundsMin.x,
+                corner & 2 ? mesh.boundsMax.y : mesh.boundsMin.y,
+                corner & 4 ? mesh.boundsMax.z : mesh.boundsMin.z,
+            };
+            if (Mat4x4::MultiplyVector(instanceView, p).z < nearPlane + 0.001f)
+                return true;
         }
+        return false;
+    }
+
+    // Only keep triangles that face the camera (backface culling), tested in object space with the stored normals.
+    // Whole clusters facing away are rejected by their normal cone without touching their vertices
+    void cullBackfaces(const Mesh& mesh, const Vec3d& cameraLocal, vector<uint32_t>& visibleTris) {
+        visibleTris.clear();
 
-        sort(vecTrianglesToRaster.begin(), vecTrianglesToRaster.end(), [](Triangle& t1, Triangle& t2) {
-            float z1 = (t1.p[0].z + t1.p[1].z + t1.p[2].z) / 3.0f;
-            float z2 = (t2.p[0].z + t2.p[1].z + t2.p[2].z) / 3.0f;
-            return z1 > z2;
-        });
+        if (mesh.clusters.empty()) {
+            cullTriangles(mesh, cameraLocal, 0, (uint32_t)mesh.triangleCount(), visibleTris);
+            return;
+        }
 
-        clipAndRasterizeTriangles(vecTrianglesToRaster);
+        for (auto& cluster : mesh.clusters) {
+            if (cluster.isBackfacing(cameraLocal)) continue;
 
-        for (auto& triToRaster : vecTrianglesToRaster) {
-            drawTriangle(triToRaster.p[0], triToRaster.p[1], triToRaster.p[2], triToRaster.color);
+            cullTriangles(mesh, cameraLocal, cluster.first, cluster.first + cluster.count, visibleTris);
         }
     }
 
-    void clipAndRasterizeTriangles(const vector<Triangle>& vecTrianglesToRaster) {
-        for (auto& originalTriangle : vecTrianglesToRaster) {
-            Triangle clipped[2];
-            list<Triangle> listTriangles;
-
-            listTriangles.push_back(originalTriangle);
-            int nNewTriangles = 1;
-
-            for (int p = 0; p < 4; p++) {
-                int nTrisToAdd = 0;
-
-                while (nNewTriangles > 0) {
-                    Triangle test = listTriangles.front();
-                    listTriangles.pop_front();
-                    nNewTriangles--;
-
-                    switch (p) {
-                    case 0:
-                        nTrisToAdd = Triangle::clipAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, test, clipped[0], clipped[1]);
-                        break;
-                    case 1:
-                        nTrisToAdd = Triangle::clipAgainstPlane({ 0.0f, (float)screenHeight - 1, 0.0f }, { 0.0f, -1.0f, 0.0f }, test, clipped[0], clipped[1]);
-                        break;
-                    case 2:
-                        nTrisToAdd = Triangle::clipAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 1.0f, 0.0f, 0.0f }, test, clipped[0], clipped[1]);
-                        break;
-                    case 3:
-                        nTrisToAdd = Triangle::clipAgainstPlane({ (float)screenWidth - 1, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, test, clipped[0], clipped[1]);
-                        break;
-                    }
-
-                    for (int w = 0; w < nTrisToAdd; w++) {
-                        listTriangles.push_back(clipped[w]);
-                    }
-                }
+    void cullTriangles(const Mesh& mesh, const Vec3d& cameraLocal, uint32_t first, uint32_t last, vector<uint32_t>& visibleTris) {
+        for (uint32_t t = first; t < last; t++) {
+            Vec3d vCameraRay = mesh.position(t, 0) - cameraLocal;
+            if (mesh.normal(t).dot(vCameraRay) < 0.0f) {
+                visibleTris.push_back(t);
             }
         }
     }
 
+    // Transform every visible triangle of a shared mesh by one instance matrix in a single tight pass.
+    // Compressed meshes have the dequantization folded into the matrix. Texture coordinates are only
+    // carried for instances that draw with a texture
+    template <Stage Packed, Stage TexCoords>
+    void transformBatch(const Mesh& mesh, const Mat4x4& instanceMatrix, const vector<uint32_t>& visibleTris, vector<Triangle>& transformedTris, bool textured) {
+        transformedTris.resize(visibleTris.size());
+        Mat4x4 transform = mesh.positionTransform(instanceMatrix);
+
+        for (size_t v = 0; v < visibleTris.size(); v++) {
+            if (runs<Packed>(mesh.isCompressed()))
+                mesh.transformTriangleAs<true>(visibleTris[v], transform, transformedTris[v].p);
+            else
+                mesh.transformTriangleAs<false>(visibleTris[v], transform, transformedTris[v].p);
+
+            if (runs<TexCoords>(textured))
+                mesh.texCoords(visibleTris[v], transformedTris[v].t);
+        }
+    }
 
-    void setupMatrices() {
-        Mat4x4 translationMatrix;
-        translationMatrix = Mat4x4::MakeIdentity();
-        translationMatrix = Mat4x4::MakeTranslation(0.0f, 0.0f, 0.0f);
+    // Point and spot lights at the triangle's center, only the lights binned to its grid cell are evaluated
+    Vec3d shadeLocalLights(const Mesh& mesh, uint32_t t, const Mat4x4& instanceView) {
+        Vec3d center = Mat4x4::MultiplyVector(instanceView, (mesh.position(t, 0) + mesh.position(t, 1) + mesh.position(t, 2)) * (1.0f / 3.0f));
+        Vec3d normal = Mat4x4::MultiplyVector(instanceView, mesh.normal(t)).normalize();
+        return lightGrid.shade(center, normal);
+    }
 
-        worldMatrix = Mat4x4::MakeIdentity();
-        worldMatrix = Mat4x4::MultiplyMatrix(worldMatrix, translationMatrix);
+    // Light terms only depend on the light direction in object space, so static lights reuse them every frame
+    const vector<float>& getShading(InstanceCache& cache, const MeshRef& mesh, const Vec3d& lightLocal) {
+        bool sameMesh = cache.shadedMesh.lock() == mesh && cache.shades.size() == mesh->triangleCount();
+        bool sameLight = cache.shadedLight.x == lightLocal.x && cache.shadedLight.y == lightLocal.y && cache.shadedLight.z == lightLocal.z;
 
-        Mat4x4 cameraRotationMatrix, cameraRotationMatrixX, cameraRotationMatrixY;
-        cameraRotationMatrixY = Mat4x4::MakeRotationY(camera.fYaw);
-        cameraRotationMatrixX = Mat4x4::MakeRotationX(camera.fPitch);
+        if (!sameMesh || !sameLight) {
+            cache.shadedMesh = mesh;
+            cache.shadedLight = lightLocal;
+            cache.shades.resize(mesh->triangleCount());
+
+            for (size_t t = 0; t < cache.shades.size(); t++) {
+                cache.shades[t] = max(0.1f, lightLocal.dot(mesh->normal(t)));
+            }
+        }
 
-        cameraRotationMatrix = Mat4x4::MultiplyMatrix(cameraRotationMatrixX, cameraRotationMatrixY);
+        return cache.shades;
+    }
+
+    template <Stage NearClip, Stage TexCoords>
+    void drawTransformedTriangle(const Triangle& triTransformed, vector<Triangle>& projectedTris, bool nearClip, bool textured) {
+        Triangle triViewed;
+
+        // Apply view matrix to each vertex
+        for (int i = 0; i < 3; i++) {
+            triViewed.p[i] = Mat4x4::MultiplyVector(viewMatrix, triTransformed.p[i]);
+            if (runs<TexCoords>(textured))
+                triViewed.t[i] = triTransformed.t[i];
+        }
+
+        triViewed.color = triTransformed.color;
+
+        // Clip triangles against near plane
+        int nClippedTriangles = 1;
+        Triangle clipped[2] = { triViewed };
+        if (runs<NearClip>(nearClip))
+            nClippedTriangles = Triangle::clipAgainstPlane({ 0.0f, 0.0f, nearPlane }, { 0.0f, 0.0f, 1.0f }, triViewed, clipped[0], clipped[1]);
+
+        for (int n = 0; n < nClippedTriangles; n++) {
+            Triangle clippedTriangle = clipped[n];
+            Triangle triProjected;
+
+            // Apply projection matrix to each vertex, keeping 1/w in w and dividing the texture
+            // coordinates by it so they can be interpolated in screen space
+            for (int i = 0; i < 3; i++) {
+                Vec3d clip = Mat4x4::MultiplyVector(projectionMatrix, clippedTriangle.p[i]);
+                float invW = 1.0f / clip.w;
+                triProjected.p[i] = Vec3d(clip.x * invW, clip.y * invW, clip.z * invW, invW);
+                if (runs<TexCoords>(textured))
+                    triProjected.t[i] = clippedTriangle.t[i] * invW;
+            }
+
+            // Scale and shift to screen space
+            for (int i = 0; i < 3; i++) {
+                triProjected.p[i].x *= 0.5f;
+                triProjected.p[i].y *= 0.5f;
+            }
+
+            triProjected.color = clippedTriangle.color;
+
+            // Add to the list
+            projectedTris.push_back(triProjected);
+        }
+    }
+
+    void setupMatrices() {
+        Mat4x4 cameraRotationMatrix = Mat4x4::MakeRotationXY(camera.fPitch, camera.fYaw);
 
         camera.vUp = { 0,1,0 };
         camera.vTarget = { 0,0,1 };
@@ -174,7 +680,7 @@ private:
         camera.vLookDir = Mat4x4::MultiplyVector(cameraRotationMatrix, camera.vTarget);
         camera.vTarget = camera.vCameraPosition + camera.vLookDir;
 
-        Mat4x4 cameraMatrix = Mat4x4::PointAt(camera.vCameraPosition, camera.vTarget, camera.vUp);
+        cameraMatrix = Mat4x4::PointAt(camera.vCameraPosition, camera.vTarget, camera.vUp);
 
         viewMatrix = Mat4x4::QuickInverse(cameraMatrix);
     }
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+struct ResolutionSettings {
+    double budgetMs = 1000.0 / 60.0;
+    float minScale = 0.25f;
+    float maxScale = 1.0f;
+    double aim = 0.85;       // Fraction of the budget a new scale is chosen for
+    double raiseBelow = 0.7; // Frames have to stay under this fraction of the budget to go up
+    int raiseAfter = 30;     // Frames in a row under raiseBelow before going up
+    float maxRaise = 0.1f;   // Largest step up, a rise is a guess until it is measured
+    int window = 9;          // Frames in the median
+};
+
+// Picks the fraction of the window size frames are rendered at so they fit a frame time budget.
+// The median of the last few frames is what gets compared, a single slow frame changes nothing.
+// Over budget the scale drops at once by what the pixel count predicts, and it only climbs back
+// after the frames stayed well under budget for a while. Both aim somewhat below the budget and
+// a rise only starts further below that, so the scale settles instead of flipping between sizes
+class ResolutionScaler {
+    ResolutionSettings settings;
+    float scale;
+
+    vector<double> recent;
+    size_t frames = 0;
+    int underBudget = 0;
+
+public:
+    ResolutionScaler(const ResolutionSettings& settings = ResolutionSettings()) : settings(settings), scale(settings.maxScale) {
+        recent.resize(max(settings.window, 1));
+    }
+
+    float getScale() const {
+        return scale;
+    }
+
+    double getBudget() const {
+        return settings.budgetMs;
+    }
+
+    // Forget the measurements, for when frames stop being comparable like after a mode switch
+    void reset() {
+        frames = 0;
+        underBudget = 0;
+    }
+
+    // Time one frame took at the current scale. Returns whether the scale changed
+    bool addFrame(double ms) {
+        recent[frames++ % recent.size()] = ms;
+        if (frames < recent.size())
+            return false;
+
+        vector<double> sorted = recent;
+        nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+        double median = max(sorted[sorted.size() / 2], 0.001);
+
+        // Frame time goes with the pixel count, the square of the scale
+        float fit = scale * (float)sqrt(settings.budgetMs * settings.aim / median);
+
+        if (median > settings.budgetMs) {
+            return change(max(fit, settings.minScale));
+        }
+
+        if (median < settings.budgetMs * settings.raiseBelow && scale < settings.maxScale) {
+            if (++underBudget >= settings.raiseAfter)
+                return change(min(min(fit, scale + settings.maxRaise), settings.maxScale));
+            return false;
+        }
+
+        underBudget = 0;
+        return false;
+    }
+
+private:
+    bool change(float next) {
+        if (next == scale)
+            return false;
+
+        // Frames measured at the old scale say nothing about the new one
+        scale = next;
+        reset();
+        return true;
+    }
+};
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include "math.h"
+#include "texture.h"
+
+using namespace std;
+
+// Geometry is immutable once it is shared, every instance placing it only holds a reference
+typedef shared_ptr<const Mesh> MeshRef;
+
+struct Material {
+    Vec3d color = { 1.0f, 1.0f, 1.0f };
+
+    // Multiplied with color once it has finished loading, only the software rasterizer samples it
+    shared_ptr<Texture> texture;
+};
+
+enum class LightType { Point, Spot };
+
+// Local light with a hard range, angles are half angles of the spot cone in radians
+struct Light {
+    LightType type = LightType::Point;
+    Vec3d position;
+    Vec3d direction = { 0.0f, 0.0f, 1.0f, 0.0f };
+    Vec3d color = { 1.0f, 1.0f, 1.0f };
+    float intensity = 1.0f;
+    float range = 10.0f;
+    float innerAngle = 0.3f;
+    float outerAngle = 0.5f;
+};
+
+// A transform in the hierarchy, world = local * parent world. Parents always come before their
+// children in Scene::nodes, so a single pass in order sees every parent up to date first
+struct SceneNode {
+    static const size_t none = (size_t)-1;
+
+    size_t parent = none;
+    Mat4x4 local = Mat4x4::MakeIdentity();
+    Mat4x4 world = Mat4x4::MakeIdentity();
+    bool dirty = true;
+    bool changed = false; // World was recomputed in the current update pass
+
+    vector<size_t> instances;
+};
+
+struct MeshInstance {
+    MeshRef mesh;
+    Mat4x4 transform = Mat4x4::MakeIdentity(); // World transform, kept in sync with node when attached
+    Material material;
+    bool invisible = false;
+    size_t node = SceneNode::none;
+
+    // Scene version of the last change to this instance, lets the renderer keep what it built from it
+    uint64_t version = 0;
+
+    MeshInstance() = default;
+
+    MeshInstance(MeshRef mesh, Mat4x4 transform) : mesh(mesh), transform(transform) {}
+};
+
+// All instances that share one geometry, so the renderer can transform them back to back
+struct MeshBatch {
+    MeshRef mesh;
+    vector<size_t> instances;
+};
+
+// Instances should be changed through the setters or getInstance so the change is tracked.
+// Shared meshes never change, swapping the mesh of an instance counts as an instance change
+class Scene {
+    vector<MeshBatch> batches;
+    bool batchesDirty = true;
+    bool transformsDirty = false;
+
+    // Bumped on every change, the renderer compares it to skip frames where nothing happened
+    uint64_t version = 0;
+    uint64_t lightsVersion = 0;
+
+public:
+    vector<MeshRef> meshes;
+    vector<MeshInstance> instances;
+    vector<SceneNode> nodes;
+    vector<Light> lights;
+
+    // Compressed meshes take about a quarter of the memory for a bounded loss of precision, see Mesh::compress
+    MeshRef addMesh(Mesh mesh, bool compress = false) {
+        // Normals and clusters are baked here since the geometry can no longer change afterwards
+        mesh.computeNormals();
+        mesh.buildClusters();
+        mesh.computeBounds();
+        if (compress)
+            mesh.compress();
+
+        MeshRef ref = make_shared<const Mesh>(std::move(mesh));
+        meshes.push_back(ref);
+        return ref;
+    }
+
+    size_t addInstance(MeshRef mesh, Mat4x4 transform = Mat4x4::MakeIdentity()) {
+        instances.push_back(MeshInstance(mesh, transform));
+        batchesDirty = true;
+        touch(instances.size() - 1);
+        return instances.size() - 1;
+    }
+
+    // Instance whose transform follows a node of the hierarchy
+    size_t addInstanceAt(MeshRef mesh, size_t node) {
+        size_t index = addInstance(mesh, nodes[node].world);
+        attachInstance(index, node);
+        return index;
+    }
+
+    // The parent has to exist already, which keeps nodes in parent first order
+    size_t addNode(size_t parent = SceneNode::none, Mat4x4 local = Mat4x4::MakeIdentity()) {
+        SceneNode node;
+        node.parent = parent;
+        node.local = local;
+        nodes.push_back(node);
+
+        transformsDirty = true;
+        version++;
+        return nodes.size() - 1;
+    }
+
+    void setLocalTransform(size_t node, const Mat4x4& local) {
+        nodes[node].local = local;
+        nodes[node].dirty = true;
+
+        transformsDirty = true;
+        version++;
+    }
+
+    void attachInstance(size_t instance, size_t node) {
+        detachInstance(instance);
+
+        instances[instance].node = node;
+        nodes[node].instances.push_back(instance);
+        nodes[node].dirty = true;
+
+        transformsDirty = true;
+        touch(instance);
+    }
+
+    // The instance keeps its current world transform
+    void detachInstance(size_t instance) {
+        size_t node = instances[instance].node;
+        if (node == SceneNode::none) return;
+
+        auto& attached = nodes[node].instances;
+        attached.erase(remove(attached.begin(), attached.end(), instance), attached.end());
+        instances[instance].node = SceneNode::none;
+        touch(instance);
+    }
+
+    // Recompute the world matrices below every changed node and hand them to the attached instances.
+    // Costs nothing while the hierarchy stands still
+    void updateTransforms() {
+        if (!transformsDirty) return;
+
+        for (auto& node : nodes) {
+            if (node.parent != SceneNode::none && nodes[node.parent].changed)
+                node.dirty = true;
+
+            node.changed = node.dirty;
+            if (!node.dirty) continue;
+
+            node.world = node.parent == SceneNode::none ? node.local : Mat4x4::MultiplyMatrix(node.local, nodes[node.parent].world);
+            node.dirty = false;
+
+            for (size_t instance : node.instances) {
+                instances[instance].transform = node.world;
+                touch(instance);
+            }
+        }
+
+        transformsDirty = false;
+    }
+
+    // Mutable access, the instance is assumed changed
+    MeshInstance& getInstance(size_t index) {
+        batchesDirty = true;
+        touch(index);
+        return instances[index];
+    }
+
+    const MeshInstance& getInstance(size_t index) const {
+        return instances[index];
+    }
+
+    size_t getInstanceCount() const {
+        return instances.size();
+    }
+
+    // Triangles over all instances, shared meshes counted once per instance
+    uint64_t getTriangleCount() const {
+        uint64_t count = 0;
+        for (auto& instance : instances) {
+            if (instance.mesh)
+                count += instance.mesh->triangleCount();
+        }
+        return count;
+    }
+
+    // Instances attached to a node get overwritten by it on the next update
+    void setTransform(size_t index, const Mat4x4& transform) {
+        instances[index].transform = transform;
+        touch(index);
+    }
+
+    void setInvisible(size_t index, bool invisible) {
+        if (instances[index].invisible == invisible) return;
+
+        instances[index].invisible = invisible;
+        touch(index);
+    }
+
+    uint64_t getVersion() const {
+        return version;
+    }
+
+    size_t addLight(const Light& light) {
+        lights.push_back(light);
+        lightsVersion = ++version;
+        return lights.size() - 1;
+    }
+
+    // Mutable access, the light is assumed changed
+    Light& getLight(size_t index) {
+        lightsVersion = ++version;
+        return lights[index];
+    }
+
+    uint64_t getLightsVersion() const {
+        return lightsVersion;
+    }
+
+    const vector<MeshBatch>& getBatches() {
+        if (batchesDirty) {
+            buildBatches();
+        }
+        return batches;
+    }
+
+private:
+    void touch(size_t index) {
+        instances[index].version = ++version;
+    }
+
+    void buildBatches() {
+        unordered_map<const Mesh*, size_t> batchIndex;
+        batches.clear();
+
+        for (size_t i = 0; i < instances.size(); i++) {
+            const Mesh* mesh = instances[i].mesh.get();
+            if (!mesh) continue;
+
+            auto it = batchIndex.find(mesh);
+            if (it == batchIndex.end()) {
+                it = batchIndex.emplace(mesh, batches.size()).first;
+                batches.push_back({ instances[i].mesh, {} });
+            }
+            batches[it->second].instances.push_back(i);
+        }
+
+        batchesDirty = false;
+    }
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include "math.h"
+#include "scene.h"
+#include "texture.h"
+#include "heightfield.h"
+
+using namespace std;
+
+// Plain text scene description for offline rendering. One statement per line, # starts a comment:
+//   mesh <name> <file.obj> [scale <s>] [compress]
+//   box <name> <x0 y0 z0> <x1 y1 z1>
+//   heightfield <name> <image.ppm|image.tga> <spacing> <height> [compress]
+//   instance <mesh> [at <x y z>] [yaw <radians>] [color <r g b>] [texture <file.ppm|file.tga>]
+//   point <x y z> <r g b> <intensity> <range>
+//   spot <x y z> <dx dy dz> <r g b> <intensity> <range> <inner> <outer>
+//   sun <x y z>
+// The sun is a direction toward the light. A heightfield is a grid mesh, one point per pixel and
+// brighter is higher up to <height>. Files are relative to the scene file's directory
+struct SceneFile {
+    Vec3d sunDirection = { 0.0f, 1.0f, -1.0f };
+    string error; // What went wrong and on which line when load fails
+
+    // When set, textures decode on the loader's thread and load returns before they are done.
+    // Instances draw with their plain color until then, or for good if the file cannot be decoded
+    TextureLoader* textureLoader = nullptr;
+
+    bool load(const string& sFilename, Scene& scene) {
+        ifstream f(sFilename);
+        if (!f.is_open()) {
+            error = "cannot open " + sFilename;
+            return false;
+        }
+
+        size_t slash = sFilename.find_last_of("/\\");
+        string directory = slash == string::npos ? "" : sFilename.substr(0, slash + 1);
+
+        unordered_map<string, MeshRef> meshes;
+        unordered_map<string, shared_ptr<Texture>> textures;
+
+        string line;
+        int lineNumber = 0;
+        while (getline(f, line)) {
+            lineNumber++;
+            line = line.substr(0, line.find('#'));
+
+            istringstream s(line);
+            string statement;
+            if (!(s >> statement))
+                continue;
+
+            if (statement == "mesh") {
+                string name, file, option;
+                if (!(s >> name >> file))
+                    return fail(lineNumber, "expected mesh <name> <file>");
+
+                Mesh mesh;
+                if (!mesh.LoadFromObjectFile(resolve(directory, file)))
+                    return fail(lineNumber, "cannot load " + file);
+
+                bool compress = false;
+                while (s >> option) {
+                    float scale;
+                    if (option == "scale" && s >> scale)
+                        mesh.increaseSize(scale);
+                    else if (option == "compress")
+                        compress = true;
+                    else
+                        return fail(lineNumber, "unknown mesh option " + option);
+                }
+                meshes[name] = scene.addMesh(std::move(mesh), compress);
+            }
+            else if (statement == "box") {
+                string name;
+                Vec3d p1, p2;
+                if (!(s >> name) || !readVector(s, p1) || !readVector(s, p2))
+                    return fail(lineNumber, "expected box <name> <x0 y0 z0> <x1 y1 z1>");
+
+                Mesh mesh;
+                mesh.createCubeoid(p1, p2);
+                meshes[name] = scene.addMesh(std::move(mesh));
+            }
+            else if (statement == "heightfield") {
+                string name, file, option;
+                float spacing, height;
+                if (!(s >> name >> file >> spacing >> height))
+                    return fail(lineNumber, "expected heightfield <name> <image> <spacing> <height>");
+
+                Heightfield heightfield;
+                if (!heightfield.fromImage(resolve(directory, file), spacing, height))
+                    return fail(lineNumber, "cannot build a heightfield from " + file);
+
+                bool compress = false;
+                while (s >> option) {
+                    if (option == "compress")
+                        compress = true;
+                    else
+                        return fail(lineNumber, "unknown heightfield option " + option);
+                }
+                meshes[name] = scene.addMesh(heightfield.toMesh(), compress);
+            }
+            else if (statement == "instance") {
+                string name, option;
+                if (!(s >> name) || !meshes.count(name))
+                    return fail(lineNumber, "instance of unknown mesh " + name);
+
+                Vec3d position, color = { 1.0f, 1.0f, 1.0f };
+                float yaw = 0.0f;
+                shared_ptr<Texture> texture;
+                while (s >> option) {
+                    string file;
+                    if (option == "at" && readVector(s, position)) {}
+                    else if (option == "yaw" && s >> yaw) {}
+                    else if (option == "color" && readVector(s, color)) {}
+                    else if (option == "texture" && s >> file) {
+                        texture = loadTexture(resolve(directory, file), textures);
+                        if (!texture)
+                            return fail(lineNumber, "cannot load texture " + file);
+                    }
+                    else
+                        return fail(lineNumber, "bad instance option " + option);
+                }
+
+                size_t index = scene.addInstance(meshes[name], Mat4x4::MultiplyMatrix(Mat4x4::MakeRotationY(yaw), Mat4x4::MakeTranslation(position.x, position.y, position.z)));
+                scene.getInstance(index).material.color = color;
+                scene.getInstance(index).material.texture = texture;
+            }
+            else if (statement == "point" || statement == "spot") {
+                Light light;
+                light.type = statement == "point" ? LightType::Point : LightType::Spot;
+
+                bool ok = readVector(s, light.position);
+                if (light.type == LightType::Spot) {
+                    ok = ok && readVector(s, light.direction);
+                    light.direction = light.direction.normalize();
+                    light.direction.w = 0.0f;
+                }
+                ok = ok && readVector(s, light.color) && s >> light.intensity >> light.range;
+                if (light.type == LightType::Spot)
+                    ok = ok && s >> light.innerAngle >> light.outerAngle;
+
+                if (!ok)
+                    return fail(lineNumber, "incomplete " + statement + " light");
+                scene.addLight(light);
+            }
+            else if (statement == "sun") {
+                if (!readVector(s, sunDirection))
+                    return fail(lineNumber, "expected sun <x y z>");
+            }
+            else {
+                return fail(lineNumber, "unknown statement " + statement);
+            }
+        }
+
+        return true;
+    }
+
+private:
+    bool fail(int lineNumber, const string& message) {
+        error = "line " + to_string(lineNumber) + ": " + message;
+        return false;
+    }
+
+    static bool readVector(istringstream& s, Vec3d& v) {
+        return (bool)(s >> v.x >> v.y >> v.z);
+    }
+
+    static string resolve(const string& directory, const string& file) {
+        bool absolute = !file.empty() && (file[0] == '/' || file[0] == '\\' || (file.size() > 1 && file[1] == ':'));
+        return absolute ? file : directory + file;
+    }
+
+    // Without a loader decoded right away, an offline render has nothing better to do while it waits
+    shared_ptr<Texture> loadTexture(const string& sFilename, unordered_map<string, shared_ptr<Texture>>& textures) {
+        auto it = textures.find(sFilename);
+        if (it != textures.end())
+            return it->second;
+
+        if (textureLoader) {
+            shared_ptr<Texture> texture = textureLoader->load(sFilename);
+            textures[sFilename] = texture;
+            return texture;
+        }
+
+        int width = 0, height = 0;
+        vector<uint32_t> pixels;
+        if (!Texture::decode(sFilename, width, height, pixels))
+            return nullptr;
+
+        shared_ptr<Texture> texture = Texture::fromPixels(width, height, pixels);
+        textures[sFilename] = texture;
+        return texture;
+    }
+};
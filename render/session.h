@@ -0,0 +1,277 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include "math.h"
+#include "keyboard.h"
+
+using namespace std;
+
+// What a session starts from: the window, the camera, the renderer switches and every physics
+// body. The scene itself is rebuilt by the app, the counts only catch a log replayed against
+// different geometry
+struct SessionStart {
+    struct Body {
+        uint32_t instance = 0;
+        Vec3d position;
+        Vec3d velocity;
+    };
+
+    int32_t width = 0;
+    int32_t height = 0;
+    Vec3d cameraPosition;
+    float yaw = 0.0f;
+    float pitch = 0.0f;
+    bool rayTraced = false;
+    bool shadows = true;
+    Vec3d lightDirection;
+    uint32_t instanceCount = 0;
+    uint64_t triangleCount = 0;
+    vector<Body> bodies;
+};
+
+// One tick: its time step and the input it took, cursor movement already summed
+struct SessionFrame {
+    float elapsed = 0.0f;
+    Vec2f motion;
+    vector<InputEvent> events; // Keys and buttons only
+};
+
+// Binary session log, little endian as written by the machines we run on:
+//   "RSES" u32 version, the start state, then per tick
+//   f32 elapsed, u16 event count, u8 has motion, [f32 dx, f32 dy], per event u8 type, u8 action, u16 code
+// A tick without input is 7 bytes, a busy one rarely more than a few dozen
+class SessionRecorder {
+    ofstream f;
+
+public:
+    static const uint32_t version = 1;
+
+    bool open(const string& sFilename, const SessionStart& start) {
+        f.open(sFilename, ios::binary);
+        if (!f.is_open())
+            return false;
+
+        f.write("RSES", 4);
+        put(version);
+        put(start.width);
+        put(start.height);
+        putVector(start.cameraPosition);
+        put(start.yaw);
+        put(start.pitch);
+        put((uint8_t)start.rayTraced);
+        put((uint8_t)start.shadows);
+        putVector(start.lightDirection);
+        put(start.instanceCount);
+        put(start.triangleCount);
+        put((uint32_t)start.bodies.size());
+        for (auto& body : start.bodies) {
+            put(body.instance);
+            putVector(body.position);
+            putVector(body.velocity);
+        }
+        return f.good();
+    }
+
+    // events as processEvents handed them out, motion events are folded into one movement
+    void writeFrame(float elapsed, const vector<InputEvent>& events) {
+        Vec2f motion;
+        uint16_t count = 0;
+        for (auto& event : events) {
+            if (event.type == InputEvent::Motion)
+                motion = motion + event.delta;
+            else
+                count++;
+        }
+
+        bool hasMotion = motion.x != 0.0f || motion.y != 0.0f;
+        put(elapsed);
+        put(count);
+        put((uint8_t)hasMotion);
+        if (hasMotion) {
+            put(motion.x);
+            put(motion.y);
+        }
+        for (auto& event : events) {
+            if (event.type == InputEvent::Motion) continue;
+            put((uint8_t)event.type);
+            put((uint8_t)event.action);
+            put((uint16_t)event.code);
+        }
+    }
+
+    bool close() {
+        f.close();
+        return !f.fail();
+    }
+
+private:
+    template <typename T>
+    void put(T value) {
+        f.write((const char*)&value, sizeof(T));
+    }
+
+    void putVector(const Vec3d& v) {
+        put(v.x);
+        put(v.y);
+        put(v.z);
+    }
+};
+
+class SessionPlayer {
+    vector<uint8_t> data;
+    size_t offset = 0;
+    bool truncated = false;
+
+public:
+    SessionStart start;
+    string error;
+
+    bool open(const string& sFilename) {
+        ifstream f(sFilename, ios::binary);
+        if (!f.is_open()) {
+            error = "cannot open " + sFilename;
+            return false;
+        }
+        data.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+
+        if (data.size() < 8 || memcmp(data.data(), "RSES", 4) != 0) {
+            error = sFilename + " is not a session log";
+            return false;
+        }
+        offset = 4;
+        if (get<uint32_t>() != SessionRecorder::version) {
+            error = sFilename + " was written by another version";
+            return false;
+        }
+
+        start.width = get<int32_t>();
+        start.height = get<int32_t>();
+        start.cameraPosition = getVector();
+        start.yaw = get<float>();
+        start.pitch = get<float>();
+        start.rayTraced = get<uint8_t>() != 0;
+        start.shadows = get<uint8_t>() != 0;
+        start.lightDirection = getVector();
+        start.lightDirection.w = 0.0f;
+        start.instanceCount = get<uint32_t>();
+        start.triangleCount = get<uint64_t>();
+        uint32_t bodyCount = get<uint32_t>();
+        for (uint32_t i = 0; i < bodyCount && !truncated; i++) {
+            SessionStart::Body body;
+            body.instance = get<uint32_t>();
+            body.position = getVector();
+            body.velocity = getVector();
+            start.bodies.push_back(body);
+        }
+
+        if (truncated) {
+            error = sFilename + " ends inside its header";
+            return false;
+        }
+        return true;
+    }
+
+    // False at the end of the log. A tick cut off by a crash while recording ends it as well
+    bool nextFrame(SessionFrame& frame) {
+        if (offset >= data.size())
+            return false;
+
+        frame.elapsed = get<float>();
+        uint16_t count = get<uint16_t>();
+        frame.motion = Vec2f();
+        if (get<uint8_t>() != 0) {
+            frame.motion.x = get<float>();
+            frame.motion.y = get<float>();
+        }
+
+        frame.events.resize(count);
+        for (auto& event : frame.events) {
+            event.type = (InputEvent::Type)get<uint8_t>();
+            event.action = get<uint8_t>();
+            event.code = get<uint16_t>();
+        }
+        return !truncated;
+    }
+
+private:
+    template <typename T>
+    T get() {
+        T value{};
+        if (offset + sizeof(T) > data.size()) {
+            truncated = true;
+            offset = data.size();
+            return value;
+        }
+        memcpy(&value, &data[offset], sizeof(T));
+        offset += sizeof(T);
+        return value;
+    }
+
+    Vec3d getVector() {
+        Vec3d v;
+        v.x = get<float>();
+        v.y = get<float>();
+        v.z = get<float>();
+        return v;
+    }
+};
+
+// Per frame times of a replay with a summary of the spread and where the slowest frames were.
+// Frames are numbered by their tick in the log, so a slow one can be found again
+class FrameTimings {
+    vector<size_t> ticks;
+    vector<double> milliseconds;
+
+public:
+    void add(size_t tick, double ms) {
+        ticks.push_back(tick);
+        milliseconds.push_back(ms);
+    }
+
+    void report() const {
+        if (milliseconds.empty()) {
+            printf("No frames were timed\n");
+            return;
+        }
+
+        vector<double> sorted = milliseconds;
+        sort(sorted.begin(), sorted.end());
+        auto percentile = [&](double p) { return sorted[min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5))]; };
+
+        double total = 0.0;
+        for (double ms : milliseconds)
+            total += ms;
+
+        printf("%zu frame(s), %.3f ms mean, %.3f ms median, %.3f ms p95, %.3f ms p99, %.3f ms max\n",
+            milliseconds.size(), total / milliseconds.size(), percentile(0.5), percentile(0.95), percentile(0.99), sorted.back());
+
+        vector<size_t> order(milliseconds.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        size_t shown = min(order.size(), (size_t)5);
+        partial_sort(order.begin(), order.begin() + shown, order.end(), [&](size_t a, size_t b) { return milliseconds[a] > milliseconds[b]; });
+
+        printf("Slowest ticks:");
+        for (size_t i = 0; i < shown; i++)
+            printf(" %zu (%.3f ms)", ticks[order[i]], milliseconds[order[i]]);
+        printf("\n");
+    }
+
+    // tick,ms per line for plotting
+    bool save(const string& sFilename) const {
+        ofstream f(sFilename);
+        if (!f.is_open())
+            return false;
+
+        f << "tick,ms\n";
+        for (size_t i = 0; i < milliseconds.size(); i++)
+            f << ticks[i] << "," << milliseconds[i] << "\n";
+        return f.good();
+    }
+};
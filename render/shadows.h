@@ -0,0 +1,213 @@
+#pragma once
+
+#include <vector>
+#include <future>
+#include <cstdint>
+#include "math.h"
+#include "scene.h"
+#include "framebuffer.h"
+#include "rasterizer.h"
+
+using namespace std;
+
+// Cascaded shadow maps for the directional light, depth rendered with the software rasterizer.
+// Every cascade is a square in light space around the viewer, each one four times wider than
+// the one before. Centers snap to a quarter of the cascade width, so a map stays valid while the
+// viewer moves inside its snap cell and is only rendered again when it leaves it, the light
+// turns or the scene changes. Stale cascades render on worker threads between begin and finish
+class ShadowCascades {
+public:
+    static const int cascadeCount = 3;
+    static const int mapSize = 1024;
+
+    struct Cascade {
+        float radius = 0.0f;
+        Framebuffer map;
+
+        // World position to (map x, map y, depth), depth is 0 at the light and 1 at the far end of the scene
+        Mat4x4 worldToMap;
+        float texelWorld = 0.0f;
+        float depthScale = 0.0f;
+
+        // What the map was rendered for
+        bool valid = false;
+        float centerX = 0.0f;
+        float centerY = 0.0f;
+        uint64_t sceneVersion = 0;
+        Vec3d lightDirection;
+    };
+
+private:
+    Cascade cascades[cascadeCount];
+    vector<future<void>> pending;
+
+public:
+    ShadowCascades() {
+        float radius = 12.0f;
+        for (auto& cascade : cascades) {
+            cascade.radius = radius;
+            cascade.map.resizeDepth(mapSize, mapSize);
+            radius *= 4.0f;
+        }
+    }
+
+    ~ShadowCascades() {
+        finish();
+    }
+
+    // Returns whether any cascade is rendered again, shading that used the old maps is then stale.
+    // The scene must not change until finish
+    bool begin(const Scene& scene, const Vec3d& lightDirection, const Vec3d& viewer) {
+        finish();
+
+        // The light travels against lightDirection, build a basis looking along it
+        Vec3d forward = (lightDirection * -1.0f).normalizeOr({ 0.0f, -1.0f, 0.0f });
+        Vec3d upHint = fabsf(forward.y) < 0.99f ? Vec3d(0.0f, 1.0f, 0.0f) : Vec3d(1.0f, 0.0f, 0.0f);
+        Vec3d right = upHint.cross(forward).normalize();
+        Vec3d up = forward.cross(right);
+
+        float viewerX = viewer.dot(right);
+        float viewerY = viewer.dot(up);
+
+        bool depthRangeKnown = false;
+        float depthMin = 0.0f, depthMax = 1.0f;
+        bool changed = false;
+
+        for (int i = 0; i < cascadeCount; i++) {
+            Cascade& cascade = cascades[i];
+
+            float snap = cascade.radius * 0.5f;
+            float centerX = roundf(viewerX / snap) * snap;
+            float centerY = roundf(viewerY / snap) * snap;
+
+            bool sameLight = cascade.lightDirection.x == lightDirection.x && cascade.lightDirection.y == lightDirection.y && cascade.lightDirection.z == lightDirection.z;
+            if (cascade.valid && sameLight && cascade.sceneVersion == scene.getVersion() && cascade.centerX == centerX && cascade.centerY == centerY)
+                continue;
+
+            if (!depthRangeKnown) {
+                sceneDepthRange(scene, forward, depthMin, depthMax);
+                depthRangeKnown = true;
+            }
+
+            cascade.valid = true;
+            cascade.centerX = centerX;
+            cascade.centerY = centerY;
+            cascade.sceneVersion = scene.getVersion();
+            cascade.lightDirection = lightDirection;
+
+            float scale = mapSize / (2.0f * cascade.radius);
+            cascade.texelWorld = 1.0f / scale;
+            cascade.depthScale = 1.0f / (depthMax - depthMin);
+
+            Mat4x4& m = cascade.worldToMap;
+            m = Mat4x4::MakeIdentity();
+            for (int k = 0; k < 3; k++) {
+                m.m[k][0] = (&right.x)[k] * scale;
+                m.m[k][1] = (&up.x)[k] * scale;
+                m.m[k][2] = (&forward.x)[k] * cascade.depthScale;
+            }
+            m.m[3][0] = -(centerX - cascade.radius) * scale;
+            m.m[3][1] = -(centerY - cascade.radius) * scale;
+            m.m[3][2] = -depthMin * cascade.depthScale;
+
+            pending.push_back(async(launch::async, [this, &scene, i]() { render(cascades[i], scene); }));
+            changed = true;
+        }
+
+        return changed;
+    }
+
+    void finish() {
+        for (auto& job : pending)
+            job.get();
+        pending.clear();
+    }
+
+    // Lit fraction of a world point from a 3x3 percentage closer filter in the smallest cascade
+    // covering it. The point is pushed out along its normal by a texel or two to avoid acne
+    float visibility(const Vec3d& point, const Vec3d& normal) const {
+        for (auto& cascade : cascades) {
+            if (!cascade.valid) continue;
+
+            Vec3d offset = point + normal * (cascade.texelWorld * 1.5f);
+            Vec3d p = Mat4x4::MultiplyVector(cascade.worldToMap, offset);
+            if (p.x < 2.0f || p.y < 2.0f || p.x >= mapSize - 2 || p.y >= mapSize - 2)
+                continue;
+
+            float depth = p.z - cascade.texelWorld * cascade.depthScale;
+            int tx = (int)p.x, ty = (int)p.y;
+
+            int lit = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                const float* row = &cascade.map.depth[(size_t)(ty + dy) * mapSize + tx];
+                lit += (depth <= row[-1]) + (depth <= row[0]) + (depth <= row[1]);
+            }
+            return lit * (1.0f / 9.0f);
+        }
+
+        return 1.0f;
+    }
+
+private:
+    static void sceneDepthRange(const Scene& scene, const Vec3d& forward, float& depthMin, float& depthMax) {
+        depthMin = 1e30f;
+        depthMax = -1e30f;
+
+        for (auto& instance : scene.instances) {
+            if (!instance.mesh || instance.invisible) continue;
+
+            for (int corner = 0; corner < 8; corner++) {
+                Vec3d p = {
+                    corner & 1 ? instance.mesh->boundsMax.x : instance.mesh->boundsMin.x,
+                    corner & 2 ? instance.mesh->boundsMax.y : instance.mesh->boundsMin.y,
+                    corner & 4 ? instance.mesh->boundsMax.z : instance.mesh->boundsMin.z,
+                };
+                float d = Mat4x4::MultiplyVector(instance.transform, p).dot(forward);
+                depthMin = min(depthMin, d);
+                depthMax = max(depthMax, d);
+            }
+        }
+
+        // Keep a margin so the nearest and farthest surfaces are not on the clear value
+        if (depthMin > depthMax) {
+            depthMin = 0.0f;
+            depthMax = 1.0f;
+        }
+        float margin = max((depthMax - depthMin) * 0.01f, 0.01f);
+        depthMin -= margin;
+        depthMax += margin;
+    }
+
+    static void render(Cascade& cascade, const Scene& scene) {
+        cascade.map.clear(0, 1.0f);
+
+        Vec3d transformed[3];
+        for (auto& instance : scene.instances) {
+            if (!instance.mesh || instance.invisible) continue;
+
+            Mat4x4 toMap = Mat4x4::MultiplyMatrix(instance.transform, cascade.worldToMap);
+
+            // Instances entirely beside the map are skipped without touching their triangles
+            float minX = 1e30f, maxX = -1e30f, minY = 1e30f, maxY = -1e30f;
+            for (int corner = 0; corner < 8; corner++) {
+                Vec3d p = Mat4x4::MultiplyVector(toMap, {
+                    corner & 1 ? instance.mesh->boundsMax.x : instance.mesh->boundsMin.x,
+                    corner & 2 ? instance.mesh->boundsMax.y : instance.mesh->boundsMin.y,
+                    corner & 4 ? instance.mesh->boundsMax.z : instance.mesh->boundsMin.z,
+                });
+                minX = min(minX, p.x); maxX = max(maxX, p.x);
+                minY = min(minY, p.y); maxY = max(maxY, p.y);
+            }
+            if (maxX < 0.0f || maxY < 0.0f || minX >= mapSize || minY >= mapSize)
+                continue;
+
+            // Both sides are drawn, closed meshes then shadow themselves without a front face bias
+            const Mesh& mesh = *instance.mesh;
+            Mat4x4 transform = mesh.positionTransform(toMap);
+            for (size_t t = 0; t < mesh.triangleCount(); t++) {
+                mesh.transformTriangle(t, transform, transformed);
+                Rasterizer::drawTriangle(cascade.map, transformed[0], transformed[1], transformed[2], 0);
+            }
+        }
+    }
+};
@@ -0,0 +1,343 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <cstdint>
+#include <algorithm>
+#include "math.h"
+
+using namespace std;
+
+// RGBA8 texture with a full mip chain. Every level is a power of two and stored in Morton
+// (Z) order, so the 2x2 footprint of a bilinear fetch and neighbouring pixels of a triangle
+// mostly land in the same cache lines whatever direction the texture is walked in
+class Texture {
+public:
+    struct Level {
+        int width = 0;
+        int height = 0;
+        int log2Width = 0;
+        int log2Height = 0;
+        vector<uint32_t> texels;
+    };
+
+    vector<Level> levels;
+
+    // Set by the loader once levels are complete, the renderer draws untextured until then
+    atomic<bool> ready{ false };
+    atomic<bool> failed{ false };
+
+    // Build the texture from rows of RGBA8 pixels, top row first
+    void build(int width, int height, const vector<uint32_t>& pixels) {
+        levels.clear();
+
+        Level base;
+        base.log2Width = ceilLog2(width);
+        base.log2Height = ceilLog2(height);
+        base.width = 1 << base.log2Width;
+        base.height = 1 << base.log2Height;
+        base.texels.resize((size_t)base.width * base.height);
+
+        // Nearest resample up to the power of two size
+        for (int y = 0; y < base.height; y++) {
+            int sy = y * height / base.height;
+            for (int x = 0; x < base.width; x++) {
+                int sx = x * width / base.width;
+                base.texels[swizzle(base, x, y)] = pixels[(size_t)sy * width + sx];
+            }
+        }
+        levels.push_back(std::move(base));
+
+        // Box filter each level down to 1x1
+        while (levels.back().width > 1 || levels.back().height > 1) {
+            const Level& src = levels.back();
+            Level dst;
+            dst.log2Width = max(0, src.log2Width - 1);
+            dst.log2Height = max(0, src.log2Height - 1);
+            dst.width = 1 << dst.log2Width;
+            dst.height = 1 << dst.log2Height;
+            dst.texels.resize((size_t)dst.width * dst.height);
+
+            for (int y = 0; y < dst.height; y++) {
+                for (int x = 0; x < dst.width; x++) {
+                    int x0 = min(x * 2, src.width - 1), x1 = min(x * 2 + 1, src.width - 1);
+                    int y0 = min(y * 2, src.height - 1), y1 = min(y * 2 + 1, src.height - 1);
+                    uint32_t c[4] = { fetch(src, x0, y0), fetch(src, x1, y0), fetch(src, x0, y1), fetch(src, x1, y1) };
+
+                    uint32_t result = 0;
+                    for (int shift = 0; shift < 32; shift += 8) {
+                        uint32_t sum = 0;
+                        for (auto texel : c)
+                            sum += (texel >> shift) & 0xFF;
+                        result |= ((sum + 2) / 4) << shift;
+                    }
+                    dst.texels[swizzle(dst, x, y)] = result;
+                }
+            }
+            levels.push_back(std::move(dst));
+        }
+    }
+
+    // A texture built on the calling thread from pixels already in memory, ready right away
+    static shared_ptr<Texture> fromPixels(int width, int height, const vector<uint32_t>& pixels) {
+        auto texture = make_shared<Texture>();
+        texture->build(width, height, pixels);
+        texture->ready.store(true, memory_order_release);
+        return texture;
+    }
+
+    // Trilinear sample with wrapping coordinates, lod is log2 of texels per pixel on the base level
+    Vec3d sample(float u, float v, float lod) const {
+        float maxLevel = (float)(levels.size() - 1);
+        lod = min(max(lod, 0.0f), maxLevel);
+
+        int level = (int)lod;
+        float blend = lod - level;
+
+        Vec3d color = sampleBilinear(levels[level], u, v);
+        if (blend > 0.0f && level + 1 < (int)levels.size())
+            color = color * (1.0f - blend) + sampleBilinear(levels[level + 1], u, v) * blend;
+        return color;
+    }
+
+    int baseWidth() const { return levels.empty() ? 0 : levels[0].width; }
+    int baseHeight() const { return levels.empty() ? 0 : levels[0].height; }
+
+    // Binary P6 PPM or uncompressed/RLE 24 and 32 bit TGA, picked by extension
+    static bool decode(const string& sFilename, int& width, int& height, vector<uint32_t>& pixels) {
+        string extension = sFilename.size() >= 4 ? sFilename.substr(sFilename.size() - 4) : "";
+        transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+        if (extension == ".tga")
+            return decodeTGA(sFilename, width, height, pixels);
+        return decodePPM(sFilename, width, height, pixels);
+    }
+
+private:
+    static int ceilLog2(int value) {
+        int log = 0;
+        while ((1 << log) < value)
+            log++;
+        return log;
+    }
+
+    // Spread the low 16 bits so a zero sits between every bit
+    static uint32_t spreadBits(uint32_t v) {
+        v &= 0x0000FFFF;
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    }
+
+    // Morton order inside squares of the smaller side, the squares themselves follow each other
+    static size_t swizzle(const Level& level, int x, int y) {
+        int log2Square = min(level.log2Width, level.log2Height);
+        uint32_t mask = (1u << log2Square) - 1;
+        size_t square = (size_t)((x >> log2Square) + (y >> log2Square)) << (2 * log2Square);
+        return square + (spreadBits(x & mask) | (spreadBits(y & mask) << 1));
+    }
+
+    static uint32_t fetch(const Level& level, int x, int y) {
+        return level.texels[swizzle(level, x, y)];
+    }
+
+    static Vec3d unpack(uint32_t c) {
+        const float scale = 1.0f / 255.0f;
+        return Vec3d((c & 0xFF) * scale, ((c >> 8) & 0xFF) * scale, ((c >> 16) & 0xFF) * scale);
+    }
+
+    static Vec3d sampleBilinear(const Level& level, float u, float v) {
+        float x = u * level.width - 0.5f;
+        float y = v * level.height - 0.5f;
+        float fx = floorf(x), fy = floorf(y);
+        float tx = x - fx, ty = y - fy;
+
+        int x0 = (int)fx & (level.width - 1), x1 = (x0 + 1) & (level.width - 1);
+        int y0 = (int)fy & (level.height - 1), y1 = (y0 + 1) & (level.height - 1);
+
+        Vec3d top = unpack(fetch(level, x0, y0)) * (1.0f - tx) + unpack(fetch(level, x1, y0)) * tx;
+        Vec3d bottom = unpack(fetch(level, x0, y1)) * (1.0f - tx) + unpack(fetch(level, x1, y1)) * tx;
+        return top * (1.0f - ty) + bottom * ty;
+    }
+
+    static void skipComments(ifstream& f) {
+        f >> ws;
+        while (f.peek() == '#') {
+            string comment;
+            getline(f, comment);
+            f >> ws;
+        }
+    }
+
+    static bool decodePPM(const string& sFilename, int& width, int& height, vector<uint32_t>& pixels) {
+        ifstream f(sFilename, ios::binary);
+        if (!f.is_open())
+            return false;
+
+        string magic;
+        int maxValue = 0;
+        f >> magic;
+        skipComments(f); f >> width;
+        skipComments(f); f >> height;
+        skipComments(f); f >> maxValue;
+        f.get();
+
+        if (magic != "P6" || width <= 0 || height <= 0 || maxValue != 255)
+            return false;
+
+        vector<uint8_t> rgb((size_t)width * height * 3);
+        if (!f.read((char*)rgb.data(), rgb.size()))
+            return false;
+
+        pixels.resize((size_t)width * height);
+        for (size_t i = 0; i < pixels.size(); i++)
+            pixels[i] = rgb[i * 3] | (rgb[i * 3 + 1] << 8) | (rgb[i * 3 + 2] << 16) | 0xFF000000u;
+        return true;
+    }
+
+    static bool decodeTGA(const string& sFilename, int& width, int& height, vector<uint32_t>& pixels) {
+        ifstream f(sFilename, ios::binary);
+        if (!f.is_open())
+            return false;
+
+        uint8_t header[18];
+        if (!f.read((char*)header, sizeof(header)))
+            return false;
+
+        int imageType = header[2];
+        width = header[12] | (header[13] << 8);
+        height = header[14] | (header[15] << 8);
+        int bytesPerPixel = header[16] / 8;
+        bool topDown = (header[17] & 0x20) != 0;
+
+        if ((imageType != 2 && imageType != 10) || (bytesPerPixel != 3 && bytesPerPixel != 4) || width <= 0 || height <= 0)
+            return false;
+
+        f.seekg(header[0], ios::cur); // Image ID
+
+        vector<uint8_t> bgra((size_t)width * height * bytesPerPixel);
+        if (imageType == 2) {
+            if (!f.read((char*)bgra.data(), bgra.size()))
+                return false;
+        }
+        else {
+            // Run length encoded packets
+            size_t offset = 0;
+            while (offset < bgra.size()) {
+                int packet = f.get();
+                if (packet == EOF)
+                    return false;
+
+                int count = (packet & 0x7F) + 1;
+                if (offset + (size_t)count * bytesPerPixel > bgra.size())
+                    return false;
+
+                if (packet & 0x80) {
+                    uint8_t value[4];
+                    if (!f.read((char*)value, bytesPerPixel))
+                        return false;
+                    for (int i = 0; i < count; i++, offset += bytesPerPixel)
+                        copy(value, value + bytesPerPixel, bgra.begin() + offset);
+                }
+                else {
+                    if (!f.read((char*)&bgra[offset], (size_t)count * bytesPerPixel))
+                        return false;
+                    offset += (size_t)count * bytesPerPixel;
+                }
+            }
+        }
+
+        pixels.resize((size_t)width * height);
+        for (int y = 0; y < height; y++) {
+            int srcY = topDown ? y : height - 1 - y;
+            for (int x = 0; x < width; x++) {
+                const uint8_t* p = &bgra[((size_t)srcY * width + x) * bytesPerPixel];
+                uint32_t alpha = bytesPerPixel == 4 ? p[3] : 0xFF;
+                pixels[(size_t)y * width + x] = p[2] | (p[1] << 8) | (p[0] << 16) | (alpha << 24);
+            }
+        }
+        return true;
+    }
+};
+
+// Decodes textures on a background thread so loading never stalls the render loop
+class TextureLoader {
+    struct Request {
+        string path;
+        shared_ptr<Texture> texture;
+    };
+
+    thread worker;
+    mutex queueMutex;
+    condition_variable queueChanged;
+    deque<Request> queue;
+    bool stopping = false;
+
+public:
+    TextureLoader() {
+        worker = thread([this] { run(); });
+    }
+
+    ~TextureLoader() {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueChanged.notify_one();
+        worker.join();
+    }
+
+    TextureLoader(const TextureLoader&) = delete;
+    TextureLoader& operator=(const TextureLoader&) = delete;
+
+    // Returns at once, the texture reports ready or failed when decoding is done
+    shared_ptr<Texture> load(const string& path) {
+        auto texture = make_shared<Texture>();
+        {
+            lock_guard<mutex> lock(queueMutex);
+            queue.push_back({ path, texture });
+        }
+        queueChanged.notify_one();
+        return texture;
+    }
+
+private:
+    void run() {
+        while (true) {
+            Request request;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                queueChanged.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping) {
+                    // Nothing will decode what is left, waiting renderers fall back to the plain color
+                    for (auto& pending : queue)
+                        pending.texture->failed.store(true, memory_order_release);
+                    queue.clear();
+                    return;
+                }
+
+                request = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            int width = 0, height = 0;
+            vector<uint32_t> pixels;
+            if (Texture::decode(request.path, width, height, pixels)) {
+                request.texture->build(width, height, pixels);
+                request.texture->ready.store(true, memory_order_release);
+            }
+            else {
+                request.texture->failed.store(true, memory_order_release);
+            }
+        }
+    }
+};